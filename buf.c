@@ -7,6 +7,8 @@ bufput(struct buf *b, const void *data, size_t len)
 {
     assert(b && b->unit);
 
+    if (!len)
+        return;
     if (b->size + len > b->asize && buf_grow(b, b->size + len) < 0)
         return;
 
@@ -69,6 +71,15 @@ buf_append_chars(struct buf *b, const char *s)
     bufput(b, s, strlen(s));
 }
 
+/*!
+ *  Appends \a len bytes of \a data, which need not be a string.
+ */
+void
+buf_append(struct buf *b, const void *data, size_t len)
+{
+    bufput(b, data, len);
+}
+
 /*!
  *  Null-terminates the buffer (i.e., appends a '\0' to the buffer's data).
  */
@@ -43,20 +43,143 @@
  *  \brief Search operator node.
  */
 
+/*!
+ *  \struct node_arena
+ *
+ *  \brief A region allocator for node trees.
+ *
+ *  Nodes created in an arena are carved out of large blocks, with the node
+ *  specific data placed right after the node itself, and are released all at
+ *  once by node_arena_destroy(). They must not be passed to node_destroy().
+ */
+
+/*
+ *  Alignment of every allocation handed out by an arena.
+ */
+#define ARENA_ALIGN sizeof(void *)
+
+static struct node_arena_block *
+arena_block_new(size_t size)
+{
+    struct node_arena_block *b;
+    b = malloc(sizeof(struct node_arena_block) + size);
+    if (b) {
+        b->next = NULL;
+        b->size = size;
+        b->used = 0;
+    }
+    return b;
+}
+
+/*!
+ *  Creates a new arena that allocates memory in blocks of \a block_size bytes,
+ *  or NODE_ARENA_BLOCK_SIZE bytes if \a block_size is 0.
+ */
+struct node_arena *
+node_arena_new(size_t block_size)
+{
+    struct node_arena *arena;
+    arena = malloc(sizeof(struct node_arena));
+    if (arena) {
+        arena->blocks = NULL;
+        arena->block_size = block_size ? block_size : NODE_ARENA_BLOCK_SIZE;
+    }
+    return arena;
+}
+
+/*!
+ *  Destroys the arena together with every node allocated from it.
+ */
+void
+node_arena_destroy(struct node_arena *arena)
+{
+    struct node_arena_block *b, *next;
+
+    if (!arena)
+        return;
+
+    b = arena->blocks;
+    while (b) {
+        next = b->next;
+        free(b);
+        b = next;
+    }
+    free(arena);
+}
+
+/*!
+ *  Allocates \a size bytes from the arena. Requests larger than the block size
+ *  get a block of their own.
+ */
+void *
+node_arena_alloc(struct node_arena *arena, size_t size)
+{
+    struct node_arena_block *b;
+    void *p;
+
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    b = arena->blocks;
+    if (!b || b->used + size > b->size) {
+        if (size > arena->block_size) {
+            /*
+             *  Keep the current block in front, it still has room.
+             */
+            if (!(b = arena_block_new(size)))
+                return NULL;
+            if (arena->blocks) {
+                b->next = arena->blocks->next;
+                arena->blocks->next = b;
+            } else {
+                arena->blocks = b;
+            }
+            b->used = size;
+            return b->data;
+        }
+        if (!(b = arena_block_new(arena->block_size)))
+            return NULL;
+        b->next = arena->blocks;
+        arena->blocks = b;
+    }
+    p = b->data + b->used;
+    b->used += size;
+    return p;
+}
+
+/*
+ *  Allocates a node of the given type together with size bytes of node
+ *  specific data, either from the arena or, if it is NULL, from the heap.
+ */
+static struct node *
+node_new(struct node_arena *arena, uint8_t type, size_t size)
+{
+    struct node *n;
+
+    if (arena) {
+        n = node_arena_alloc(arena, sizeof(struct node) + size);
+        if (!n)
+            return NULL;
+        n->data = size ? (void *) (n + 1) : NULL;
+        n->flags = NODE_FLAG_ARENA;
+    } else {
+        n = malloc(sizeof(struct node));
+        if (!n)
+            return NULL;
+        n->data = size ? malloc(size) : NULL;
+        n->flags = 0;
+    }
+    n->type = type;
+    n->arity = 0;
+    n->refs = 0;
+    return n;
+}
+
 /*!
  *  Creates a new projection function node.
  */
 struct node *
 projection_node_new(int place)
 {
-    struct node *n;
-    struct node_projection *proj;
-    n = malloc(sizeof(struct node));
-    proj = malloc(sizeof(struct node_projection));
-    n->type = NODE_PROJECTION;
-    proj->place = place;
-    n->data = proj;
-    return n;
+    return projection_node_arena_new(NULL, place);
 }
 
 /*!
@@ -65,11 +188,7 @@ projection_node_new(int place)
 struct node *
 zero_node_new()
 {
-    struct node *n;
-    n = malloc(sizeof(struct node));
-    n->data = NULL;
-    n->type = NODE_ZERO;
-    return n;
+    return zero_node_arena_new(NULL);
 }
 
 /*!
@@ -78,11 +197,7 @@ zero_node_new()
 struct node *
 successor_node_new()
 {
-    struct node *n;
-    n = malloc(sizeof(struct node));
-    n->data = NULL;
-    n->type = NODE_SUCCESSOR;
-    return n;
+    return successor_node_arena_new(NULL);
 }
 
 /*!
@@ -93,15 +208,104 @@ successor_node_new()
  */
 struct node *
 composition_node_new(struct node *f, struct node **g)
+{
+    return composition_node_arena_new(NULL, f, g);
+}
+
+/*!
+ *  Creates a new recursion node.
+ */
+struct node *
+recursion_node_new(struct node *f, struct node *g)
+{
+    return recursion_node_arena_new(NULL, f, g);
+}
+
+/*!
+ *  Creates a new search node (the μ-operator).
+ */
+struct node *
+search_node_new(struct node *p)
+{
+    return search_node_arena_new(NULL, p);
+}
+
+struct node *invalid_node_new()
+{
+    return invalid_node_arena_new(NULL);
+}
+
+/*!
+ *  Creates a new kernel node, see node_kernel_compute(). The node takes over
+ *  the tree kernel->orig.
+ */
+struct node *
+kernel_node_new(const struct node_kernel *kernel)
+{
+    return kernel_node_arena_new(NULL, kernel);
+}
+
+/*!
+ *  Creates a new node that evaluates to \a value for any arguments, or to -1
+ *  if value is negative. It is a KERNEL_VALUE kernel without an original
+ *  tree, and serializes as a chain of successors.
+ */
+struct node *
+constant_node_new(int value)
+{
+    return constant_node_arena_new(NULL, value);
+}
+
+struct node *
+node_clone(struct node *n)
+{
+    return node_arena_clone(NULL, n);
+}
+
+/*!
+ *  Creates a new projection function node in \a arena. The arena variants of
+ *  the node constructors allocate from the heap if \a arena is NULL.
+ */
+struct node *
+projection_node_arena_new(struct node_arena *arena, int place)
+{
+    struct node *n;
+    n = node_new(arena, NODE_PROJECTION, sizeof(struct node_projection));
+    ((struct node_projection *) n->data)->place = place;
+    return n;
+}
+
+/*!
+ *  Creates a new zero function node in \a arena.
+ */
+struct node *
+zero_node_arena_new(struct node_arena *arena)
+{
+    return node_new(arena, NODE_ZERO, 0);
+}
+
+/*!
+ *  Creates a new successor function node in \a arena.
+ */
+struct node *
+successor_node_arena_new(struct node_arena *arena)
+{
+    return node_new(arena, NODE_SUCCESSOR, 0);
+}
+
+/*!
+ *  Creates a new composition node in \a arena. The NULL terminated array
+ *  \a g should come from node_arena_array_new() on the same arena.
+ */
+struct node *
+composition_node_arena_new(struct node_arena *arena, struct node *f, struct node **g)
 {
     struct node *n, *d;
     struct node_composition *comp;
-    n = malloc(sizeof(struct node));
-    comp = malloc(sizeof(struct node_composition));
-    n->type = NODE_COMPOSITION;
+    n = node_new(arena, NODE_COMPOSITION, sizeof(struct node_composition));
+    comp = (struct node_composition *) n->data;
     comp->f = f;
     comp->g = g;
-    n->data = comp;
     while (g && (d = *g))
         ++g;
     comp->places = (g - comp->g);
@@ -109,49 +313,88 @@ composition_node_new(struct node *f, struct node **g)
 }
 
 /*!
- *  Creates a new recursion node.
+ *  Creates a new recursion node in \a arena.
  */
 struct node *
-recursion_node_new(struct node *f, struct node *g)
+recursion_node_arena_new(struct node_arena *arena, struct node *f, struct node *g)
 {
     struct node *n;
     struct node_recursion *rec;
-    n = malloc(sizeof(struct node));
-    rec = malloc(sizeof(struct node_recursion));
-    n->type = NODE_RECURSION;
+    n = node_new(arena, NODE_RECURSION, sizeof(struct node_recursion));
+    rec = (struct node_recursion *) n->data;
     rec->f = f;
     rec->g = g;
-    n->data = rec;
     return n;
 }
 
 /*!
- *  Creates a new search node (the μ-operator).
+ *  Creates a new search node in \a arena.
  */
 struct node *
-search_node_new(struct node *p)
+search_node_arena_new(struct node_arena *arena, struct node *p)
 {
     struct node *n;
-    struct node_search *search;
-    n = malloc(sizeof(struct node));
-    search = malloc(sizeof(struct node_search));
-    n->type = NODE_SEARCH;
-    search->p = p;
-    n->data = search;
+    n = node_new(arena, NODE_SEARCH, sizeof(struct node_search));
+    ((struct node_search *) n->data)->p = p;
     return n;
 }
 
-struct node *invalid_node_new()
+struct node *
+invalid_node_arena_new(struct node_arena *arena)
+{
+    return node_new(arena, NODE_INVALID, 0);
+}
+
+/*!
+ *  Creates a new kernel node in \a arena.
+ */
+struct node *
+kernel_node_arena_new(struct node_arena *arena, const struct node_kernel *kernel)
 {
     struct node *n;
-    n = malloc(sizeof(struct node));
-    n->data = NULL;
-    n->type = NODE_INVALID;
+    n = node_new(arena, NODE_KERNEL, sizeof(struct node_kernel));
+    *((struct node_kernel *) n->data) = *kernel;
     return n;
 }
 
+/*!
+ *  Creates a new constant node in \a arena.
+ */
 struct node *
-node_clone(struct node *n)
+constant_node_arena_new(struct node_arena *arena, int value)
+{
+    struct node_kernel kernel;
+
+    kernel.op = KERNEL_VALUE;
+    kernel.arity = -1;
+    kernel.need = 0;
+    kernel.a.place = -1;
+    kernel.a.offset = value < 0 ? -1 : value;
+    kernel.b = kernel.a;
+    kernel.orig = NULL;
+    return kernel_node_arena_new(arena, &kernel);
+}
+
+/*!
+ *  Allocates a new, zero filled node array with \a e elements in \a arena.
+ */
+struct node **
+node_arena_array_new(struct node_arena *arena, size_t e)
+{
+    struct node **g;
+    if (!arena)
+        return node_array_new(e);
+    if ((g = node_arena_alloc(arena, e * sizeof(struct node *))))
+        memset(g, 0, e * sizeof(struct node *));
+    return g;
+}
+
+/*!
+ *  Creates a deep copy of \a n in \a arena, so that a whole tree can be
+ *  gathered into one contiguous region and later released in one call.
+ */
+struct node *
+node_arena_clone(struct node_arena *arena, const struct node *n)
 {
     struct node **g;
     union node_d_ptr d_ptr;
@@ -162,26 +405,35 @@ node_clone(struct node *n)
         {
         case NODE_COMPOSITION:
             d_ptr.comp = (struct node_composition *) n->data;
-            g = node_array_new(d_ptr.comp->places);
+            g = node_arena_array_new(arena, d_ptr.comp->places + 1);
             for (i = 0; i < d_ptr.comp->places; ++i)
-                g[i] = node_clone(d_ptr.comp->g[i]);
-            return composition_node_new(node_clone(d_ptr.comp->f), g);
+                g[i] = node_arena_clone(arena, d_ptr.comp->g[i]);
+            return composition_node_arena_new(arena,
+                                              node_arena_clone(arena, d_ptr.comp->f), g);
         case NODE_RECURSION:
             d_ptr.rec = (struct node_recursion *) n->data;
-            return recursion_node_new(node_clone(d_ptr.rec->f),
-                                      node_clone(d_ptr.rec->g));
+            return recursion_node_arena_new(arena,
+                                            node_arena_clone(arena, d_ptr.rec->f),
+                                            node_arena_clone(arena, d_ptr.rec->g));
         case NODE_SEARCH:
             d_ptr.search = (struct node_search *) n->data;
-            return search_node_new(node_clone(d_ptr.search->p));
+            return search_node_arena_new(arena,
+                                         node_arena_clone(arena, d_ptr.search->p));
         case NODE_PROJECTION:
             d_ptr.proj = (struct node_projection *) n->data;
-            return projection_node_new(d_ptr.proj->place);
+            return projection_node_arena_new(arena, d_ptr.proj->place);
         case NODE_ZERO:
-            return zero_node_new();
+            return zero_node_arena_new(arena);
         case NODE_SUCCESSOR:
-            return successor_node_new();
+            return successor_node_arena_new(arena);
         case NODE_INVALID:
-            return invalid_node_new();
+            return invalid_node_arena_new(arena);
+        case NODE_KERNEL:
+        {
+            struct node_kernel kernel = *((struct node_kernel *) n->data);
+            kernel.orig = node_arena_clone(arena, kernel.orig);
+            return kernel_node_arena_new(arena, &kernel);
+        }
         } /* end switch */
     }
     return NULL;
@@ -200,6 +452,12 @@ node_destroy(struct node *n)
     if (!n)
         return;
 
+    /*
+     *  Arena nodes go away with their arena, and shared nodes are released
+     *  through the table that owns them.
+     */
+    assert(!(n->flags & (NODE_FLAG_ARENA | NODE_FLAG_SHARED)));
+
     switch (n->type)
     {
     case NODE_COMPOSITION:
@@ -222,6 +480,10 @@ node_destroy(struct node *n)
         d_ptr.search = (struct node_search *) n->data;
         node_destroy(d_ptr.search->p);
         break;
+    case NODE_KERNEL:
+        d_ptr.kernel = (struct node_kernel *) n->data;
+        node_destroy(d_ptr.kernel->orig);
+        break;
     case NODE_ZERO:
     case NODE_PROJECTION:
     case NODE_SUCCESSOR:
@@ -238,18 +500,26 @@ node_destroy(struct node *n)
 struct node **
 node_array_new(size_t e)
 {
-    return calloc(e, sizeof(struct node));
+    return calloc(e, sizeof(struct node *));
 }
 
 /*!
  *  Returns the result of the computation described by the provided node tree.
+ *
+ *  The argument vector \a x is never modified, so the same array may be shared
+ *  between calls. Primitive recursion is evaluated bottom-up, from 0 to the
+ *  value of the recursion variable, in a loop that uses constant stack space
+ *  regardless of the size of that value.
+ *
+ *  Neither the tree nor the arguments are written to, and no state outlives
+ *  the call, so any number of threads may evaluate the same tree at once.
  */
 int
-node_compute(const struct node *n, int *x, size_t args)
+node_compute(const struct node *n, const int *x, size_t args)
 {
     union node_d_ptr d_ptr;
     struct node **curr;
-    int i, j, lim;
+    int i, j, k, lim;
 
     if (args && *x < 0)
         return -1;
@@ -284,36 +554,53 @@ node_compute(const struct node *n, int *x, size_t args)
         return node_compute(d_ptr.comp->f, y, j);
     }
     case NODE_RECURSION:
+    {
         if (!args)
             return -1;
         d_ptr.rec = (struct node_recursion *) n->data;
-        if (0 == x[args - 1]) {
-            return node_compute(d_ptr.rec->f, x, args - 1);
-        } else {
-            int nx[args + 1];
-            --x[args - 1];
-            i = node_compute(n, x, args);
+        lim = x[args - 1];
+        i = node_compute(d_ptr.rec->f, x, args - 1);
+        if (i < 0)
+            return -1;
+        /*
+         *  The step function g is applied to (h(x, k), x, k) for k = 0 .. y-1,
+         *  where h(x, 0) is the value of the base function f. Only the first
+         *  and last slot of the argument vector change between steps.
+         */
+        int nx[args + 1];
+        memcpy(&nx[1], x, (args - 1) * sizeof(int));
+        for (k = 0; k < lim; ++k) {
+            nx[0] = i;
+            nx[args] = k;
+            i = node_compute(d_ptr.rec->g, nx, args + 1);
             if (i < 0)
                 return -1;
-            nx[0] = i;
-            memcpy(&nx[1], x, args * sizeof(int));
-            ++x[args - 1];
-            return node_compute(d_ptr.rec->g, nx, args + 1);
         }
+        return i;
+    }
     case NODE_SEARCH:
+    {
         if (!args)
             return -1;
         d_ptr.search = (struct node_search *) n->data;
+        int nx[args];
+        memcpy(nx, x, args * sizeof(int));
         lim = x[args - 1];
         for (i = 0; i < lim; ++i) {
-            x[args - 1] = i;
-            j = node_compute(d_ptr.search->p, x, args);
+            nx[args - 1] = i;
+            j = node_compute(d_ptr.search->p, nx, args);
             if (j < 0)
                 return -1;
             else if (1 == j)
                 return i;
         }
         return lim;
+    }
+    case NODE_KERNEL:
+        d_ptr.kernel = (struct node_kernel *) n->data;
+        if (!node_kernel_applies(d_ptr.kernel, x, args))
+            return node_compute(d_ptr.kernel->orig, x, args);
+        return node_kernel_compute(d_ptr.kernel, x, args);
     } /* end switch */
 
     /*
@@ -322,3 +609,345 @@ node_compute(const struct node *n, int *x, size_t args)
     assert(0);
     return -1;
 }
+
+static int
+analyze_max(int a, int b)
+{
+    return a < 0 || b < 0 ? -1 : (a > b ? a : b);
+}
+
+/*!
+ *  Checks that \a n is well-formed and returns its arity: the smallest number
+ *  of arguments it can be called with such that every projection is in range
+ *  and every successor, recursion and search receives at least one argument,
+ *  at every node the evaluation can reach. With more arguments that still
+ *  holds. Returns -1 for trees that are not well-formed for any number of
+ *  arguments, such as trees containing invalid nodes or a composition whose
+ *  outer function needs more arguments than it has legs.
+ *
+ *  The result is recorded in every node, so that shared subtrees are analyzed
+ *  once and node_compute_checked() can rely on it. node_incr_replace() and
+ *  node_optimize() drop it from the nodes they change; after any other edit,
+ *  other than by node_strength_reduce(), call node_analysis_clear() before
+ *  analyzing again. As it writes to the tree, it should run before the tree
+ *  is shared between threads.
+ */
+int
+node_analyze(struct node *n)
+{
+    union node_d_ptr d_ptr;
+    int arity, i;
+
+    assert(n);
+
+    if (n->flags & NODE_FLAG_ANALYZED)
+        return n->flags & NODE_FLAG_WELL_FORMED ? n->arity : -1;
+
+    switch (n->type)
+    {
+    case NODE_ZERO:
+        arity = 0;
+        break;
+    case NODE_PROJECTION:
+        d_ptr.proj = (struct node_projection *) n->data;
+        arity = d_ptr.proj->place < 0 || d_ptr.proj->place >= NODE_MAX_ARITY
+            ? -1 : d_ptr.proj->place + 1;
+        break;
+    case NODE_SUCCESSOR:
+        arity = 1;
+        break;
+    case NODE_COMPOSITION:
+        d_ptr.comp = (struct node_composition *) n->data;
+        arity = node_analyze(d_ptr.comp->f);
+        arity = arity >= 0 && arity <= d_ptr.comp->places ? 0 : -1;
+        for (i = 0; i < d_ptr.comp->places; ++i)
+            arity = analyze_max(arity, node_analyze(d_ptr.comp->g[i]));
+        break;
+    case NODE_RECURSION:
+        /*
+         *  The base function gets one argument less, the step function one
+         *  more.
+         */
+        d_ptr.rec = (struct node_recursion *) n->data;
+        arity = node_analyze(d_ptr.rec->f);
+        i = node_analyze(d_ptr.rec->g);
+        arity = analyze_max(arity < 0 ? -1 : arity + 1, i > 0 ? i - 1 : i);
+        arity = analyze_max(arity, 1);
+        break;
+    case NODE_SEARCH:
+        d_ptr.search = (struct node_search *) n->data;
+        arity = analyze_max(node_analyze(d_ptr.search->p), 1);
+        break;
+    case NODE_KERNEL:
+        d_ptr.kernel = (struct node_kernel *) n->data;
+        arity = d_ptr.kernel->orig ? node_analyze(d_ptr.kernel->orig)
+                                   : d_ptr.kernel->need;
+        break;
+    case NODE_INVALID:
+    default:
+        arity = -1;
+        break;
+    } /* end switch */
+
+    if (arity > NODE_MAX_ARITY)
+        arity = -1;
+    n->flags |= NODE_FLAG_ANALYZED;
+    if (arity >= 0) {
+        n->flags |= NODE_FLAG_WELL_FORMED;
+        n->arity = (uint16_t) arity;
+    }
+    return arity;
+}
+
+/*!
+ *  Drops the result of node_analyze() from every node of \a n, so that the
+ *  next call analyzes the tree afresh.
+ */
+void
+node_analysis_clear(struct node *n)
+{
+    union node_d_ptr d_ptr;
+    int i;
+
+    assert(n);
+
+    n->flags &= ~(NODE_FLAG_ANALYZED | NODE_FLAG_WELL_FORMED);
+
+    switch (n->type)
+    {
+    case NODE_COMPOSITION:
+        d_ptr.comp = (struct node_composition *) n->data;
+        node_analysis_clear(d_ptr.comp->f);
+        for (i = 0; i < d_ptr.comp->places; ++i)
+            node_analysis_clear(d_ptr.comp->g[i]);
+        break;
+    case NODE_RECURSION:
+        d_ptr.rec = (struct node_recursion *) n->data;
+        node_analysis_clear(d_ptr.rec->f);
+        node_analysis_clear(d_ptr.rec->g);
+        break;
+    case NODE_SEARCH:
+        d_ptr.search = (struct node_search *) n->data;
+        node_analysis_clear(d_ptr.search->p);
+        break;
+    case NODE_KERNEL:
+        d_ptr.kernel = (struct node_kernel *) n->data;
+        if (d_ptr.kernel->orig)
+            node_analysis_clear(d_ptr.kernel->orig);
+        break;
+    default:
+        break;
+    } /* end switch */
+}
+
+/*
+ *  node_compute() without the checks node_analyze() has made redundant.
+ *  Arguments are never negative here, as the caller checks them once and
+ *  every value passed down is either an argument, a counter or a result
+ *  that was tested.
+ */
+static int
+compute_checked(const struct node *n, const int *x, size_t args)
+{
+    union node_d_ptr d_ptr;
+    struct node **curr;
+    int i, j, k, lim;
+
+    switch (n->type)
+    {
+    case NODE_ZERO:
+        return 0;
+    case NODE_PROJECTION:
+        return x[((struct node_projection *) n->data)->place];
+    case NODE_SUCCESSOR:
+        return (*x) + 1;
+    case NODE_COMPOSITION:
+    {
+        d_ptr.comp = (struct node_composition *) n->data;
+        curr = d_ptr.comp->g;
+        int y[d_ptr.comp->places + 1];
+        for (j = 0; j < d_ptr.comp->places; ++j) {
+            if ((i = compute_checked(curr[j], x, args)) < 0)
+                return -1;
+            y[j] = i;
+        }
+        return compute_checked(d_ptr.comp->f, y, j);
+    }
+    case NODE_RECURSION:
+    {
+        d_ptr.rec = (struct node_recursion *) n->data;
+        lim = x[args - 1];
+        if ((i = compute_checked(d_ptr.rec->f, x, args - 1)) < 0)
+            return -1;
+        int nx[args + 1];
+        memcpy(&nx[1], x, (args - 1) * sizeof(int));
+        for (k = 0; k < lim; ++k) {
+            nx[0] = i;
+            nx[args] = k;
+            if ((i = compute_checked(d_ptr.rec->g, nx, args + 1)) < 0)
+                return -1;
+        }
+        return i;
+    }
+    case NODE_SEARCH:
+    {
+        d_ptr.search = (struct node_search *) n->data;
+        int nx[args];
+        memcpy(nx, x, args * sizeof(int));
+        lim = x[args - 1];
+        for (i = 0; i < lim; ++i) {
+            nx[args - 1] = i;
+            j = compute_checked(d_ptr.search->p, nx, args);
+            if (j < 0)
+                return -1;
+            else if (1 == j)
+                return i;
+        }
+        return lim;
+    }
+    case NODE_KERNEL:
+        d_ptr.kernel = (struct node_kernel *) n->data;
+        if (d_ptr.kernel->arity >= 0 && d_ptr.kernel->arity != (int) args)
+            return compute_checked(d_ptr.kernel->orig, x, args);
+        return node_kernel_compute(d_ptr.kernel, x, args);
+    } /* end switch */
+
+    /*
+     * We should never reach here!
+     */
+    assert(0);
+    return -1;
+}
+
+/*!
+ *  Returns the same result as node_compute() for a tree \a n that passed
+ *  node_analyze(), called with at least as many arguments as its arity. The
+ *  arguments are checked once, up front, instead of at every node; if any
+ *  is negative node_compute() is used.
+ */
+int
+node_compute_checked(const struct node *n, const int *x, size_t args)
+{
+    size_t i;
+
+    assert(n && (n->flags & NODE_FLAG_WELL_FORMED) && args >= n->arity);
+
+    for (i = 0; i < args; ++i)
+        if (x[i] < 0)
+            return node_compute(n, x, args);
+    return compute_checked(n, x, args);
+}
+
+static int64_t
+operand(const struct node_operand *o, const int *x)
+{
+    return (o->place < 0 ? 0 : (int64_t) x[o->place]) + o->offset;
+}
+
+/*!
+ *  Returns 1 if \a kernel may stand in for its original tree on the arguments
+ *  \a x, otherwise 0. It may not if it was made for another argument count,
+ *  or if an operand reads a negative argument: the tree passes such a value
+ *  on as it is, where the kernel would do arithmetic on it. A kernel that
+ *  reads no argument always applies, so orig is only needed if one does.
+ */
+int
+node_kernel_applies(const struct node_kernel *kernel, const int *x, size_t args)
+{
+    if (kernel->arity >= 0 && kernel->arity != (int) args)
+        return 0;
+    if (kernel->a.place >= 0 && kernel->a.place < (int) args
+            && x[kernel->a.place] < 0)
+        return 0;
+    if (kernel->b.place >= 0 && kernel->b.place < (int) args
+            && x[kernel->b.place] < 0)
+        return 0;
+    return 1;
+}
+
+/*!
+ *  Computes the native arithmetic function described by \a kernel, whose
+ *  operands are of the form x[place] + offset, or just offset if place is
+ *  negative:
+ *
+ *  Kernel            Result
+ *  ----------------------------------------------------------------------------
+ *  KERNEL_VALUE      a
+ *  KERNEL_ADD        a + b
+ *  KERNEL_MULT       a * b
+ *  KERNEL_EXP        a ^ b
+ *  KERNEL_PRED       a - 1,    or 0 if a = 0
+ *  KERNEL_MONUS      a - b,    or 0 if a < b
+ *  KERNEL_ISZERO     1 if a = 0, otherwise 0
+ *  KERNEL_FACT       a!
+ *
+ *  Results that do not fit in an int are undefined (-1), just as the overflow
+ *  would make the equivalent node tree return -1. The argument count must be
+ *  at least kernel->need; the caller checks node_kernel_applies().
+ */
+int
+node_kernel_compute(const struct node_kernel *kernel, const int *x, size_t args)
+{
+    int64_t a, b, y;
+
+    if ((int) args < kernel->need || (args && *x < 0))
+        return -1;
+
+    a = operand(&kernel->a, x);
+    b = operand(&kernel->b, x);
+
+    switch (kernel->op)
+    {
+    case KERNEL_VALUE:
+        y = a;
+        break;
+    case KERNEL_ADD:
+        y = a + b;
+        break;
+    case KERNEL_MULT:
+        y = a * b;
+        break;
+    case KERNEL_EXP:
+        /*
+         *  Square and multiply, stopping as soon as the result is too big.
+         */
+        y = 1;
+        if (a < 2 || !b)
+            return !b ? 1 : (int) a;
+        while (b) {
+            if (b & 1) {
+                y *= a;
+                if (y > INT32_MAX)
+                    return -1;
+            }
+            if ((b >>= 1)) {
+                a *= a;
+                if (a > INT32_MAX)
+                    return -1;
+            }
+        }
+        break;
+    case KERNEL_PRED:
+        y = a ? a - 1 : 0;
+        break;
+    case KERNEL_MONUS:
+        y = a > b ? a - b : 0;
+        break;
+    case KERNEL_ISZERO:
+        y = !a;
+        break;
+    case KERNEL_FACT:
+        y = 1;
+        while (a > 1) {
+            y *= a--;
+            if (y > INT32_MAX)
+                return -1;
+        }
+        break;
+    default:
+        assert(0);
+        return -1;
+    } /* end switch */
+
+    return y > INT32_MAX ? -1 : (int) y;
+}
@@ -16,12 +16,39 @@ enum node_type {
     NODE_COMPOSITION,
     NODE_RECURSION,
     NODE_SEARCH,
-    NODE_INVALID
+    NODE_INVALID,
+    NODE_KERNEL
 };
 
+enum node_kernel_op {
+    KERNEL_VALUE = 0,
+    KERNEL_ADD,
+    KERNEL_MULT,
+    KERNEL_EXP,
+    KERNEL_PRED,
+    KERNEL_MONUS,
+    KERNEL_ISZERO,
+    KERNEL_FACT
+};
+
+enum node_flag {
+    NODE_FLAG_ARENA       = 1 << 0,
+    NODE_FLAG_SHARED      = 1 << 1,
+    NODE_FLAG_ANALYZED    = 1 << 2,
+    NODE_FLAG_WELL_FORMED = 1 << 3
+};
+
+/*
+ *  Largest arity node_analyze() can record.
+ */
+#define NODE_MAX_ARITY UINT16_MAX
+
 struct node
 {
     uint8_t type;
+    uint8_t flags;
+    uint16_t arity;
+    uint32_t refs;
     void *data;
 };
 
@@ -48,11 +75,44 @@ struct node_search
     struct node *p;
 };
 
+struct node_operand
+{
+    int place;
+    int offset;
+};
+
+struct node_kernel
+{
+    int op;
+    int arity;
+    int need;
+    struct node_operand a;
+    struct node_operand b;
+    struct node *orig;
+};
+
+#define NODE_ARENA_BLOCK_SIZE (64 * 1024)
+
+struct node_arena_block
+{
+    struct node_arena_block *next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+struct node_arena
+{
+    struct node_arena_block *blocks;
+    size_t block_size;
+};
+
 union node_d_ptr {
     struct node_composition *comp;
     struct node_recursion *rec;
     struct node_search *search;
     struct node_projection *proj;
+    struct node_kernel *kernel;
 };
 
 struct node *projection_node_new(int place);
@@ -62,13 +122,38 @@ struct node *composition_node_new(struct node *f, struct node **g);
 struct node *recursion_node_new(struct node *f, struct node *g);
 struct node *search_node_new(struct node *p);
 struct node *invalid_node_new();
+struct node *kernel_node_new(const struct node_kernel *kernel);
+struct node *constant_node_new(int value);
 
 struct node *node_clone(struct node *n);
 void node_destroy(struct node *n);
 
 struct node **node_array_new(size_t e);
 
-int node_compute(const struct node *n, int *x, size_t args);
+struct node_arena *node_arena_new(size_t block_size);
+void node_arena_destroy(struct node_arena *arena);
+void *node_arena_alloc(struct node_arena *arena, size_t size);
+
+struct node *projection_node_arena_new(struct node_arena *arena, int place);
+struct node *zero_node_arena_new(struct node_arena *arena);
+struct node *successor_node_arena_new(struct node_arena *arena);
+struct node *composition_node_arena_new(struct node_arena *arena, struct node *f, struct node **g);
+struct node *recursion_node_arena_new(struct node_arena *arena, struct node *f, struct node *g);
+struct node *search_node_arena_new(struct node_arena *arena, struct node *p);
+struct node *invalid_node_arena_new(struct node_arena *arena);
+struct node *kernel_node_arena_new(struct node_arena *arena, const struct node_kernel *kernel);
+struct node *constant_node_arena_new(struct node_arena *arena, int value);
+
+struct node **node_arena_array_new(struct node_arena *arena, size_t e);
+struct node *node_arena_clone(struct node_arena *arena, const struct node *n);
+
+int node_compute(const struct node *n, const int *x, size_t args);
+int node_kernel_compute(const struct node_kernel *kernel, const int *x, size_t args);
+int node_kernel_applies(const struct node_kernel *kernel, const int *x, size_t args);
+
+int node_analyze(struct node *n);
+void node_analysis_clear(struct node *n);
+int node_compute_checked(const struct node *n, const int *x, size_t args);
 
 #ifdef __cplusplus
 }
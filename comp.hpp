@@ -0,0 +1,213 @@
+#ifndef COMP_HPP
+#define COMP_HPP
+
+#include <array>
+#include <cstddef>
+#include "comp.h"
+
+/*
+ * A companion to comp.h for C++17, in which a general recursive function is
+ * described by a type instead of a node tree:
+ *
+ *  kompu::zero, kompu::succ          the initial functions
+ *  kompu::proj<I>                    the projection {I}
+ *  kompu::comp<F, G...>              the composition [F, G...]
+ *  kompu::rec<F, G>                  the primitive recursion <F, G>
+ *  kompu::search<P>                  the search (P)
+ *
+ * so that, for instance,
+ *
+ *  using add = kompu::rec<kompu::proj<0>, kompu::comp<kompu::succ, kompu::proj<0>>>;
+ *
+ * is addition. Every type has a static apply() that evaluates the function
+ * on a std::array of arguments, with the same result as node_compute() on the
+ * equivalent tree. The whole function is known to the compiler, which can
+ * inline it into code specialized for it, and apply() is constexpr, so with
+ * constant arguments it can be computed at compile time:
+ *
+ *  static_assert(kompu::eval<add>(2, 3) == 5);
+ *
+ * to_node() builds the equivalent heap allocated node tree, for use with the
+ * rest of the library, node_serialize() for instance.
+ */
+
+namespace kompu
+{
+
+/*
+ *  node_compute() makes every node undefined if its first argument is
+ *  negative.
+ */
+template <std::size_t N>
+constexpr bool
+undefined(const std::array<int, N> &x)
+{
+    if constexpr (N > 0)
+        return x[0] < 0;
+    return false;
+}
+
+struct zero
+{
+    template <std::size_t N>
+    static constexpr int
+    apply(const std::array<int, N> &x)
+    {
+        return undefined(x) ? -1 : 0;
+    }
+
+    static struct node *
+    to_node()
+    {
+        return zero_node_new();
+    }
+};
+
+struct succ
+{
+    template <std::size_t N>
+    static constexpr int
+    apply(const std::array<int, N> &x)
+    {
+        if constexpr (N > 0)
+            return undefined(x) ? -1 : x[0] + 1;
+        return -1;
+    }
+
+    static struct node *
+    to_node()
+    {
+        return successor_node_new();
+    }
+};
+
+template <int I>
+struct proj
+{
+    static_assert(I >= 0, "projection places are not negative");
+
+    template <std::size_t N>
+    static constexpr int
+    apply(const std::array<int, N> &x)
+    {
+        if constexpr (I < (int) N)
+            return undefined(x) ? -1 : x[I];
+        return -1;
+    }
+
+    static struct node *
+    to_node()
+    {
+        return projection_node_new(I);
+    }
+};
+
+template <class F, class... G>
+struct comp
+{
+    template <std::size_t N>
+    static constexpr int
+    apply(const std::array<int, N> &x)
+    {
+        if (undefined(x))
+            return -1;
+        std::array<int, sizeof...(G)> y{ G::apply(x)... };
+        for (std::size_t i = 0; i < y.size(); ++i)
+            if (y[i] < 0)
+                return -1;
+        return F::apply(y);
+    }
+
+    static struct node *
+    to_node()
+    {
+        struct node **g = node_array_new(sizeof...(G) + 1);
+        std::size_t i = 0;
+        ((g[i++] = G::to_node()), ...);
+        return composition_node_new(F::to_node(), g);
+    }
+};
+
+template <class F, class G>
+struct rec
+{
+    template <std::size_t N>
+    static constexpr int
+    apply(const std::array<int, N> &x)
+    {
+        if constexpr (N > 0) {
+            if (undefined(x))
+                return -1;
+            std::array<int, N - 1> base{};
+            std::array<int, N + 1> nx{};
+            for (std::size_t i = 0; i + 1 < N; ++i)
+                base[i] = nx[i + 1] = x[i];
+            int h = F::apply(base);
+            if (h < 0)
+                return -1;
+            /*
+             *  g is applied to (h(x, k), x, k) for k = 0 .. y-1.
+             */
+            for (int k = 0; k < x[N - 1]; ++k) {
+                nx[0] = h;
+                nx[N] = k;
+                if ((h = G::apply(nx)) < 0)
+                    return -1;
+            }
+            return h;
+        }
+        return -1;
+    }
+
+    static struct node *
+    to_node()
+    {
+        return recursion_node_new(F::to_node(), G::to_node());
+    }
+};
+
+template <class P>
+struct search
+{
+    template <std::size_t N>
+    static constexpr int
+    apply(const std::array<int, N> &x)
+    {
+        if constexpr (N > 0) {
+            if (undefined(x))
+                return -1;
+            std::array<int, N> nx = x;
+            for (int i = 0; i < x[N - 1]; ++i) {
+                nx[N - 1] = i;
+                int j = P::apply(nx);
+                if (j < 0)
+                    return -1;
+                if (1 == j)
+                    return i;
+            }
+            return x[N - 1];
+        }
+        return -1;
+    }
+
+    static struct node *
+    to_node()
+    {
+        return search_node_new(P::to_node());
+    }
+};
+
+/*!
+ *  Returns F applied to the arguments \a x, as node_compute() would for the
+ *  tree F::to_node().
+ */
+template <class F, class... X>
+constexpr int
+eval(X... x)
+{
+    return F::apply(std::array<int, sizeof...(X)>{ static_cast<int>(x)... });
+}
+
+} /* namespace kompu */
+
+#endif /* COMP_HPP */
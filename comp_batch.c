@@ -0,0 +1,430 @@
+#include <malloc.h>
+#include <assert.h>
+#include <string.h>
+#include "comp_batch.h"
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/*
+ * Batch evaluation computes one node for many argument vectors at once. The
+ * vectors are stored as a structure of arrays: argument j of lane i is at
+ * xs[j * count + i], so that each argument forms a contiguous row and the
+ * leaves reduce to lane-wise arithmetic on whole rows.
+ *
+ * An undefined result is -1 as usual. A lane whose first argument is negative
+ * evaluates to -1 at every node, so the leaves OR their result with the sign
+ * of that row. Compositions pass undefined legs on by poisoning the first row
+ * of the outer function's arguments. Recursion and search run their loops
+ * over all lanes together, and lanes that finish early are compacted out of
+ * the working set so that each pass only touches lanes still running.
+ */
+
+static int batch(const struct node *n, const int *xs, size_t args, size_t count, int *out);
+
+/*
+ *  out[i] = (a[i] + add) | (s[i] < 0 ? -1 : 0). The arrays may overlap
+ *  exactly.
+ */
+static void
+lanes_or_sign(int *out, const int *a, int add, const int *s, size_t count)
+{
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    __m256i v8 = _mm256_set1_epi32(add);
+    for (; i + 8 <= count; i += 8) {
+        __m256i va = _mm256_loadu_si256((const __m256i *) (a + i));
+        __m256i vs = _mm256_loadu_si256((const __m256i *) (s + i));
+        va = _mm256_or_si256(_mm256_add_epi32(va, v8), _mm256_srai_epi32(vs, 31));
+        _mm256_storeu_si256((__m256i *) (out + i), va);
+    }
+#endif
+#if defined(__SSE2__)
+    __m128i v4 = _mm_set1_epi32(add);
+    for (; i + 4 <= count; i += 4) {
+        __m128i va = _mm_loadu_si128((const __m128i *) (a + i));
+        __m128i vs = _mm_loadu_si128((const __m128i *) (s + i));
+        va = _mm_or_si128(_mm_add_epi32(va, v4), _mm_srai_epi32(vs, 31));
+        _mm_storeu_si128((__m128i *) (out + i), va);
+    }
+#endif
+    for (; i < count; ++i)
+        out[i] = (int) ((unsigned int) a[i] + (unsigned int) add) | -(s[i] < 0);
+}
+
+/*
+ *  out[i] = s[i] < 0 ? -1 : 0.
+ */
+static void
+lanes_sign(int *out, const int *s, size_t count)
+{
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    for (; i + 8 <= count; i += 8) {
+        __m256i vs = _mm256_loadu_si256((const __m256i *) (s + i));
+        _mm256_storeu_si256((__m256i *) (out + i), _mm256_srai_epi32(vs, 31));
+    }
+#endif
+#if defined(__SSE2__)
+    for (; i + 4 <= count; i += 4) {
+        __m128i vs = _mm_loadu_si128((const __m128i *) (s + i));
+        _mm_storeu_si128((__m128i *) (out + i), _mm_srai_epi32(vs, 31));
+    }
+#endif
+    for (; i < count; ++i)
+        out[i] = -(s[i] < 0);
+}
+
+static void
+lanes_fill(int *out, int v, size_t count)
+{
+    size_t i;
+    for (i = 0; i < count; ++i)
+        out[i] = v;
+}
+
+static int
+batch_composition(const struct node *n, const int *xs, size_t args,
+                  size_t count, int *out)
+{
+    struct node_composition *comp;
+    int *y;
+    int j, r;
+
+    comp = (struct node_composition *) n->data;
+    if (!comp->places) {
+        if (batch(comp->f, NULL, 0, count, out))
+            return -1;
+        if (args)
+            lanes_or_sign(out, out, 0, xs, count);
+        return 0;
+    }
+
+    y = malloc(comp->places * count * sizeof(int));
+    if (!y)
+        return -1;
+    for (j = 0; j < comp->places; ++j) {
+        if (batch(comp->g[j], xs, args, count, y + j * count)) {
+            free(y);
+            return -1;
+        }
+    }
+    /*
+     *  A lane in which any leg is undefined gets a negative first argument, so
+     *  the outer function is undefined in that lane too.
+     */
+    for (j = 1; j < comp->places; ++j)
+        lanes_or_sign(y, y, 0, y + j * count, count);
+
+    r = batch(comp->f, y, comp->places, count, out);
+    free(y);
+    return r;
+}
+
+/*
+ *  Moves the columns listed in keep to the front of each of the rows rows of
+ *  the m lane wide array nx, leaving an array with m2 lanes. Every column
+ *  moves towards the start of the buffer, so this can be done in place.
+ */
+static void
+lanes_compact(int *nx, size_t rows, size_t m, const size_t *keep, size_t m2)
+{
+    size_t r, j;
+    for (r = 0; r < rows; ++r)
+        for (j = 0; j < m2; ++j)
+            nx[r * m2 + j] = nx[r * m + keep[j]];
+}
+
+/*
+ *  State shared by the recursion and search loops: the argument array of the
+ *  inner function for the lanes still running, the lane each column came
+ *  from, and the bound of the loop in that lane.
+ */
+struct lanes
+{
+    int *nx;
+    int *res;
+    int *lim;
+    size_t *idx;
+    size_t *keep;
+};
+
+static int
+lanes_new(struct lanes *l, size_t rows, size_t count)
+{
+    l->nx = malloc(rows * count * sizeof(int));
+    l->res = malloc(count * sizeof(int));
+    l->lim = malloc(count * sizeof(int));
+    l->idx = malloc(count * sizeof(size_t));
+    l->keep = malloc(count * sizeof(size_t));
+    return (l->nx && l->res && l->lim && l->idx && l->keep) ? 0 : -1;
+}
+
+static void
+lanes_destroy(struct lanes *l)
+{
+    free(l->nx);
+    free(l->res);
+    free(l->lim);
+    free(l->idx);
+    free(l->keep);
+}
+
+static int
+batch_recursion(const struct node *n, const int *xs, size_t args,
+                size_t count, int *out)
+{
+    struct node_recursion *rec;
+    struct lanes l;
+    size_t i, j, m, m2, r;
+    int k;
+
+    rec = (struct node_recursion *) n->data;
+    if (batch(rec->f, xs, args - 1, count, out))
+        return -1;
+    if (lanes_new(&l, args + 1, count)) {
+        lanes_destroy(&l);
+        return -1;
+    }
+
+    /*
+     *  Lanes start with h(x, 0) = f(x) in the first row and the counter in the
+     *  last. A lane with a zero bound is already done.
+     */
+    m = 0;
+    for (i = 0; i < count; ++i) {
+        if (xs[i] < 0)
+            out[i] = -1;
+        else if (out[i] >= 0 && xs[(args - 1) * count + i] > 0)
+            l.idx[m++] = i;
+    }
+    for (j = 0; j < m; ++j) {
+        i = l.idx[j];
+        l.nx[j] = out[i];
+        for (r = 0; r + 1 < args; ++r)
+            l.nx[(r + 1) * m + j] = xs[r * count + i];
+        l.nx[args * m + j] = 0;
+        l.lim[j] = xs[(args - 1) * count + i];
+    }
+
+    while (m) {
+        if (batch(rec->g, l.nx, args + 1, m, l.res)) {
+            lanes_destroy(&l);
+            return -1;
+        }
+        m2 = 0;
+        for (j = 0; j < m; ++j) {
+            k = l.nx[args * m + j] + 1;
+            if (l.res[j] < 0 || k == l.lim[j]) {
+                out[l.idx[j]] = l.res[j] < 0 ? -1 : l.res[j];
+                continue;
+            }
+            l.nx[j] = l.res[j];
+            l.nx[args * m + j] = k;
+            l.idx[m2] = l.idx[j];
+            l.lim[m2] = l.lim[j];
+            l.keep[m2++] = j;
+        }
+        if (m2 < m)
+            lanes_compact(l.nx, args + 1, m, l.keep, m2);
+        m = m2;
+    }
+
+    lanes_destroy(&l);
+    return 0;
+}
+
+static int
+batch_search(const struct node *n, const int *xs, size_t args,
+             size_t count, int *out)
+{
+    struct node_search *search;
+    struct lanes l;
+    size_t i, j, m, m2, r;
+    int k;
+
+    search = (struct node_search *) n->data;
+    if (lanes_new(&l, args, count)) {
+        lanes_destroy(&l);
+        return -1;
+    }
+
+    m = 0;
+    for (i = 0; i < count; ++i) {
+        out[i] = xs[(args - 1) * count + i];
+        if (xs[i] < 0)
+            out[i] = -1;
+        else if (out[i] > 0)
+            l.idx[m++] = i;
+    }
+    for (j = 0; j < m; ++j) {
+        i = l.idx[j];
+        for (r = 0; r + 1 < args; ++r)
+            l.nx[r * m + j] = xs[r * count + i];
+        l.nx[(args - 1) * m + j] = 0;
+        l.lim[j] = xs[(args - 1) * count + i];
+    }
+
+    while (m) {
+        if (batch(search->p, l.nx, args, m, l.res)) {
+            lanes_destroy(&l);
+            return -1;
+        }
+        m2 = 0;
+        for (j = 0; j < m; ++j) {
+            k = l.nx[(args - 1) * m + j];
+            if (l.res[j] < 0) {
+                out[l.idx[j]] = -1;
+                continue;
+            }
+            if (1 == l.res[j]) {
+                out[l.idx[j]] = k;
+                continue;
+            }
+            if (k + 1 == l.lim[j])
+                continue;
+            l.nx[(args - 1) * m + j] = k + 1;
+            l.idx[m2] = l.idx[j];
+            l.lim[m2] = l.lim[j];
+            l.keep[m2++] = j;
+        }
+        if (m2 < m)
+            lanes_compact(l.nx, args, m, l.keep, m2);
+        m = m2;
+    }
+
+    lanes_destroy(&l);
+    return 0;
+}
+
+/*
+ *  Kernels are evaluated lane by lane; only the first argument and the places
+ *  read by the two operands are gathered. If an operand is negative in any
+ *  lane, the whole batch goes to the original tree instead.
+ */
+static int
+batch_kernel(const struct node *n, const int *xs, size_t args, size_t count,
+             int *out)
+{
+    const struct node_kernel *kernel;
+    int x[args + 1];
+    size_t i;
+
+    kernel = (const struct node_kernel *) n->data;
+    if (kernel->arity >= 0 && kernel->arity != (int) args)
+        return batch(kernel->orig, xs, args, count, out);
+    if ((int) args < kernel->need) {
+        lanes_fill(out, -1, count);
+        return 0;
+    }
+
+    for (i = 0; i < count; ++i)
+        if ((kernel->a.place >= 0 && xs[kernel->a.place * count + i] < 0)
+                || (kernel->b.place >= 0 && xs[kernel->b.place * count + i] < 0))
+            return batch(kernel->orig, xs, args, count, out);
+
+    memset(x, 0, sizeof(x));
+    for (i = 0; i < count; ++i) {
+        if (args)
+            x[0] = xs[i];
+        if (kernel->a.place >= 0)
+            x[kernel->a.place] = xs[kernel->a.place * count + i];
+        if (kernel->b.place >= 0)
+            x[kernel->b.place] = xs[kernel->b.place * count + i];
+        out[i] = node_kernel_compute(kernel, x, args);
+    }
+    return 0;
+}
+
+static int
+batch(const struct node *n, const int *xs, size_t args, size_t count, int *out)
+{
+    int j;
+
+    switch (n->type)
+    {
+    case NODE_ZERO:
+    case NODE_INVALID:
+        if (args)
+            lanes_sign(out, xs, count);
+        else
+            lanes_fill(out, 0, count);
+        return 0;
+    case NODE_PROJECTION:
+        j = ((struct node_projection *) n->data)->place;
+        if (j >= (int) args)
+            lanes_fill(out, -1, count);
+        else
+            lanes_or_sign(out, xs + j * count, 0, xs, count);
+        return 0;
+    case NODE_SUCCESSOR:
+        /*
+         *  The successor of nothing is undefined.
+         */
+        if (!args)
+            lanes_fill(out, -1, count);
+        else
+            lanes_or_sign(out, xs, 1, xs, count);
+        return 0;
+    case NODE_COMPOSITION:
+        return batch_composition(n, xs, args, count, out);
+    case NODE_RECURSION:
+        if (!args) {
+            lanes_fill(out, -1, count);
+            return 0;
+        }
+        return batch_recursion(n, xs, args, count, out);
+    case NODE_SEARCH:
+        if (!args) {
+            lanes_fill(out, -1, count);
+            return 0;
+        }
+        return batch_search(n, xs, args, count, out);
+    case NODE_KERNEL:
+        return batch_kernel(n, xs, args, count, out);
+    } /* end switch */
+
+    /*
+     * We should never reach here!
+     */
+    assert(0);
+    return -1;
+}
+
+/*!
+ *  Evaluates \a n for \a count argument vectors of \a args arguments each and
+ *  stores the results in \a out, so that out[i] is what node_compute() returns
+ *  for the vector of lane i. The vectors are given as a structure of arrays:
+ *  argument j of lane i is xs[j * count + i]. Returns 0 on success and -1 if
+ *  memory for intermediate results could not be allocated.
+ */
+int
+node_compute_batch(const struct node *n, const int *xs, size_t args,
+                   size_t count, int *out)
+{
+    size_t base, m, j;
+    int *chunk;
+
+    assert(n && (xs || !args) && out);
+
+    if (count <= NODE_BATCH_LANES)
+        return batch(n, xs, args, count, out);
+
+    chunk = malloc((args ? args : 1) * NODE_BATCH_LANES * sizeof(int));
+    if (!chunk)
+        return -1;
+    for (base = 0; base < count; base += m) {
+        m = count - base < NODE_BATCH_LANES ? count - base : NODE_BATCH_LANES;
+        for (j = 0; j < args; ++j)
+            memcpy(chunk + j * m, xs + j * count + base, m * sizeof(int));
+        if (batch(n, chunk, args, m, out + base)) {
+            free(chunk);
+            return -1;
+        }
+    }
+    free(chunk);
+    return 0;
+}
@@ -0,0 +1,23 @@
+#ifndef COMP_BATCH_H
+#define COMP_BATCH_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include "comp.h"
+
+/*
+ *  Number of lanes evaluated together. Larger batches are split into chunks
+ *  of this size so that intermediate results stay in cache.
+ */
+#define NODE_BATCH_LANES 256
+
+int node_compute_batch(const struct node *n, const int *xs, size_t args, size_t count, int *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* COMP_BATCH_H */
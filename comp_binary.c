@@ -0,0 +1,616 @@
+#include <malloc.h>
+#include <assert.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "comp_binary.h"
+
+/*
+ * The binary format is a header followed by the tree in prefix order, one
+ * opcode byte per node. Integers are unsigned LEB128 varints: seven bits a
+ * byte, least significant group first, the high bit set on all but the last
+ * byte.
+ *
+ *   header    "KMPU" version:u8 nodes:varint size:varint
+ *   zero      0x00
+ *   succ      0x01
+ *   proj      0x02 place:varint
+ *   comp      0x03 len:varint legs:varint f g1 .. gm
+ *   rec       0x04 len:varint f g
+ *   search    0x05 len:varint p
+ *   invalid   0x06
+ *   const     0x07 value+1:varint          (0 is the undefined constant)
+ *
+ * Here size is the length of the body and len the number of bytes after the
+ * len field that belong to the node. Lengths let a reader step over a
+ * subtree without decoding it, so an image is evaluated in place: a leg of a
+ * composition is found by skipping the ones before it, and the step of a
+ * recursion by skipping the base. Kernels are written as the tree they
+ * replace, constants without one as a const record.
+ *
+ * An image is checked once, when it is opened, in a single bounds-checked
+ * pass over the bytes. After that it is trusted, and node_image_compute()
+ * reads it without checks and without allocating.
+ */
+
+#define BIN_HEADER_MIN 7
+#define BIN_VARINT_MAX 5
+#define BIN_MAX_DEPTH 4096
+
+/*!
+ *  \struct node_image
+ *
+ *  \brief A validated binary tree in memory, see node_image_open().
+ */
+
+struct measure
+{
+    uint32_t *lens;
+    size_t count;
+    size_t asize;
+    size_t nodes;
+};
+
+static size_t
+varint_size(uint32_t v)
+{
+    size_t k = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        ++k;
+    }
+    return k;
+}
+
+static uint8_t *
+varint_put(uint8_t *p, uint32_t v)
+{
+    while (v >= 0x80) {
+        *p++ = (uint8_t) (v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (uint8_t) v;
+    return p;
+}
+
+/*
+ *  Reads a varint from [p, end), or returns NULL if it runs past the end or
+ *  does not fit in 32 bits.
+ */
+static const uint8_t *
+varint_get(const uint8_t *p, const uint8_t *end, uint32_t *v)
+{
+    uint64_t r = 0;
+    int k;
+
+    for (k = 0; k < BIN_VARINT_MAX; ++k) {
+        if (p >= end)
+            return NULL;
+        r |= (uint64_t) (*p & 0x7f) << (7 * k);
+        if (!(*p++ & 0x80)) {
+            if (r > UINT32_MAX)
+                return NULL;
+            *v = (uint32_t) r;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/*
+ *  The unchecked reader, for images that have been validated.
+ */
+static const uint8_t *
+varint_read(const uint8_t *p, uint32_t *v)
+{
+    uint32_t r = 0;
+    int s = 0;
+
+    while (*p & 0x80) {
+        r |= (uint32_t) (*p++ & 0x7f) << s;
+        s += 7;
+    }
+    *v = r | (uint32_t) *p++ << s;
+    return p;
+}
+
+static const struct node *
+unwrap(const struct node *n)
+{
+    const struct node_kernel *kernel;
+
+    while (NODE_KERNEL == n->type) {
+        kernel = (const struct node_kernel *) n->data;
+        if (!kernel->orig)
+            break;
+        n = kernel->orig;
+    }
+    return n;
+}
+
+/*
+ *  Returns the encoded size of n, and records the len field of every
+ *  compound node in prefix order. Returns 0 if n can not be written.
+ */
+static size_t
+measure(struct measure *m, const struct node *n)
+{
+    union node_d_ptr d_ptr;
+    size_t i, idx, len, s;
+    uint32_t *lens;
+
+    n = unwrap(n);
+    ++m->nodes;
+
+    switch (n->type)
+    {
+    case NODE_ZERO:
+    case NODE_SUCCESSOR:
+    case NODE_INVALID:
+        return 1;
+    case NODE_PROJECTION:
+        d_ptr.proj = (struct node_projection *) n->data;
+        if (d_ptr.proj->place < 0)
+            return 0;
+        return 1 + varint_size((uint32_t) d_ptr.proj->place);
+    case NODE_KERNEL:
+        d_ptr.kernel = (struct node_kernel *) n->data;
+        if (KERNEL_VALUE != d_ptr.kernel->op)
+            return 0;
+        return 1 + varint_size((uint32_t) d_ptr.kernel->a.offset + 1);
+    case NODE_COMPOSITION:
+    case NODE_RECURSION:
+    case NODE_SEARCH:
+        break;
+    default:
+        return 0;
+    }
+
+    if (m->count == m->asize) {
+        m->asize = m->asize ? m->asize * 2 : 64;
+        if (!(lens = realloc(m->lens, m->asize * sizeof(uint32_t))))
+            return 0;
+        m->lens = lens;
+    }
+    idx = m->count++;
+
+    switch (n->type)
+    {
+    case NODE_COMPOSITION:
+        d_ptr.comp = (struct node_composition *) n->data;
+        len = varint_size((uint32_t) d_ptr.comp->places);
+        if (!(s = measure(m, d_ptr.comp->f)))
+            return 0;
+        len += s;
+        for (i = 0; i < (size_t) d_ptr.comp->places; ++i) {
+            if (!(s = measure(m, d_ptr.comp->g[i])))
+                return 0;
+            len += s;
+        }
+        break;
+    case NODE_RECURSION:
+        d_ptr.rec = (struct node_recursion *) n->data;
+        if (!(len = measure(m, d_ptr.rec->f)) || !(s = measure(m, d_ptr.rec->g)))
+            return 0;
+        len += s;
+        break;
+    default:
+        d_ptr.search = (struct node_search *) n->data;
+        if (!(len = measure(m, d_ptr.search->p)))
+            return 0;
+        break;
+    }
+
+    if (len > UINT32_MAX)
+        return 0;
+    m->lens[idx] = (uint32_t) len;
+    return 1 + varint_size((uint32_t) len) + len;
+}
+
+static uint8_t *
+emit(const uint32_t **lens, const struct node *n, uint8_t *p)
+{
+    union node_d_ptr d_ptr;
+    int i;
+
+    n = unwrap(n);
+
+    switch (n->type)
+    {
+    case NODE_ZERO:
+        *p++ = BIN_ZERO;
+        break;
+    case NODE_SUCCESSOR:
+        *p++ = BIN_SUCC;
+        break;
+    case NODE_INVALID:
+        *p++ = BIN_INVALID;
+        break;
+    case NODE_PROJECTION:
+        d_ptr.proj = (struct node_projection *) n->data;
+        *p++ = BIN_PROJ;
+        p = varint_put(p, (uint32_t) d_ptr.proj->place);
+        break;
+    case NODE_KERNEL:
+        d_ptr.kernel = (struct node_kernel *) n->data;
+        *p++ = BIN_CONST;
+        p = varint_put(p, (uint32_t) d_ptr.kernel->a.offset + 1);
+        break;
+    case NODE_COMPOSITION:
+        d_ptr.comp = (struct node_composition *) n->data;
+        *p++ = BIN_COMP;
+        p = varint_put(p, *(*lens)++);
+        p = varint_put(p, (uint32_t) d_ptr.comp->places);
+        p = emit(lens, d_ptr.comp->f, p);
+        for (i = 0; i < d_ptr.comp->places; ++i)
+            p = emit(lens, d_ptr.comp->g[i], p);
+        break;
+    case NODE_RECURSION:
+        d_ptr.rec = (struct node_recursion *) n->data;
+        *p++ = BIN_REC;
+        p = varint_put(p, *(*lens)++);
+        p = emit(lens, d_ptr.rec->f, p);
+        p = emit(lens, d_ptr.rec->g, p);
+        break;
+    case NODE_SEARCH:
+        d_ptr.search = (struct node_search *) n->data;
+        *p++ = BIN_SEARCH;
+        p = varint_put(p, *(*lens)++);
+        p = emit(lens, d_ptr.search->p, p);
+        break;
+    } /* end switch */
+    return p;
+}
+
+/*!
+ *  Appends the binary image of \a n to \a buf. The tree is measured in a
+ *  first pass and written in a second, into space reserved up front.
+ *  Returns 0, or -1 if the tree holds a kernel without its original tree,
+ *  other than a constant, or memory runs out.
+ */
+int
+node_serialize_binary(const struct node *n, struct buf *buf)
+{
+    struct measure m = { NULL, 0, 0, 0 };
+    const uint32_t *lens;
+    uint8_t *p, *start;
+    size_t body, total;
+
+    if (!(body = measure(&m, n)) || body > UINT32_MAX || m.nodes > UINT32_MAX) {
+        free(m.lens);
+        return -1;
+    }
+    total = 5 + varint_size((uint32_t) m.nodes) + varint_size((uint32_t) body) + body;
+    if (buf_grow(buf, buf->size + total) < 0) {
+        free(m.lens);
+        return -1;
+    }
+
+    start = p = (uint8_t *) buf->data + buf->size;
+    memcpy(p, NODE_BINARY_MAGIC, 4);
+    p += 4;
+    *p++ = NODE_BINARY_VERSION;
+    p = varint_put(p, (uint32_t) m.nodes);
+    p = varint_put(p, (uint32_t) body);
+    lens = m.lens;
+    p = emit(&lens, n, p);
+
+    assert((size_t) (p - start) == total);
+    buf->size += total;
+    free(m.lens);
+    return 0;
+}
+
+/*
+ *  Checks the node at p, which must end by end. Returns the first byte after
+ *  it, or NULL if it is malformed.
+ */
+static const uint8_t *
+check(const uint8_t *p, const uint8_t *end, size_t *nodes, int depth)
+{
+    const uint8_t *stop;
+    uint32_t v, len, legs;
+    uint8_t op;
+
+    if (p >= end || depth > BIN_MAX_DEPTH)
+        return NULL;
+    ++*nodes;
+
+    switch ((op = *p++))
+    {
+    case BIN_ZERO:
+    case BIN_SUCC:
+    case BIN_INVALID:
+        return p;
+    case BIN_PROJ:
+        if (!(p = varint_get(p, end, &v)) || v > INT_MAX)
+            return NULL;
+        return p;
+    case BIN_CONST:
+        if (!(p = varint_get(p, end, &v)) || v > (uint32_t) INT_MAX + 1)
+            return NULL;
+        return p;
+    case BIN_COMP:
+    case BIN_REC:
+    case BIN_SEARCH:
+        break;
+    default:
+        return NULL;
+    }
+
+    if (!(p = varint_get(p, end, &len)) || len > (size_t) (end - p))
+        return NULL;
+    stop = p + len;
+
+    switch (op)
+    {
+    case BIN_COMP:
+        /*
+         *  Every leg takes at least a byte, which bounds the loop by the
+         *  length of the input.
+         */
+        if (!(p = varint_get(p, stop, &legs)) || legs > INT_MAX
+                || legs > (size_t) (stop - p))
+            return NULL;
+        if (!(p = check(p, stop, nodes, depth + 1)))
+            return NULL;
+        while (legs--)
+            if (!(p = check(p, stop, nodes, depth + 1)))
+                return NULL;
+        break;
+    case BIN_REC:
+        if (!(p = check(p, stop, nodes, depth + 1))
+                || !(p = check(p, stop, nodes, depth + 1)))
+            return NULL;
+        break;
+    default:
+        if (!(p = check(p, stop, nodes, depth + 1)))
+            return NULL;
+        break;
+    } /* end switch */
+
+    return p == stop ? p : NULL;
+}
+
+/*!
+ *  Opens the binary image in \a data, which is validated but neither copied
+ *  nor retained beyond the pointer: it has to stay in place for as long as
+ *  the image is used. Returns 0, or -1 if the data is not a well formed
+ *  image of the current version.
+ */
+int
+node_image_open(struct node_image *img, const void *data, size_t size)
+{
+    const uint8_t *p = data, *end = p + size;
+    uint32_t nodes, body;
+    size_t count = 0;
+
+    memset(img, 0, sizeof(struct node_image));
+    if (!data || size < BIN_HEADER_MIN || memcmp(p, NODE_BINARY_MAGIC, 4)
+            || NODE_BINARY_VERSION != p[4])
+        return -1;
+    p += 5;
+    if (!(p = varint_get(p, end, &nodes)) || !(p = varint_get(p, end, &body)))
+        return -1;
+    if (body != (size_t) (end - p) || check(p, end, &count, 0) != end
+            || count != nodes)
+        return -1;
+
+    img->body = p;
+    img->size = body;
+    img->nodes = nodes;
+    return 0;
+}
+
+/*!
+ *  Maps the file at \a path read-only and opens it as an image, so that the
+ *  tree is evaluated straight from the page cache. Release the image with
+ *  node_image_unmap(). Returns 0, or -1 on error.
+ */
+int
+node_image_map(struct node_image *img, const char *path)
+{
+    struct stat st;
+    void *map;
+    int fd;
+
+    memset(img, 0, sizeof(struct node_image));
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 || st.st_size < BIN_HEADER_MIN) {
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (MAP_FAILED == map)
+        return -1;
+    if (node_image_open(img, map, (size_t) st.st_size) < 0) {
+        munmap(map, (size_t) st.st_size);
+        return -1;
+    }
+    img->map = map;
+    img->map_size = (size_t) st.st_size;
+    return 0;
+}
+
+/*!
+ *  Unmaps an image opened with node_image_map(). Images opened on memory
+ *  owned by the caller are only cleared.
+ */
+void
+node_image_unmap(struct node_image *img)
+{
+    if (img->map)
+        munmap(img->map, img->map_size);
+    memset(img, 0, sizeof(struct node_image));
+}
+
+static const uint8_t *
+skip(const uint8_t *p)
+{
+    uint32_t v;
+
+    switch (*p++)
+    {
+    case BIN_PROJ:
+    case BIN_CONST:
+        return varint_read(p, &v);
+    case BIN_COMP:
+    case BIN_REC:
+    case BIN_SEARCH:
+        p = varint_read(p, &v);
+        return p + v;
+    default:
+        return p;
+    }
+}
+
+static int
+compute(const uint8_t *p, const int *x, size_t args)
+{
+    const uint8_t *f;
+    uint32_t v, m;
+    int i, j, k, lim;
+
+    if (args && *x < 0)
+        return -1;
+
+    switch (*p++)
+    {
+    case BIN_ZERO:
+    case BIN_INVALID:
+        return 0;
+    case BIN_PROJ:
+        varint_read(p, &v);
+        return v < args ? x[v] : -1;
+    case BIN_SUCC:
+        return args ? (*x) + 1 : -1;
+    case BIN_CONST:
+        varint_read(p, &v);
+        return v ? (int) (v - 1) : -1;
+    case BIN_COMP:
+    {
+        p = varint_read(p, &v);
+        p = varint_read(p, &m);
+        f = p;
+        p = skip(p);
+        int y[m ? m : 1];
+        for (j = 0; j < (int) m; ++j) {
+            if ((i = compute(p, x, args)) < 0)
+                return -1;
+            y[j] = i;
+            p = skip(p);
+        }
+        return compute(f, y, m);
+    }
+    case BIN_REC:
+    {
+        if (!args)
+            return -1;
+        p = varint_read(p, &v);
+        lim = x[args - 1];
+        if ((i = compute(p, x, args - 1)) < 0)
+            return -1;
+        p = skip(p);
+        int nx[args + 1];
+        memcpy(&nx[1], x, (args - 1) * sizeof(int));
+        for (k = 0; k < lim; ++k) {
+            nx[0] = i;
+            nx[args] = k;
+            if ((i = compute(p, nx, args + 1)) < 0)
+                return -1;
+        }
+        return i;
+    }
+    case BIN_SEARCH:
+    {
+        if (!args)
+            return -1;
+        p = varint_read(p, &v);
+        int nx[args];
+        memcpy(nx, x, args * sizeof(int));
+        lim = x[args - 1];
+        for (i = 0; i < lim; ++i) {
+            nx[args - 1] = i;
+            j = compute(p, nx, args);
+            if (j < 0)
+                return -1;
+            else if (1 == j)
+                return i;
+        }
+        return lim;
+    }
+    } /* end switch */
+
+    return -1;
+}
+
+/*!
+ *  Evaluates the image on \a x with the semantics of node_compute(),
+ *  reading the bytes in place. Nothing is allocated outside the stack, so
+ *  any number of threads may evaluate the same image at once.
+ */
+int
+node_image_compute(const struct node_image *img, const int *x, size_t args)
+{
+    assert(img->body);
+    return compute(img->body, x, args);
+}
+
+static struct node *
+to_node(const uint8_t *p)
+{
+    struct node *f, **g;
+    uint32_t v, m, j;
+
+    switch (*p++)
+    {
+    case BIN_ZERO:
+        return zero_node_new();
+    case BIN_SUCC:
+        return successor_node_new();
+    case BIN_INVALID:
+        return invalid_node_new();
+    case BIN_PROJ:
+        varint_read(p, &v);
+        return projection_node_new((int) v);
+    case BIN_CONST:
+        varint_read(p, &v);
+        return constant_node_new(v ? (int) (v - 1) : -1);
+    case BIN_COMP:
+        p = varint_read(p, &v);
+        p = varint_read(p, &m);
+        f = to_node(p);
+        p = skip(p);
+        g = node_array_new(m + 1);
+        for (j = 0; j < m; ++j) {
+            g[j] = to_node(p);
+            p = skip(p);
+        }
+        return composition_node_new(f, g);
+    case BIN_REC:
+        p = varint_read(p, &v);
+        f = to_node(p);
+        return recursion_node_new(f, to_node(skip(p)));
+    case BIN_SEARCH:
+        p = varint_read(p, &v);
+        return search_node_new(to_node(p));
+    } /* end switch */
+
+    return NULL;
+}
+
+/*!
+ *  Builds a heap node tree from the image, for code that needs to edit or
+ *  analyze it.
+ */
+struct node *
+node_image_to_node(const struct node_image *img)
+{
+    assert(img->body);
+    return to_node(img->body);
+}
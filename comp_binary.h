@@ -0,0 +1,48 @@
+#ifndef COMP_BINARY_H
+#define COMP_BINARY_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include "comp.h"
+#include "buf.h"
+
+#define NODE_BINARY_MAGIC "KMPU"
+#define NODE_BINARY_VERSION 1
+
+enum node_binary_op {
+    BIN_ZERO = 0,
+    BIN_SUCC,
+    BIN_PROJ,
+    BIN_COMP,
+    BIN_REC,
+    BIN_SEARCH,
+    BIN_INVALID,
+    BIN_CONST
+};
+
+struct node_image
+{
+    const uint8_t *body;
+    size_t size;
+    size_t nodes;
+    void *map;
+    size_t map_size;
+};
+
+int node_serialize_binary(const struct node *n, struct buf *buf);
+
+int node_image_open(struct node_image *img, const void *data, size_t size);
+int node_image_map(struct node_image *img, const char *path);
+void node_image_unmap(struct node_image *img);
+
+int node_image_compute(const struct node_image *img, const int *x, size_t args);
+struct node *node_image_to_node(const struct node_image *img);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* COMP_BINARY_H */
@@ -0,0 +1,378 @@
+#include <malloc.h>
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "comp_eval.h"
+#include "comp_serialize.h"
+
+/*
+ * An evaluation context bounds and observes a call to node_compute_ctx().
+ *
+ * Every node visited costs one step of fuel, including each application of
+ * the step function of a recursion and each test of a search predicate. When
+ * the fuel runs out the evaluation unwinds and returns NODE_EXHAUSTED, which
+ * like -1 propagates through every node above it.
+ *
+ * With NODE_PROFILE_VISITS the context counts the visits to each node, in a
+ * table keyed on the node's address. NODE_PROFILE_TIME adds the wall clock
+ * time spent in each node, inclusive of its subtrees, at the price of two
+ * clock reads per visit. The deepest nesting of evaluations is always kept.
+ *
+ * All state of an evaluation lives in its context, and the tree is only read.
+ * Threads that share a tree, such as a library of functions loaded once, each
+ * evaluate it with a context of their own.
+ */
+
+#define PROFILE_MIN_SIZE 64
+
+static size_t
+profile_hash(const struct node *n)
+{
+    size_t h = (size_t) n;
+    h ^= h >> 17;
+    h *= 0xed5ad4bbU;
+    return h ^ (h >> 11);
+}
+
+static int
+profile_grow(struct node_eval_ctx *ctx)
+{
+    struct node_profile_entry *old, *e;
+    size_t size, i, j;
+
+    size = ctx->size ? 2 * ctx->size : PROFILE_MIN_SIZE;
+    e = calloc(size, sizeof(struct node_profile_entry));
+    if (!e)
+        return -1;
+    old = ctx->entries;
+    for (i = 0; i < ctx->size; ++i) {
+        if (!old[i].n)
+            continue;
+        j = profile_hash(old[i].n) & (size - 1);
+        while (e[j].n)
+            j = (j + 1) & (size - 1);
+        e[j] = old[i];
+    }
+    free(old);
+    ctx->entries = e;
+    ctx->size = size;
+    return 0;
+}
+
+/*
+ *  Returns the entry of n, adding one if needed, or NULL if the table could
+ *  not grow; the visit then goes unrecorded.
+ */
+static struct node_profile_entry *
+profile_entry(struct node_eval_ctx *ctx, const struct node *n)
+{
+    size_t i;
+
+    if (4 * (ctx->count + 1) > 3 * ctx->size && profile_grow(ctx))
+        return NULL;
+    i = profile_hash(n) & (ctx->size - 1);
+    while (ctx->entries[i].n && ctx->entries[i].n != n)
+        i = (i + 1) & (ctx->size - 1);
+    if (!ctx->entries[i].n) {
+        ctx->entries[i].n = n;
+        ++ctx->count;
+    }
+    return &ctx->entries[i];
+}
+
+/*!
+ *  \struct node_eval_ctx
+ *
+ *  \brief Step budget and profiling counters for node_compute_ctx().
+ *
+ *  fuel is the number of steps left and steps the number taken so far.
+ *  max_depth is the deepest nesting of node evaluations seen.
+ */
+
+/*!
+ *  Creates an evaluation context with a budget of \a fuel steps, or no limit
+ *  if fuel is NODE_FUEL_UNLIMITED. \a flags selects the profiling counters,
+ *  see enum node_profile_flag.
+ */
+struct node_eval_ctx *
+node_eval_ctx_new(unsigned long fuel, int flags)
+{
+    struct node_eval_ctx *ctx;
+
+    ctx = malloc(sizeof(struct node_eval_ctx));
+    if (!ctx)
+        return NULL;
+    ctx->flags = flags;
+    ctx->entries = NULL;
+    ctx->size = 0;
+    ctx->count = 0;
+    node_eval_ctx_reset(ctx, fuel);
+    return ctx;
+}
+
+/*!
+ *  Destroys the provided context and releases associated memory.
+ */
+void
+node_eval_ctx_destroy(struct node_eval_ctx *ctx)
+{
+    if (!ctx)
+        return;
+
+    free(ctx->entries);
+    free(ctx);
+}
+
+/*!
+ *  Refills the budget to \a fuel steps and clears all counters.
+ */
+void
+node_eval_ctx_reset(struct node_eval_ctx *ctx, unsigned long fuel)
+{
+    ctx->fuel = fuel;
+    ctx->exhausted = 0;
+    ctx->steps = 0;
+    ctx->depth = 0;
+    ctx->max_depth = 0;
+    if (ctx->entries)
+        memset(ctx->entries, 0, ctx->size * sizeof(struct node_profile_entry));
+    ctx->count = 0;
+}
+
+static uint64_t
+clock_nanos(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t) t.tv_sec * 1000000000u + (uint64_t) t.tv_nsec;
+}
+
+static int compute(const struct node *n, const int *x, size_t args, struct node_eval_ctx *ctx);
+
+/*
+ *  The result of a node whose subtree came out negative: NODE_EXHAUSTED if
+ *  the budget ran out, otherwise undefined. A negative argument passed on by
+ *  a projection must not pass for the former.
+ */
+static int
+failed(int i, const struct node_eval_ctx *ctx)
+{
+    return NODE_EXHAUSTED == i && ctx->exhausted ? NODE_EXHAUSTED : -1;
+}
+
+static int
+compute_node(const struct node *n, const int *x, size_t args,
+             struct node_eval_ctx *ctx)
+{
+    union node_d_ptr d_ptr;
+    struct node **curr;
+    int i, j, k, lim;
+
+    switch (n->type)
+    {
+    case NODE_ZERO:
+    case NODE_INVALID:
+        return 0;
+    case NODE_PROJECTION:
+        d_ptr.proj = (struct node_projection *) n->data;
+        j = d_ptr.proj->place;
+        return j < (int) args ? x[j] : -1;
+    case NODE_SUCCESSOR:
+        return (*x) + 1;
+    case NODE_COMPOSITION:
+    {
+        d_ptr.comp = (struct node_composition *) n->data;
+        curr = d_ptr.comp->g;
+        int y[d_ptr.comp->places + 1];
+        j = 0;
+        while (j < d_ptr.comp->places) {
+            i = compute(*curr, x, args, ctx);
+            if (i < 0)
+                return failed(i, ctx);
+            y[j++] = i;
+            ++curr;
+        }
+        return compute(d_ptr.comp->f, y, j, ctx);
+    }
+    case NODE_RECURSION:
+    {
+        if (!args)
+            return -1;
+        d_ptr.rec = (struct node_recursion *) n->data;
+        lim = x[args - 1];
+        i = compute(d_ptr.rec->f, x, args - 1, ctx);
+        if (i < 0)
+            return failed(i, ctx);
+        int nx[args + 1];
+        memcpy(&nx[1], x, (args - 1) * sizeof(int));
+        for (k = 0; k < lim; ++k) {
+            nx[0] = i;
+            nx[args] = k;
+            i = compute(d_ptr.rec->g, nx, args + 1, ctx);
+            if (i < 0)
+                return failed(i, ctx);
+        }
+        return i;
+    }
+    case NODE_SEARCH:
+    {
+        if (!args)
+            return -1;
+        d_ptr.search = (struct node_search *) n->data;
+        int nx[args];
+        memcpy(nx, x, args * sizeof(int));
+        lim = x[args - 1];
+        for (i = 0; i < lim; ++i) {
+            nx[args - 1] = i;
+            j = compute(d_ptr.search->p, nx, args, ctx);
+            if (j < 0)
+                return failed(j, ctx);
+            else if (1 == j)
+                return i;
+        }
+        return lim;
+    }
+    case NODE_KERNEL:
+        d_ptr.kernel = (struct node_kernel *) n->data;
+        if (!node_kernel_applies(d_ptr.kernel, x, args))
+            return compute(d_ptr.kernel->orig, x, args, ctx);
+        return node_kernel_compute(d_ptr.kernel, x, args);
+    } /* end switch */
+
+    /*
+     * We should never reach here!
+     */
+    assert(0);
+    return -1;
+}
+
+static int
+compute(const struct node *n, const int *x, size_t args, struct node_eval_ctx *ctx)
+{
+    struct node_profile_entry *e;
+    uint64_t start;
+    int y;
+
+    if (NODE_FUEL_UNLIMITED != ctx->fuel) {
+        if (!ctx->fuel) {
+            ctx->exhausted = 1;
+            return NODE_EXHAUSTED;
+        }
+        --ctx->fuel;
+    }
+    ++ctx->steps;
+
+    if (args && *x < 0)
+        return -1;
+
+    e = NULL;
+    if (ctx->flags && (e = profile_entry(ctx, n)))
+        ++e->visits;
+
+    if (++ctx->depth > ctx->max_depth)
+        ctx->max_depth = ctx->depth;
+
+    if (e && (ctx->flags & NODE_PROFILE_TIME)) {
+        start = clock_nanos();
+        y = compute_node(n, x, args, ctx);
+        /*
+         *  The table may have moved while the subtree was evaluated.
+         */
+        if ((e = profile_entry(ctx, n)))
+            e->nanos += clock_nanos() - start;
+    } else {
+        y = compute_node(n, x, args, ctx);
+    }
+
+    --ctx->depth;
+    return y;
+}
+
+/*!
+ *  Returns the same result as node_compute(), unless evaluation takes more
+ *  steps than the fuel left in \a ctx, in which case it stops and returns
+ *  NODE_EXHAUSTED. Steps, profiling counters and the remaining fuel carry
+ *  over between calls until node_eval_ctx_reset() is called.
+ *
+ *  The call is reentrant: \a n and \a x are not modified, and \a ctx must not
+ *  be used by another thread at the same time.
+ */
+int
+node_compute_ctx(const struct node *n, const int *x, size_t args,
+                 struct node_eval_ctx *ctx)
+{
+    int y;
+
+    assert(n && ctx);
+    y = compute(n, x, args, ctx);
+    return NODE_EXHAUSTED == y ? failed(y, ctx) : y;
+}
+
+/*!
+ *  Returns the counters of node \a n, or NULL if it has not been visited with
+ *  profiling enabled.
+ */
+const struct node_profile_entry *
+node_eval_ctx_lookup(const struct node_eval_ctx *ctx, const struct node *n)
+{
+    size_t i;
+
+    if (!ctx->size)
+        return NULL;
+    i = profile_hash(n) & (ctx->size - 1);
+    while (ctx->entries[i].n) {
+        if (ctx->entries[i].n == n)
+            return &ctx->entries[i];
+        i = (i + 1) & (ctx->size - 1);
+    }
+    return NULL;
+}
+
+static int
+entry_compare(const void *a, const void *b)
+{
+    const struct node_profile_entry *e, *f;
+
+    e = *(const struct node_profile_entry * const *) a;
+    f = *(const struct node_profile_entry * const *) b;
+    if (e->nanos != f->nanos)
+        return e->nanos < f->nanos ? 1 : -1;
+    if (e->visits != f->visits)
+        return e->visits < f->visits ? 1 : -1;
+    return 0;
+}
+
+/*!
+ *  Appends the profile to \a b as text, one line per visited node with its
+ *  visit count, time in nanoseconds and serialized subtree, separated by tabs
+ *  and sorted with the most expensive nodes first. The first line holds the
+ *  total steps and maximum depth.
+ */
+void
+node_eval_ctx_export(const struct node_eval_ctx *ctx, struct buf *b)
+{
+    const struct node_profile_entry **sorted;
+    size_t i, m;
+    char str[64];
+
+    snprintf(str, sizeof(str), "steps\t%lu\tdepth\t%i\n", ctx->steps, ctx->max_depth);
+    buf_append_chars(b, str);
+
+    sorted = malloc((ctx->count + 1) * sizeof(*sorted));
+    if (!sorted)
+        return;
+    for (i = 0, m = 0; i < ctx->size; ++i)
+        if (ctx->entries[i].n)
+            sorted[m++] = &ctx->entries[i];
+    qsort(sorted, m, sizeof(*sorted), entry_compare);
+
+    for (i = 0; i < m; ++i) {
+        snprintf(str, sizeof(str), "%lu\t%" PRIu64 "\t",
+                 sorted[i]->visits, sorted[i]->nanos);
+        buf_append_chars(b, str);
+        node_serialize(sorted[i]->n, b);
+        buf_append_chars(b, "\n");
+    }
+    free(sorted);
+}
@@ -0,0 +1,59 @@
+#ifndef COMP_EVAL_H
+#define COMP_EVAL_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <limits.h>
+#include "comp.h"
+#include "buf.h"
+
+/*
+ *  Result of node_compute_ctx() when the step budget ran out before the
+ *  evaluation finished. Distinct from -1, which means undefined.
+ */
+#define NODE_EXHAUSTED -2
+
+#define NODE_FUEL_UNLIMITED ULONG_MAX
+
+enum node_profile_flag {
+    NODE_PROFILE_VISITS = 1 << 0,
+    NODE_PROFILE_TIME   = 1 << 1
+};
+
+struct node_profile_entry
+{
+    const struct node *n;
+    unsigned long visits;
+    uint64_t nanos;
+};
+
+struct node_eval_ctx
+{
+    unsigned long fuel;
+    int exhausted;
+    unsigned long steps;
+    int flags;
+    int depth;
+    int max_depth;
+    struct node_profile_entry *entries;
+    size_t size;
+    size_t count;
+};
+
+struct node_eval_ctx *node_eval_ctx_new(unsigned long fuel, int flags);
+void node_eval_ctx_destroy(struct node_eval_ctx *ctx);
+void node_eval_ctx_reset(struct node_eval_ctx *ctx, unsigned long fuel);
+
+int node_compute_ctx(const struct node *n, const int *x, size_t args, struct node_eval_ctx *ctx);
+
+const struct node_profile_entry *node_eval_ctx_lookup(const struct node_eval_ctx *ctx, const struct node *n);
+void node_eval_ctx_export(const struct node_eval_ctx *ctx, struct buf *b);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* COMP_EVAL_H */
@@ -0,0 +1,438 @@
+#include <malloc.h>
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include "comp_flat.h"
+#include "comp_serialize.h"
+
+/*
+ * A flat tree stores all nodes of a tree in one array of fixed size records,
+ * with the data of every node inline and children referred to by their index.
+ * The legs of a composition are a range of indices in a second array, and
+ * kernels, which are larger than a record, live in a third one. Children are
+ * stored before their parents, the root last, so a tree that was built bottom
+ * up sits in memory in the order it is evaluated.
+ *
+ * A record takes 16 bytes and a leg 4, against a heap node with its separate
+ * data block and leg array, each with the allocator's own overhead. Subtrees
+ * that are shared, see node_table_intern(), are stored once.
+ */
+
+/*!
+ *  \struct node_flat
+ *
+ *  \brief A node tree in one array of records, see node_flat_new().
+ */
+
+struct flattener
+{
+    struct node_flat *flat;
+    const struct node **keys;
+    uint32_t *values;
+    size_t size;
+    size_t count;
+};
+
+static int
+grow(void **p, size_t *asize, size_t need, size_t elem)
+{
+    size_t n;
+    void *q;
+
+    if (need <= *asize)
+        return 0;
+    n = *asize ? *asize : 64;
+    while (n < need)
+        n *= 2;
+    if (n > UINT32_MAX)
+        return -1;
+    q = realloc(*p, n * elem);
+    if (!q)
+        return -1;
+    *p = q;
+    *asize = n;
+    return 0;
+}
+
+static size_t
+shared_slot(const struct flattener *c, const struct node *n)
+{
+    size_t i = ((size_t) n >> 4) & (c->size - 1);
+    while (c->keys[i] && c->keys[i] != n)
+        i = (i + 1) & (c->size - 1);
+    return i;
+}
+
+static int
+shared_insert(struct flattener *c, const struct node *n, uint32_t index)
+{
+    const struct node **keys;
+    uint32_t *values;
+    size_t i, j, size;
+
+    if (2 * (c->count + 1) > c->size) {
+        keys = c->keys;
+        values = c->values;
+        size = c->size;
+        c->size = size ? 2 * size : 64;
+        c->keys = calloc(c->size, sizeof(struct node *));
+        c->values = malloc(c->size * sizeof(uint32_t));
+        if (!c->keys || !c->values) {
+            free(keys);
+            free(values);
+            return -1;
+        }
+        for (j = 0; j < size; ++j) {
+            if (keys[j]) {
+                i = shared_slot(c, keys[j]);
+                c->keys[i] = keys[j];
+                c->values[i] = values[j];
+            }
+        }
+        free(keys);
+        free(values);
+    }
+    i = shared_slot(c, n);
+    c->keys[i] = n;
+    c->values[i] = index;
+    ++c->count;
+    return 0;
+}
+
+/*
+ *  Appends n and everything below it, and returns its index, or -1 if out
+ *  of memory.
+ */
+static int64_t
+flatten(struct flattener *c, const struct node *n)
+{
+    struct node_flat *flat = c->flat;
+    struct node_flat_record r;
+    union node_d_ptr d_ptr;
+    int64_t f, g;
+    size_t i;
+
+    if ((n->flags & NODE_FLAG_SHARED) && c->size) {
+        i = shared_slot(c, n);
+        if (c->keys[i])
+            return c->values[i];
+    }
+
+    memset(&r, 0, sizeof(r));
+    r.type = n->type;
+
+    switch (n->type)
+    {
+    case NODE_PROJECTION:
+        r.u.place = ((struct node_projection *) n->data)->place;
+        break;
+    case NODE_COMPOSITION:
+    {
+        d_ptr.comp = (struct node_composition *) n->data;
+        uint32_t legs[d_ptr.comp->places + 1];
+        if ((f = flatten(c, d_ptr.comp->f)) < 0)
+            return -1;
+        for (i = 0; i < (size_t) d_ptr.comp->places; ++i) {
+            if ((g = flatten(c, d_ptr.comp->g[i])) < 0)
+                return -1;
+            legs[i] = (uint32_t) g;
+        }
+        if (grow((void **) &flat->legs, &flat->alegs,
+                 flat->nlegs + d_ptr.comp->places, sizeof(uint32_t)))
+            return -1;
+        memcpy(&flat->legs[flat->nlegs], legs, d_ptr.comp->places * sizeof(uint32_t));
+        r.u.comp.f = (uint32_t) f;
+        r.u.comp.legs = (uint32_t) flat->nlegs;
+        r.u.comp.places = (uint32_t) d_ptr.comp->places;
+        flat->nlegs += d_ptr.comp->places;
+        break;
+    }
+    case NODE_RECURSION:
+        d_ptr.rec = (struct node_recursion *) n->data;
+        if ((f = flatten(c, d_ptr.rec->f)) < 0 || (g = flatten(c, d_ptr.rec->g)) < 0)
+            return -1;
+        r.u.rec.f = (uint32_t) f;
+        r.u.rec.g = (uint32_t) g;
+        break;
+    case NODE_SEARCH:
+        d_ptr.search = (struct node_search *) n->data;
+        if ((f = flatten(c, d_ptr.search->p)) < 0)
+            return -1;
+        r.u.search.p = (uint32_t) f;
+        break;
+    case NODE_KERNEL:
+        d_ptr.kernel = (struct node_kernel *) n->data;
+        f = NODE_FLAT_NONE;
+        if (d_ptr.kernel->orig && (f = flatten(c, d_ptr.kernel->orig)) < 0)
+            return -1;
+        if (grow((void **) &flat->kernels, &flat->akernels,
+                 flat->nkernels + 1, sizeof(struct node_kernel)))
+            return -1;
+        flat->kernels[flat->nkernels] = *d_ptr.kernel;
+        flat->kernels[flat->nkernels].orig = NULL;
+        r.u.kernel.kernel = (uint32_t) flat->nkernels++;
+        r.u.kernel.orig = (uint32_t) f;
+        break;
+    default:
+        break;
+    } /* end switch */
+
+    if (grow((void **) &flat->nodes, &flat->asize, flat->size + 1,
+             sizeof(struct node_flat_record)))
+        return -1;
+    flat->nodes[flat->size] = r;
+    if ((n->flags & NODE_FLAG_SHARED) && shared_insert(c, n, (uint32_t) flat->size))
+        return -1;
+    return (int64_t) flat->size++;
+}
+
+/*!
+ *  Creates a flat copy of the tree \a n, or returns NULL if out of memory.
+ *  The tree itself is left untouched and may be destroyed afterwards.
+ */
+struct node_flat *
+node_flat_new(const struct node *n)
+{
+    struct node_flat *flat;
+    struct flattener c;
+    int64_t root;
+
+    assert(n);
+
+    flat = calloc(1, sizeof(struct node_flat));
+    if (!flat)
+        return NULL;
+    memset(&c, 0, sizeof(c));
+    c.flat = flat;
+    root = flatten(&c, n);
+    free(c.keys);
+    free(c.values);
+    if (root < 0) {
+        node_flat_destroy(flat);
+        return NULL;
+    }
+    flat->root = (uint32_t) root;
+    return flat;
+}
+
+/*!
+ *  Destroys the provided flat tree and releases associated memory.
+ */
+void
+node_flat_destroy(struct node_flat *flat)
+{
+    if (!flat)
+        return;
+
+    free(flat->nodes);
+    free(flat->legs);
+    free(flat->kernels);
+    free(flat);
+}
+
+static struct node *
+to_node(const struct node_flat *flat, uint32_t index)
+{
+    const struct node_flat_record *r = &flat->nodes[index];
+    struct node_kernel kernel;
+    struct node **g;
+    uint32_t i;
+
+    switch (r->type)
+    {
+    case NODE_ZERO:
+        return zero_node_new();
+    case NODE_PROJECTION:
+        return projection_node_new(r->u.place);
+    case NODE_SUCCESSOR:
+        return successor_node_new();
+    case NODE_COMPOSITION:
+        g = node_array_new(r->u.comp.places + 1);
+        for (i = 0; i < r->u.comp.places; ++i)
+            g[i] = to_node(flat, flat->legs[r->u.comp.legs + i]);
+        return composition_node_new(to_node(flat, r->u.comp.f), g);
+    case NODE_RECURSION:
+        return recursion_node_new(to_node(flat, r->u.rec.f), to_node(flat, r->u.rec.g));
+    case NODE_SEARCH:
+        return search_node_new(to_node(flat, r->u.search.p));
+    case NODE_KERNEL:
+        kernel = flat->kernels[r->u.kernel.kernel];
+        if (NODE_FLAT_NONE != r->u.kernel.orig)
+            kernel.orig = to_node(flat, r->u.kernel.orig);
+        return kernel_node_new(&kernel);
+    case NODE_INVALID:
+    default:
+        break;
+    } /* end switch */
+    return invalid_node_new();
+}
+
+/*!
+ *  Returns a new heap allocated tree equal to the one \a flat was made from.
+ *  Shared subtrees are copied once for every place they are used.
+ */
+struct node *
+node_flat_to_node(const struct node_flat *flat)
+{
+    assert(flat);
+    return to_node(flat, flat->root);
+}
+
+static int
+compute(const struct node_flat *flat, uint32_t index, const int *x, size_t args)
+{
+    const struct node_flat_record *r = &flat->nodes[index];
+    const struct node_kernel *kernel;
+    const uint32_t *legs;
+    int i, j, k, lim;
+
+    if (args && *x < 0)
+        return -1;
+
+    switch (r->type)
+    {
+    case NODE_ZERO:
+    case NODE_INVALID:
+        return 0;
+    case NODE_PROJECTION:
+        j = r->u.place;
+        return j < (int) args ? x[j] : -1;
+    case NODE_SUCCESSOR:
+        return (*x) + 1;
+    case NODE_COMPOSITION:
+    {
+        legs = &flat->legs[r->u.comp.legs];
+        int y[r->u.comp.places + 1];
+        for (j = 0; j < (int) r->u.comp.places; ++j) {
+            if ((i = compute(flat, legs[j], x, args)) < 0)
+                return -1;
+            y[j] = i;
+        }
+        return compute(flat, r->u.comp.f, y, j);
+    }
+    case NODE_RECURSION:
+    {
+        if (!args)
+            return -1;
+        lim = x[args - 1];
+        if ((i = compute(flat, r->u.rec.f, x, args - 1)) < 0)
+            return -1;
+        int nx[args + 1];
+        memcpy(&nx[1], x, (args - 1) * sizeof(int));
+        for (k = 0; k < lim; ++k) {
+            nx[0] = i;
+            nx[args] = k;
+            if ((i = compute(flat, r->u.rec.g, nx, args + 1)) < 0)
+                return -1;
+        }
+        return i;
+    }
+    case NODE_SEARCH:
+    {
+        if (!args)
+            return -1;
+        int nx[args];
+        memcpy(nx, x, args * sizeof(int));
+        lim = x[args - 1];
+        for (i = 0; i < lim; ++i) {
+            nx[args - 1] = i;
+            j = compute(flat, r->u.search.p, nx, args);
+            if (j < 0)
+                return -1;
+            else if (1 == j)
+                return i;
+        }
+        return lim;
+    }
+    case NODE_KERNEL:
+        kernel = &flat->kernels[r->u.kernel.kernel];
+        if (!node_kernel_applies(kernel, x, args))
+            return compute(flat, r->u.kernel.orig, x, args);
+        return node_kernel_compute(kernel, x, args);
+    } /* end switch */
+
+    /*
+     * We should never reach here!
+     */
+    assert(0);
+    return -1;
+}
+
+/*!
+ *  Returns the same result as node_compute() for the tree \a flat was made
+ *  from.
+ */
+int
+node_flat_compute(const struct node_flat *flat, const int *x, size_t args)
+{
+    assert(flat);
+    return compute(flat, flat->root, x, args);
+}
+
+static void
+serialize(const struct node_flat *flat, uint32_t index, struct buf *buf)
+{
+    const struct node_flat_record *r = &flat->nodes[index];
+    char str[16];
+    uint32_t i;
+
+    switch (r->type)
+    {
+    case NODE_ZERO:
+        buf_append_chars(buf, "0");
+        break;
+    case NODE_PROJECTION:
+        snprintf(str, sizeof(str), "{%i}", r->u.place);
+        buf_append_chars(buf, str);
+        break;
+    case NODE_SUCCESSOR:
+        buf_append_chars(buf, "+");
+        break;
+    case NODE_COMPOSITION:
+        buf_append_chars(buf, "[");
+        serialize(flat, r->u.comp.f, buf);
+        for (i = 0; i < r->u.comp.places; ++i) {
+            buf_append_chars(buf, ",");
+            serialize(flat, flat->legs[r->u.comp.legs + i], buf);
+        }
+        buf_append_chars(buf, "]");
+        break;
+    case NODE_RECURSION:
+        buf_append_chars(buf, "<");
+        serialize(flat, r->u.rec.f, buf);
+        buf_append_chars(buf, ",");
+        serialize(flat, r->u.rec.g, buf);
+        buf_append_chars(buf, ">");
+        break;
+    case NODE_SEARCH:
+        buf_append_chars(buf, "(");
+        serialize(flat, r->u.search.p, buf);
+        buf_append_chars(buf, ")");
+        break;
+    case NODE_KERNEL:
+        /*
+         *  As in node_serialize(), the original tree, or the constant.
+         */
+        if (NODE_FLAT_NONE != r->u.kernel.orig) {
+            serialize(flat, r->u.kernel.orig, buf);
+            break;
+        }
+        node_serialize_constant(flat->kernels[r->u.kernel.kernel].a.offset, buf);
+        break;
+    case NODE_INVALID:
+    default:
+        buf_append_chars(buf, "X");
+        break;
+    } /* end switch */
+}
+
+/*!
+ *  Appends the text form of \a flat to \a buf, exactly as node_serialize()
+ *  writes the tree it was made from.
+ */
+void
+node_flat_serialize(const struct node_flat *flat, struct buf *buf)
+{
+    assert(flat && buf);
+    serialize(flat, flat->root, buf);
+}
@@ -0,0 +1,67 @@
+#ifndef COMP_FLAT_H
+#define COMP_FLAT_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include "comp.h"
+#include "buf.h"
+
+/*
+ *  Child index of a kernel without an original tree.
+ */
+#define NODE_FLAT_NONE UINT32_MAX
+
+struct node_flat_record
+{
+    uint8_t type;
+    union {
+        int place;
+        struct {
+            uint32_t f;
+            uint32_t legs;
+            uint32_t places;
+        } comp;
+        struct {
+            uint32_t f;
+            uint32_t g;
+        } rec;
+        struct {
+            uint32_t p;
+        } search;
+        struct {
+            uint32_t kernel;
+            uint32_t orig;
+        } kernel;
+    } u;
+};
+
+struct node_flat
+{
+    struct node_flat_record *nodes;
+    size_t size;
+    size_t asize;
+    uint32_t *legs;
+    size_t nlegs;
+    size_t alegs;
+    struct node_kernel *kernels;
+    size_t nkernels;
+    size_t akernels;
+    uint32_t root;
+};
+
+struct node_flat *node_flat_new(const struct node *n);
+void node_flat_destroy(struct node_flat *flat);
+
+struct node *node_flat_to_node(const struct node_flat *flat);
+
+int node_flat_compute(const struct node_flat *flat, const int *x, size_t args);
+void node_flat_serialize(const struct node_flat *flat, struct buf *buf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* COMP_FLAT_H */
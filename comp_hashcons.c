@@ -0,0 +1,538 @@
+#include <malloc.h>
+#include <assert.h>
+#include <string.h>
+#include "comp_hashcons.h"
+
+/*
+ * Hash-consing turns node trees into a DAG in which structurally identical
+ * subtrees are represented by a single node. Since children are interned
+ * before their parents, two nodes are structurally equal exactly when they
+ * have the same type, the same projection place and the same child pointers,
+ * so both hashing and comparison only look one level deep, and equality of
+ * whole subtrees becomes pointer equality.
+ *
+ * Shared nodes carry the NODE_FLAG_SHARED flag and a reference count. The
+ * node_table_* constructors consume one reference to each child they are
+ * given and return a new reference to the result; node_table_release() drops
+ * one, and removes the node from the table when the count reaches zero.
+ */
+
+/*!
+ *  \struct node_table
+ *
+ *  \brief A hash-consing table of shared, reference counted nodes.
+ */
+
+static size_t
+mix(size_t h, size_t v)
+{
+    return (h ^ v) * 0x100000001b3ULL;
+}
+
+static size_t
+node_hash(const struct node *n)
+{
+    union node_d_ptr d_ptr;
+    size_t h;
+    int i;
+
+    h = mix(0xcbf29ce484222325ULL, n->type);
+    switch (n->type)
+    {
+    case NODE_PROJECTION:
+        d_ptr.proj = (struct node_projection *) n->data;
+        h = mix(h, (size_t) d_ptr.proj->place);
+        break;
+    case NODE_COMPOSITION:
+        d_ptr.comp = (struct node_composition *) n->data;
+        h = mix(h, (size_t) d_ptr.comp->f);
+        for (i = 0; i < d_ptr.comp->places; ++i)
+            h = mix(h, (size_t) d_ptr.comp->g[i]);
+        break;
+    case NODE_RECURSION:
+        d_ptr.rec = (struct node_recursion *) n->data;
+        h = mix(mix(h, (size_t) d_ptr.rec->f), (size_t) d_ptr.rec->g);
+        break;
+    case NODE_SEARCH:
+        d_ptr.search = (struct node_search *) n->data;
+        h = mix(h, (size_t) d_ptr.search->p);
+        break;
+    case NODE_KERNEL:
+        d_ptr.kernel = (struct node_kernel *) n->data;
+        h = mix(h, (size_t) d_ptr.kernel->a.offset);
+        break;
+    default:
+        break;
+    } /* end switch */
+    return h ^ (h >> 31);
+}
+
+static int
+node_equal(const struct node *a, const struct node *b)
+{
+    union node_d_ptr d, e;
+
+    if (a->type != b->type)
+        return 0;
+
+    switch (a->type)
+    {
+    case NODE_PROJECTION:
+        d.proj = (struct node_projection *) a->data;
+        e.proj = (struct node_projection *) b->data;
+        return d.proj->place == e.proj->place;
+    case NODE_COMPOSITION:
+        d.comp = (struct node_composition *) a->data;
+        e.comp = (struct node_composition *) b->data;
+        return d.comp->f == e.comp->f && d.comp->places == e.comp->places
+                && (!d.comp->places || !memcmp(d.comp->g, e.comp->g,
+                                               d.comp->places * sizeof(struct node *)));
+    case NODE_RECURSION:
+        d.rec = (struct node_recursion *) a->data;
+        e.rec = (struct node_recursion *) b->data;
+        return d.rec->f == e.rec->f && d.rec->g == e.rec->g;
+    case NODE_SEARCH:
+        d.search = (struct node_search *) a->data;
+        e.search = (struct node_search *) b->data;
+        return d.search->p == e.search->p;
+    case NODE_KERNEL:
+        /*
+         *  Only constants are shared as kernels.
+         */
+        d.kernel = (struct node_kernel *) a->data;
+        e.kernel = (struct node_kernel *) b->data;
+        return d.kernel->a.offset == e.kernel->a.offset;
+    default:
+        break;
+    } /* end switch */
+    return 1;
+}
+
+/*
+ *  Frees a single node without touching its children.
+ */
+static void
+node_free(struct node *n)
+{
+    if (NODE_COMPOSITION == n->type)
+        free(((struct node_composition *) n->data)->g);
+    free(n->data);
+    free(n);
+}
+
+static int
+table_grow(struct node_table *table)
+{
+    struct node **slots, **old;
+    size_t *hashes, *oldh;
+    size_t size, oldsize, i, j;
+
+    oldsize = table->size;
+    size = oldsize ? 2 * oldsize : 64;
+    slots = calloc(size, sizeof(struct node *));
+    hashes = malloc(size * sizeof(size_t));
+    if (!slots || !hashes) {
+        free(slots);
+        free(hashes);
+        return -1;
+    }
+    old = table->slots;
+    oldh = table->hashes;
+    for (i = 0; i < oldsize; ++i) {
+        if (!old[i])
+            continue;
+        j = oldh[i] & (size - 1);
+        while (slots[j])
+            j = (j + 1) & (size - 1);
+        slots[j] = old[i];
+        hashes[j] = oldh[i];
+    }
+    free(old);
+    free(oldh);
+    table->slots = slots;
+    table->hashes = hashes;
+    table->size = size;
+    return 0;
+}
+
+static void
+table_remove(struct node_table *table, const struct node *n)
+{
+    size_t i, j, k;
+
+    i = node_hash(n) & (table->size - 1);
+    while (table->slots[i] != n)
+        i = (i + 1) & (table->size - 1);
+
+    /*
+     *  Shift later members of the probe sequence back into the hole, so that
+     *  lookups never need tombstones.
+     */
+    j = i;
+    for (;;) {
+        table->slots[i] = NULL;
+        do {
+            j = (j + 1) & (table->size - 1);
+            if (!table->slots[j]) {
+                --table->count;
+                return;
+            }
+            k = table->hashes[j] & (table->size - 1);
+        } while (i <= j ? (i < k && k <= j) : (i < k || k <= j));
+        table->slots[i] = table->slots[j];
+        table->hashes[i] = table->hashes[j];
+        i = j;
+    }
+}
+
+/*
+ *  Returns a new reference to the node in the table that is equal to key, or
+ *  NULL if there is none. The key may live on the stack.
+ */
+static struct node *
+table_lookup(struct node_table *table, const struct node *key)
+{
+    size_t h, i;
+    struct node *n;
+
+    h = node_hash(key);
+    if (table->size) {
+        i = h & (table->size - 1);
+        while ((n = table->slots[i])) {
+            if (table->hashes[i] == h && node_equal(n, key)) {
+                ++n->refs;
+                return n;
+            }
+            i = (i + 1) & (table->size - 1);
+        }
+    }
+    return NULL;
+}
+
+/*
+ *  Drops the references a node holds to its children.
+ */
+static void
+release_children(struct node_table *table, struct node *n)
+{
+    union node_d_ptr d_ptr;
+    int i;
+
+    switch (n->type)
+    {
+    case NODE_COMPOSITION:
+        d_ptr.comp = (struct node_composition *) n->data;
+        for (i = 0; i < d_ptr.comp->places; ++i)
+            node_table_release(table, d_ptr.comp->g[i]);
+        node_table_release(table, d_ptr.comp->f);
+        break;
+    case NODE_RECURSION:
+        d_ptr.rec = (struct node_recursion *) n->data;
+        node_table_release(table, d_ptr.rec->f);
+        node_table_release(table, d_ptr.rec->g);
+        break;
+    case NODE_SEARCH:
+        d_ptr.search = (struct node_search *) n->data;
+        node_table_release(table, d_ptr.search->p);
+        break;
+    default:
+        break;
+    } /* end switch */
+}
+
+/*
+ *  Adds the new node n to the table. If that fails, n is freed and the
+ *  references to its children it took over are dropped.
+ */
+static struct node *
+table_insert(struct node_table *table, struct node *n)
+{
+    size_t h, i;
+
+    if (!n)
+        return NULL;
+    if (2 * (table->count + 1) > table->size && table_grow(table) < 0) {
+        release_children(table, n);
+        node_free(n);
+        return NULL;
+    }
+    h = node_hash(n);
+    i = h & (table->size - 1);
+    while (table->slots[i])
+        i = (i + 1) & (table->size - 1);
+    table->slots[i] = n;
+    table->hashes[i] = h;
+    ++table->count;
+    n->flags |= NODE_FLAG_SHARED;
+    n->refs = 1;
+    return n;
+}
+
+/*!
+ *  Creates a new, empty hash-consing table.
+ */
+struct node_table *
+node_table_new()
+{
+    struct node_table *table;
+    table = malloc(sizeof(struct node_table));
+    if (table) {
+        table->slots = NULL;
+        table->hashes = NULL;
+        table->size = 0;
+        table->count = 0;
+    }
+    return table;
+}
+
+/*!
+ *  Destroys the table together with every node in it, regardless of any
+ *  references still held.
+ */
+void
+node_table_destroy(struct node_table *table)
+{
+    size_t i;
+
+    if (!table)
+        return;
+
+    for (i = 0; i < table->size; ++i)
+        if (table->slots[i])
+            node_free(table->slots[i]);
+    free(table->slots);
+    free(table->hashes);
+    free(table);
+}
+
+static struct node *
+leaf(struct node_table *table, uint8_t type)
+{
+    struct node key, *n;
+
+    key.type = type;
+    key.data = NULL;
+    if ((n = table_lookup(table, &key)))
+        return n;
+    return table_insert(table, NODE_ZERO == type ? zero_node_new()
+                               : NODE_SUCCESSOR == type ? successor_node_new()
+                               : invalid_node_new());
+}
+
+/*!
+ *  Returns a reference to the shared zero function node.
+ */
+struct node *
+node_table_zero(struct node_table *table)
+{
+    return leaf(table, NODE_ZERO);
+}
+
+/*!
+ *  Returns a reference to the shared successor function node.
+ */
+struct node *
+node_table_successor(struct node_table *table)
+{
+    return leaf(table, NODE_SUCCESSOR);
+}
+
+/*!
+ *  Returns a reference to the shared invalid node.
+ */
+struct node *
+node_table_invalid(struct node_table *table)
+{
+    return leaf(table, NODE_INVALID);
+}
+
+/*!
+ *  Returns a reference to the shared projection node for \a place.
+ */
+struct node *
+node_table_projection(struct node_table *table, int place)
+{
+    struct node key, *n;
+    struct node_projection proj;
+
+    proj.place = place;
+    key.type = NODE_PROJECTION;
+    key.data = &proj;
+    if ((n = table_lookup(table, &key)))
+        return n;
+    return table_insert(table, projection_node_new(place));
+}
+
+/*!
+ *  Returns a reference to the shared constant kernel for \a value, where a
+ *  negative value stands for the undefined constant.
+ */
+struct node *
+node_table_constant(struct node_table *table, int value)
+{
+    struct node key, *n;
+    struct node_kernel kernel;
+
+    kernel.a.offset = value < 0 ? -1 : value;
+    key.type = NODE_KERNEL;
+    key.data = &kernel;
+    if ((n = table_lookup(table, &key)))
+        return n;
+    return table_insert(table, constant_node_new(value));
+}
+
+/*!
+ *  Returns a reference to the shared composition of \a f with the NULL
+ *  terminated array \a g. Takes over the references to \a f and to the
+ *  elements of \a g, as well as the array itself.
+ */
+struct node *
+node_table_composition(struct node_table *table, struct node *f, struct node **g)
+{
+    struct node key, *n, **curr;
+    struct node_composition comp;
+
+    comp.f = f;
+    comp.g = g;
+    for (curr = g; curr && *curr; ++curr)
+        ;
+    comp.places = (int) (curr - g);
+    key.type = NODE_COMPOSITION;
+    key.data = &comp;
+    if ((n = table_lookup(table, &key))) {
+        node_table_release(table, f);
+        for (curr = g; curr && *curr; ++curr)
+            node_table_release(table, *curr);
+        free(g);
+        return n;
+    }
+    return table_insert(table, composition_node_new(f, g));
+}
+
+/*!
+ *  Returns a reference to the shared recursion node for \a f and \a g, taking
+ *  over the references to both.
+ */
+struct node *
+node_table_recursion(struct node_table *table, struct node *f, struct node *g)
+{
+    struct node key, *n;
+    struct node_recursion rec;
+
+    rec.f = f;
+    rec.g = g;
+    key.type = NODE_RECURSION;
+    key.data = &rec;
+    if ((n = table_lookup(table, &key))) {
+        node_table_release(table, f);
+        node_table_release(table, g);
+        return n;
+    }
+    return table_insert(table, recursion_node_new(f, g));
+}
+
+/*!
+ *  Returns a reference to the shared search node for \a p, taking over the
+ *  reference to it.
+ */
+struct node *
+node_table_search(struct node_table *table, struct node *p)
+{
+    struct node key, *n;
+    struct node_search search;
+
+    search.p = p;
+    key.type = NODE_SEARCH;
+    key.data = &search;
+    if ((n = table_lookup(table, &key))) {
+        node_table_release(table, p);
+        return n;
+    }
+    return table_insert(table, search_node_new(p));
+}
+
+/*!
+ *  Returns a reference to the shared equivalent of the (unshared) tree \a n,
+ *  which is left untouched.
+ */
+struct node *
+node_table_intern(struct node_table *table, const struct node *n)
+{
+    union node_d_ptr d_ptr;
+    struct node **g;
+    int i;
+
+    if (!n)
+        return NULL;
+    if (n->flags & NODE_FLAG_SHARED)
+        return node_retain((struct node *) n);
+
+    switch (n->type)
+    {
+    case NODE_ZERO:
+        return node_table_zero(table);
+    case NODE_SUCCESSOR:
+        return node_table_successor(table);
+    case NODE_PROJECTION:
+        d_ptr.proj = (struct node_projection *) n->data;
+        return node_table_projection(table, d_ptr.proj->place);
+    case NODE_COMPOSITION:
+        d_ptr.comp = (struct node_composition *) n->data;
+        g = node_array_new(d_ptr.comp->places + 1);
+        for (i = 0; i < d_ptr.comp->places; ++i)
+            g[i] = node_table_intern(table, d_ptr.comp->g[i]);
+        return node_table_composition(table,
+                                      node_table_intern(table, d_ptr.comp->f), g);
+    case NODE_RECURSION:
+        d_ptr.rec = (struct node_recursion *) n->data;
+        return node_table_recursion(table,
+                                    node_table_intern(table, d_ptr.rec->f),
+                                    node_table_intern(table, d_ptr.rec->g));
+    case NODE_SEARCH:
+        d_ptr.search = (struct node_search *) n->data;
+        return node_table_search(table, node_table_intern(table, d_ptr.search->p));
+    case NODE_KERNEL:
+        /*
+         *  Kernels are not shared, the tree they stand for is. Constants
+         *  have none and are shared as they are.
+         */
+        d_ptr.kernel = (struct node_kernel *) n->data;
+        if (d_ptr.kernel->orig)
+            return node_table_intern(table, d_ptr.kernel->orig);
+        return node_table_constant(table, d_ptr.kernel->a.offset);
+    case NODE_INVALID:
+    default:
+        break;
+    } /* end switch */
+    return node_table_invalid(table);
+}
+
+/*!
+ *  Adds a reference to the shared node \a n and returns it.
+ */
+struct node *
+node_retain(struct node *n)
+{
+    assert(n && (n->flags & NODE_FLAG_SHARED));
+    ++n->refs;
+    return n;
+}
+
+/*!
+ *  Drops a reference to the shared node \a n. The last reference removes the
+ *  node from the table and releases its children.
+ */
+void
+node_table_release(struct node_table *table, struct node *n)
+{
+    if (!n)
+        return;
+
+    assert(n->flags & NODE_FLAG_SHARED);
+    if (--n->refs)
+        return;
+
+    table_remove(table, n);
+    release_children(table, n);
+    node_free(n);
+}
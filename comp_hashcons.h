@@ -0,0 +1,40 @@
+#ifndef COMP_HASHCONS_H
+#define COMP_HASHCONS_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include "comp.h"
+
+struct node_table
+{
+    struct node **slots;
+    size_t *hashes;
+    size_t size;
+    size_t count;
+};
+
+struct node_table *node_table_new();
+void node_table_destroy(struct node_table *table);
+
+struct node *node_table_zero(struct node_table *table);
+struct node *node_table_successor(struct node_table *table);
+struct node *node_table_invalid(struct node_table *table);
+struct node *node_table_projection(struct node_table *table, int place);
+struct node *node_table_constant(struct node_table *table, int value);
+struct node *node_table_composition(struct node_table *table, struct node *f, struct node **g);
+struct node *node_table_recursion(struct node_table *table, struct node *f, struct node *g);
+struct node *node_table_search(struct node_table *table, struct node *p);
+
+struct node *node_table_intern(struct node_table *table, const struct node *n);
+
+struct node *node_retain(struct node *n);
+void node_table_release(struct node_table *table, struct node *n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* COMP_HASHCONS_H */
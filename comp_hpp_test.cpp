@@ -0,0 +1,65 @@
+#include <cassert>
+#include "comp.hpp"
+#include "comp_serialize.h"
+
+extern "C" void comp_hpp_test(void);
+
+namespace
+{
+
+using namespace kompu;
+
+using add = rec<proj<0>, comp<succ, proj<0>>>;
+using mult = rec<zero, comp<add, proj<0>, proj<1>>>;
+using iszero = rec<comp<succ, zero>, zero>;
+using pred = rec<zero, proj<1>>;
+using monus = rec<proj<0>, comp<pred, proj<0>>>;
+using minimum = search<comp<iszero, comp<monus, proj<0>, proj<1>>>>;
+
+static_assert(eval<add>(2, 3) == 5);
+static_assert(eval<mult>(6, 7) == 42);
+static_assert(eval<monus>(3, 5) == 0 && eval<monus>(5, 3) == 2);
+static_assert(eval<minimum>(3, 5) == 3 && eval<minimum>(5, 3) == 3);
+static_assert(eval<proj<2>>(1, 2) == -1);
+static_assert(eval<mult>(-1, 2) == -1);
+
+/*
+ *  The tree of F serializes to text, and agrees with F on small arguments.
+ */
+template <class F>
+void
+check(const char *text)
+{
+    struct node *n;
+    struct buf *b, *c;
+    int x[2];
+
+    n = F::to_node();
+    b = buf_new(64);
+    c = buf_new(64);
+    buf_append_chars(b, text);
+    node_serialize(n, c);
+    assert(buf_compare(b, c));
+    buf_destroy(b);
+    buf_destroy(c);
+
+    for (x[0] = -1; x[0] < 6; ++x[0]) {
+        for (x[1] = 0; x[1] < 6; ++x[1]) {
+            assert(node_compute(n, x, 2) == eval<F>(x[0], x[1]));
+            assert(node_compute(n, x, 1) == eval<F>(x[0]));
+        }
+    }
+    node_destroy(n);
+}
+
+} /* namespace */
+
+void
+comp_hpp_test(void)
+{
+    check<add>("<{0},[+,{0}]>");
+    check<mult>("<0,[<{0},[+,{0}]>,{0},{1}]>");
+    check<monus>("<{0},[<0,{1}>,{0}]>");
+    check<minimum>("([<[+,0],0>,[<{0},[<0,{1}>,{0}]>,{0},{1}]])");
+    check<comp<proj<1>, zero, succ, proj<3>>>("[{1},0,+,{3}]");
+}
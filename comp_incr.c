@@ -0,0 +1,463 @@
+#include <malloc.h>
+#include <assert.h>
+#include <string.h>
+#include "comp_incr.h"
+
+/*
+ * Incremental evaluation keeps the result of every composition, recursion
+ * and search it evaluates, keyed on the node and its arguments, for as long
+ * as the tree is only edited through node_incr_replace(). A node computes a
+ * function of its subtree alone, so a result depends exactly on the nodes
+ * below the one it belongs to. When a subtree is replaced, the results that
+ * depended on it are those of the nodes on the path from the root down to
+ * it, and of the nodes in the old subtree; these are dropped, and everything
+ * else is kept. Evaluating the edited tree again recomputes the path, while
+ * the siblings along it are answered from the table.
+ *
+ * Results inside the step function of a recursion or the predicate of a
+ * search are not kept, as there would be one per step; the loop as a whole
+ * is. Leaves and kernels are cheaper to evaluate than to look up, and calls
+ * with more than NODE_INCR_MAX_ARGS arguments are evaluated without the
+ * table.
+ */
+
+/*!
+ *  \struct node_incr
+ *
+ *  \brief A node tree together with the results retained from evaluating
+ *  it, see node_incr_new().
+ */
+
+#define INCR_MIN_SIZE 64
+
+/*
+ *  A sorted set of node addresses, the nodes whose results are dropped.
+ */
+struct node_set
+{
+    const struct node **nodes;
+    size_t count;
+    size_t size;
+};
+
+static size_t
+incr_hash(const struct node *n, const int *x, size_t args)
+{
+    size_t h, i;
+
+    h = (size_t) n * 0x9e3779b97f4a7c15ULL;
+    for (i = 0; i < args; ++i)
+        h = (h ^ (size_t) x[i]) * 0x100000001b3ULL;
+    return h ^ (h >> 29);
+}
+
+static struct node_incr_entry *
+incr_slot(struct node_incr_entry *entries, size_t size, const struct node *n,
+          const int *x, size_t args)
+{
+    size_t i;
+
+    i = incr_hash(n, x, args) & (size - 1);
+    while (entries[i].n && (entries[i].n != n || entries[i].args != (int) args
+                            || memcmp(entries[i].x, x, args * sizeof(int))))
+        i = (i + 1) & (size - 1);
+    return &entries[i];
+}
+
+static int
+node_ptr_compare(const void *a, const void *b)
+{
+    const struct node *m, *n;
+
+    m = *(const struct node * const *) a;
+    n = *(const struct node * const *) b;
+    return m < n ? -1 : m > n;
+}
+
+/*
+ *  Moves the entries of nodes not in drop, or all if drop is NULL, to a new
+ *  table of the given size.
+ */
+static int
+incr_rehash(struct node_incr *inc, size_t size, const struct node_set *drop)
+{
+    struct node_incr_entry *entries, *e;
+    size_t i;
+
+    entries = calloc(size, sizeof(struct node_incr_entry));
+    if (!entries)
+        return -1;
+    inc->count = 0;
+    for (i = 0; i < inc->size; ++i) {
+        e = &inc->entries[i];
+        if (!e->n)
+            continue;
+        if (drop && bsearch(&e->n, drop->nodes, drop->count,
+                            sizeof(struct node *), node_ptr_compare))
+            continue;
+        *incr_slot(entries, size, e->n, e->x, e->args) = *e;
+        ++inc->count;
+    }
+    free(inc->entries);
+    inc->entries = entries;
+    inc->size = size;
+    return 0;
+}
+
+static int
+incr_lookup(struct node_incr *inc, const struct node *n, const int *x,
+            size_t args, int *y)
+{
+    struct node_incr_entry *e;
+
+    if (inc->size) {
+        e = incr_slot(inc->entries, inc->size, n, x, args);
+        if (e->n) {
+            *y = e->y;
+            ++inc->hits;
+            return 1;
+        }
+    }
+    ++inc->misses;
+    return 0;
+}
+
+/*
+ *  Keeps the result y; if the table cannot grow, the result is simply not
+ *  kept.
+ */
+static void
+incr_insert(struct node_incr *inc, const struct node *n, const int *x,
+            size_t args, int y)
+{
+    struct node_incr_entry *e;
+
+    if (4 * (inc->count + 1) > 3 * inc->size
+            && incr_rehash(inc, inc->size ? 2 * inc->size : INCR_MIN_SIZE, NULL))
+        return;
+    e = incr_slot(inc->entries, inc->size, n, x, args);
+    e->n = n;
+    e->args = (int) args;
+    e->y = y;
+    memcpy(e->x, x, args * sizeof(int));
+    ++inc->count;
+}
+
+/*!
+ *  Creates an incremental evaluator for the tree \a root, which it takes
+ *  over. The tree must be an ordinary heap allocated tree, and be changed
+ *  only through node_incr_replace() from now on. Returns NULL if out of
+ *  memory.
+ */
+struct node_incr *
+node_incr_new(struct node *root)
+{
+    struct node_incr *inc;
+
+    assert(root && !(root->flags & (NODE_FLAG_ARENA | NODE_FLAG_SHARED)));
+
+    inc = malloc(sizeof(struct node_incr));
+    if (!inc)
+        return NULL;
+    inc->root = root;
+    inc->entries = NULL;
+    inc->size = 0;
+    inc->count = 0;
+    inc->hits = 0;
+    inc->misses = 0;
+    return inc;
+}
+
+/*!
+ *  Destroys the evaluator together with its tree.
+ */
+void
+node_incr_destroy(struct node_incr *inc)
+{
+    if (!inc)
+        return;
+
+    node_destroy(inc->root);
+    free(inc->entries);
+    free(inc);
+}
+
+/*!
+ *  Drops all retained results and resets the counters.
+ */
+void
+node_incr_clear(struct node_incr *inc)
+{
+    free(inc->entries);
+    inc->entries = NULL;
+    inc->size = 0;
+    inc->count = 0;
+    inc->hits = 0;
+    inc->misses = 0;
+}
+
+static int compute(const struct node *n, const int *x, size_t args,
+                   struct node_incr *inc, int keep);
+
+/*
+ *  Evaluates the composition, recursion or search n. The results of the
+ *  nodes below it are retained if keep is set, which it never is inside the
+ *  body of a loop.
+ */
+static int
+compute_node(const struct node *n, const int *x, size_t args,
+             struct node_incr *inc, int keep)
+{
+    union node_d_ptr d_ptr;
+    struct node **curr;
+    int i, j, k, lim;
+
+    switch (n->type)
+    {
+    case NODE_COMPOSITION:
+    {
+        d_ptr.comp = (struct node_composition *) n->data;
+        curr = d_ptr.comp->g;
+        int y[d_ptr.comp->places + 1];
+        for (j = 0; j < d_ptr.comp->places; ++j) {
+            if ((i = compute(curr[j], x, args, inc, keep)) < 0)
+                return -1;
+            y[j] = i;
+        }
+        return compute(d_ptr.comp->f, y, j, inc, keep);
+    }
+    case NODE_RECURSION:
+    {
+        if (!args)
+            return -1;
+        d_ptr.rec = (struct node_recursion *) n->data;
+        lim = x[args - 1];
+        if ((i = compute(d_ptr.rec->f, x, args - 1, inc, keep)) < 0)
+            return -1;
+        int nx[args + 1];
+        memcpy(&nx[1], x, (args - 1) * sizeof(int));
+        for (k = 0; k < lim; ++k) {
+            nx[0] = i;
+            nx[args] = k;
+            if ((i = compute(d_ptr.rec->g, nx, args + 1, inc, 0)) < 0)
+                return -1;
+        }
+        return i;
+    }
+    case NODE_SEARCH:
+    {
+        if (!args)
+            return -1;
+        d_ptr.search = (struct node_search *) n->data;
+        int nx[args];
+        memcpy(nx, x, args * sizeof(int));
+        lim = x[args - 1];
+        for (i = 0; i < lim; ++i) {
+            nx[args - 1] = i;
+            j = compute(d_ptr.search->p, nx, args, inc, 0);
+            if (j < 0)
+                return -1;
+            else if (1 == j)
+                return i;
+        }
+        return lim;
+    }
+    default:
+        break;
+    } /* end switch */
+
+    /*
+     * We should never reach here!
+     */
+    assert(0);
+    return -1;
+}
+
+static int
+compute(const struct node *n, const int *x, size_t args, struct node_incr *inc,
+        int keep)
+{
+    int y;
+
+    if (args && *x < 0)
+        return -1;
+
+    switch (n->type)
+    {
+    case NODE_COMPOSITION:
+    case NODE_RECURSION:
+    case NODE_SEARCH:
+        break;
+    default:
+        return node_compute(n, x, args);
+    } /* end switch */
+
+    if (!keep || args > NODE_INCR_MAX_ARGS)
+        return compute_node(n, x, args, inc, 0);
+    if (incr_lookup(inc, n, x, args, &y))
+        return y;
+    if ((y = compute_node(n, x, args, inc, 1)) >= 0)
+        incr_insert(inc, n, x, args, y);
+    return y;
+}
+
+/*!
+ *  Returns the same result as node_compute() for the tree of \a inc, reusing
+ *  and adding to the results retained from earlier calls. The hit and miss
+ *  counters count the results found in, and missing from, the table.
+ */
+int
+node_incr_compute(struct node_incr *inc, const int *x, size_t args)
+{
+    assert(inc && (x || !args));
+    return compute(inc->root, x, args, inc, 1);
+}
+
+static int
+node_set_add(struct node_set *set, const struct node *n)
+{
+    const struct node **nodes;
+    size_t size;
+
+    if (set->count == set->size) {
+        size = set->size ? 2 * set->size : INCR_MIN_SIZE;
+        nodes = realloc(set->nodes, size * sizeof(struct node *));
+        if (!nodes)
+            return -1;
+        set->nodes = nodes;
+        set->size = size;
+    }
+    set->nodes[set->count++] = n;
+    return 0;
+}
+
+/*
+ *  Adds n and every node below it to set.
+ */
+static int
+node_set_add_tree(struct node_set *set, const struct node *n)
+{
+    union node_d_ptr d_ptr;
+    int i;
+
+    if (!n)
+        return 0;
+    if (node_set_add(set, n))
+        return -1;
+
+    switch (n->type)
+    {
+    case NODE_COMPOSITION:
+        d_ptr.comp = (struct node_composition *) n->data;
+        for (i = 0; i < d_ptr.comp->places; ++i)
+            if (node_set_add_tree(set, d_ptr.comp->g[i]))
+                return -1;
+        return node_set_add_tree(set, d_ptr.comp->f);
+    case NODE_RECURSION:
+        d_ptr.rec = (struct node_recursion *) n->data;
+        if (node_set_add_tree(set, d_ptr.rec->f))
+            return -1;
+        return node_set_add_tree(set, d_ptr.rec->g);
+    case NODE_SEARCH:
+        return node_set_add_tree(set, ((struct node_search *) n->data)->p);
+    case NODE_KERNEL:
+        return node_set_add_tree(set, ((struct node_kernel *) n->data)->orig);
+    default:
+        break;
+    } /* end switch */
+    return 0;
+}
+
+static int node_set_add_path(struct node_set *set, const struct node *n,
+                             struct node **slot);
+
+static int
+path_child(struct node_set *set, struct node **child, struct node **slot)
+{
+    return child == slot ? 1 : node_set_add_path(set, *child, slot);
+}
+
+/*
+ *  Adds the nodes from n down to the one holding slot to set. Returns 1 if
+ *  slot is in the subtree of n, 0 if not, and -1 if out of memory. Kernels
+ *  are not searched, as their trees can not be edited on their own.
+ */
+static int
+node_set_add_path(struct node_set *set, const struct node *n, struct node **slot)
+{
+    union node_d_ptr d_ptr;
+    int i, found;
+
+    found = 0;
+    switch (n->type)
+    {
+    case NODE_COMPOSITION:
+        d_ptr.comp = (struct node_composition *) n->data;
+        found = path_child(set, &d_ptr.comp->f, slot);
+        for (i = 0; !found && i < d_ptr.comp->places; ++i)
+            found = path_child(set, &d_ptr.comp->g[i], slot);
+        break;
+    case NODE_RECURSION:
+        d_ptr.rec = (struct node_recursion *) n->data;
+        if (!(found = path_child(set, &d_ptr.rec->f, slot)))
+            found = path_child(set, &d_ptr.rec->g, slot);
+        break;
+    case NODE_SEARCH:
+        d_ptr.search = (struct node_search *) n->data;
+        found = path_child(set, &d_ptr.search->p, slot);
+        break;
+    default:
+        break;
+    } /* end switch */
+
+    if (found > 0 && node_set_add(set, n))
+        return -1;
+    return found;
+}
+
+/*!
+ *  Replaces the subtree at \a slot, which is &inc->root or a child pointer
+ *  inside the tree of \a inc, such as &comp->g[1] of one of its compositions,
+ *  by \a n. The old subtree is destroyed, and the results that depended on it
+ *  are dropped while all others are kept, and so is the node_analyze() result
+ *  of the nodes on the way to slot. Returns 0 on success, or -1 if
+ *  slot is not part of the tree or memory ran out, in which case nothing is
+ *  changed and \a n still belongs to the caller.
+ */
+int
+node_incr_replace(struct node_incr *inc, struct node **slot, struct node *n)
+{
+    struct node_set drop;
+    size_t i;
+    int found;
+
+    assert(inc && slot && n);
+    assert(!(n->flags & (NODE_FLAG_ARENA | NODE_FLAG_SHARED)));
+
+    if (slot == &inc->root) {
+        node_incr_clear(inc);
+        node_destroy(inc->root);
+        inc->root = n;
+        return 0;
+    }
+
+    memset(&drop, 0, sizeof(drop));
+    found = node_set_add_path(&drop, inc->root, slot);
+    if (found <= 0 || node_set_add_tree(&drop, *slot) < 0) {
+        free(drop.nodes);
+        return -1;
+    }
+    qsort(drop.nodes, drop.count, sizeof(struct node *), node_ptr_compare);
+    if (inc->size && incr_rehash(inc, inc->size, &drop)) {
+        free(drop.nodes);
+        return -1;
+    }
+    for (i = 0; i < drop.count; ++i)
+        ((struct node *) drop.nodes[i])->flags &=
+            ~(NODE_FLAG_ANALYZED | NODE_FLAG_WELL_FORMED);
+    free(drop.nodes);
+
+    node_destroy(*slot);
+    *slot = n;
+    return 0;
+}
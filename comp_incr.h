@@ -0,0 +1,42 @@
+#ifndef COMP_INCR_H
+#define COMP_INCR_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include "comp.h"
+
+#define NODE_INCR_MAX_ARGS 8
+
+struct node_incr_entry
+{
+    const struct node *n;
+    int args;
+    int y;
+    int x[NODE_INCR_MAX_ARGS];
+};
+
+struct node_incr
+{
+    struct node *root;
+    struct node_incr_entry *entries;
+    size_t size;
+    size_t count;
+    unsigned long hits;
+    unsigned long misses;
+};
+
+struct node_incr *node_incr_new(struct node *root);
+void node_incr_destroy(struct node_incr *inc);
+void node_incr_clear(struct node_incr *inc);
+
+int node_incr_compute(struct node_incr *inc, const int *x, size_t args);
+int node_incr_replace(struct node_incr *inc, struct node **slot, struct node *n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* COMP_INCR_H */
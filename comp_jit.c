@@ -0,0 +1,624 @@
+#include <malloc.h>
+#include <assert.h>
+#include <string.h>
+#include "comp_jit.h"
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#define JIT_X86_64 1
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+/*
+ * The JIT translates a node tree into x86-64 machine code. Since the arity
+ * of every subtree follows from the arity of the root, each pair of a node
+ * and the number of arguments it is called with becomes one native function
+ * int fn(const int *x), compiled once however often it is used.
+ *
+ * Inside a function rbx holds x, and values are returned in eax. Recursion
+ * and search become loops with the bound in r12d and the counter in r13d,
+ * and the argument vector of the step function or predicate lives in the
+ * stack frame. Zero, successor and projection are never called, but inlined
+ * as register operations wherever they occur, and a composition calls its
+ * legs and outer function directly. Kernels call node_kernel_compute(), or
+ * node_compute() on their original tree if an operand they read is negative.
+ *
+ * Code is written to an anonymous mapping that is made executable, and not
+ * writable, once all calls between the functions have been resolved. On
+ * other architectures node_jit_compile() still succeeds, and node_jit_run()
+ * uses node_compute().
+ */
+
+#ifdef JIT_X86_64
+
+enum {
+    JIT_RBX = 0,
+    JIT_RSP
+};
+
+struct jit_func
+{
+    const struct node *n;
+    int args;
+    size_t offset;
+};
+
+struct jit_fixup
+{
+    size_t pos;
+    size_t target;
+};
+
+struct jit
+{
+    unsigned char *code;
+    size_t size;
+    size_t asize;
+    struct jit_func *funcs;
+    size_t nfuncs;
+    size_t afuncs;
+    struct jit_fixup *calls;
+    size_t ncalls;
+    size_t acalls;
+    size_t *undefined;
+    size_t nundefined;
+    size_t aundefined;
+    int failed;
+};
+
+static void *
+jit_grow(void *p, size_t *asize, size_t need, size_t elem)
+{
+    size_t n;
+    void *q;
+
+    if (need <= *asize)
+        return p;
+    n = *asize ? *asize : 64;
+    while (n < need)
+        n *= 2;
+    q = realloc(p, n * elem);
+    if (q)
+        *asize = n;
+    return q;
+}
+
+static void
+emit(struct jit *j, const void *bytes, size_t n)
+{
+    unsigned char *code;
+
+    if (j->failed)
+        return;
+    if (j->size + n > JIT_MAX_CODE_SIZE) {
+        j->failed = 1;
+        return;
+    }
+    code = jit_grow(j->code, &j->asize, j->size + n, 1);
+    if (!code) {
+        j->failed = 1;
+        return;
+    }
+    j->code = code;
+    memcpy(j->code + j->size, bytes, n);
+    j->size += n;
+}
+
+static void
+emit1(struct jit *j, int b)
+{
+    unsigned char c = (unsigned char) b;
+    emit(j, &c, 1);
+}
+
+static void
+emit32(struct jit *j, int32_t v)
+{
+    emit(j, &v, 4);
+}
+
+static void
+emit64(struct jit *j, uint64_t v)
+{
+    emit(j, &v, 8);
+}
+
+static void
+patch32(struct jit *j, size_t pos, int32_t v)
+{
+    if (!j->failed)
+        memcpy(j->code + pos, &v, 4);
+}
+
+/*
+ *  Emits a jump with opcode bytes op and returns the position of its rel32
+ *  operand, to be patched once the target is known.
+ */
+static size_t
+emit_jump(struct jit *j, const char *op, size_t n)
+{
+    emit(j, op, n);
+    emit32(j, 0);
+    return j->size - 4;
+}
+
+static void
+patch_jump(struct jit *j, size_t pos)
+{
+    patch32(j, pos, (int32_t) (j->size - (pos + 4)));
+}
+
+static void
+jump_undefined(struct jit *j, const char *op, size_t n)
+{
+    size_t pos, *u;
+
+    pos = emit_jump(j, op, n);
+    u = jit_grow(j->undefined, &j->aundefined, j->nundefined + 1, sizeof(size_t));
+    if (!u) {
+        j->failed = 1;
+        return;
+    }
+    j->undefined = u;
+    j->undefined[j->nundefined++] = pos;
+}
+
+/*
+ *  js undefined
+ */
+static void
+emit_js_undefined(struct jit *j)
+{
+    jump_undefined(j, "\x0f\x88", 2);
+}
+
+static void
+emit_jmp_undefined(struct jit *j)
+{
+    jump_undefined(j, "\xe9", 1);
+}
+
+/*
+ *  mov eax, [base + disp]
+ */
+static void
+emit_load(struct jit *j, int base, int32_t disp)
+{
+    if (JIT_RBX == base) {
+        emit(j, "\x8b\x83", 2);
+    } else {
+        emit(j, "\x8b\x84\x24", 3);
+    }
+    emit32(j, disp);
+}
+
+/*
+ *  mov [rsp + disp], eax
+ */
+static void
+emit_store(struct jit *j, int32_t disp)
+{
+    emit(j, "\x89\x84\x24", 3);
+    emit32(j, disp);
+}
+
+/*
+ *  mov rdi, base
+ */
+static void
+emit_arg(struct jit *j, int base)
+{
+    if (JIT_RBX == base)
+        emit(j, "\x48\x89\xdf", 3);
+    else
+        emit(j, "\x48\x89\xe7", 3);
+}
+
+/*
+ *  Called from the generated code for a kernel, which falls back to its
+ *  original tree if an operand it reads is negative.
+ */
+static int
+jit_kernel(const struct node *n, const int *x, int args)
+{
+    const struct node_kernel *kernel = (const struct node_kernel *) n->data;
+
+    if (!node_kernel_applies(kernel, x, args))
+        return node_compute(kernel->orig, x, args);
+    return node_kernel_compute(kernel, x, args);
+}
+
+static const struct node *
+jit_resolve(const struct node *n, int args)
+{
+    const struct node_kernel *kernel;
+
+    while (NODE_KERNEL == n->type) {
+        kernel = (const struct node_kernel *) n->data;
+        if (kernel->arity < 0 || kernel->arity == args)
+            break;
+        n = kernel->orig;
+    }
+    return n;
+}
+
+/*
+ *  Returns the index of the function for n called with args arguments,
+ *  adding it to the list of functions to compile if it is new.
+ */
+static size_t
+jit_func(struct jit *j, const struct node *n, int args)
+{
+    struct jit_func *funcs;
+    size_t i;
+
+    for (i = 0; i < j->nfuncs; ++i)
+        if (j->funcs[i].n == n && j->funcs[i].args == args)
+            return i;
+    funcs = jit_grow(j->funcs, &j->afuncs, j->nfuncs + 1, sizeof(struct jit_func));
+    if (!funcs) {
+        j->failed = 1;
+        return 0;
+    }
+    j->funcs = funcs;
+    j->funcs[j->nfuncs].n = n;
+    j->funcs[j->nfuncs].args = args;
+    return j->nfuncs++;
+}
+
+static void
+emit_call(struct jit *j, const struct node *n, int args)
+{
+    struct jit_fixup *calls;
+    size_t target;
+
+    target = jit_func(j, n, args);
+    emit1(j, 0xe8);
+    emit32(j, 0);
+    calls = jit_grow(j->calls, &j->acalls, j->ncalls + 1, sizeof(struct jit_fixup));
+    if (!calls) {
+        j->failed = 1;
+        return;
+    }
+    j->calls = calls;
+    j->calls[j->ncalls].pos = j->size - 4;
+    j->calls[j->ncalls].target = target;
+    ++j->ncalls;
+}
+
+/*
+ *  Emits code leaving in eax the value of n applied to the args integers at
+ *  base, jumping to the undefined exit if it is negative. The first of those
+ *  integers is known not to be negative.
+ */
+static void
+emit_apply(struct jit *j, const struct node *n, int args, int base)
+{
+    int place;
+
+    n = jit_resolve(n, args);
+    switch (n->type)
+    {
+    case NODE_ZERO:
+    case NODE_INVALID:
+        emit(j, "\x31\xc0", 2);
+        return;
+    case NODE_PROJECTION:
+        place = ((struct node_projection *) n->data)->place;
+        if (place < 0 || place >= args) {
+            emit_jmp_undefined(j);
+            return;
+        }
+        emit_load(j, base, 4 * place);
+        if (place)
+            break;
+        return;
+    case NODE_SUCCESSOR:
+        if (!args) {
+            emit_jmp_undefined(j);
+            return;
+        }
+        emit_load(j, base, 0);
+        emit(j, "\x83\xc0\x01", 3);
+        break;
+    case NODE_KERNEL:
+        /*
+         *  movabs rdi, n; mov rsi, base; mov edx, args;
+         *  movabs rax, jit_kernel; call rax
+         */
+        emit(j, "\x48\xbf", 2);
+        emit64(j, (uint64_t) (uintptr_t) n);
+        emit(j, JIT_RBX == base ? "\x48\x89\xde" : "\x48\x89\xe6", 3);
+        emit1(j, 0xba);
+        emit32(j, args);
+        emit(j, "\x48\xb8", 2);
+        emit64(j, (uint64_t) (uintptr_t) &jit_kernel);
+        emit(j, "\xff\xd0", 2);
+        break;
+    default:
+        emit_arg(j, base);
+        emit_call(j, n, args);
+        break;
+    } /* end switch */
+    emit(j, "\x85\xc0", 2);
+    emit_js_undefined(j);
+}
+
+static int
+jit_frame(const struct node *n, int args)
+{
+    int slots;
+
+    switch (n->type)
+    {
+    case NODE_COMPOSITION:
+        slots = ((struct node_composition *) n->data)->places;
+        break;
+    case NODE_RECURSION:
+        slots = args + 1;
+        break;
+    case NODE_SEARCH:
+        slots = args;
+        break;
+    default:
+        slots = 0;
+        break;
+    } /* end switch */
+    return (4 * slots + 15) & ~15;
+}
+
+static void
+emit_body(struct jit *j, const struct node *n, int args)
+{
+    union node_d_ptr d_ptr;
+    size_t loop, done, found;
+    int i;
+
+    switch (n->type)
+    {
+    case NODE_COMPOSITION:
+        d_ptr.comp = (struct node_composition *) n->data;
+        for (i = 0; i < d_ptr.comp->places; ++i) {
+            emit_apply(j, d_ptr.comp->g[i], args, JIT_RBX);
+            emit_store(j, 4 * i);
+        }
+        emit_apply(j, d_ptr.comp->f, d_ptr.comp->places, JIT_RSP);
+        break;
+    case NODE_RECURSION:
+        if (!args) {
+            emit_jmp_undefined(j);
+            break;
+        }
+        d_ptr.rec = (struct node_recursion *) n->data;
+        /*
+         *  nx = (h, x[0] .. x[args-2], k); mov ecx, [rbx + 4i];
+         *  mov [rsp + 4i + 4], ecx
+         */
+        for (i = 0; i + 1 < args; ++i) {
+            emit(j, "\x8b\x8b", 2);
+            emit32(j, 4 * i);
+            emit(j, "\x89\x8c\x24", 3);
+            emit32(j, 4 * i + 4);
+        }
+        /*
+         *  mov r12d, [rbx + 4(args-1)]; xor r13d, r13d
+         */
+        emit(j, "\x44\x8b\xa3", 3);
+        emit32(j, 4 * (args - 1));
+        emit(j, "\x45\x31\xed", 3);
+        emit_apply(j, d_ptr.rec->f, args - 1, JIT_RBX);
+        /*
+         *  loop: cmp r13d, r12d; jge done
+         */
+        loop = j->size;
+        emit(j, "\x45\x39\xe5", 3);
+        done = emit_jump(j, "\x0f\x8d", 2);
+        emit_store(j, 0);
+        emit(j, "\x44\x89\xac\x24", 4);
+        emit32(j, 4 * args);
+        emit_apply(j, d_ptr.rec->g, args + 1, JIT_RSP);
+        /*
+         *  inc r13d; jmp loop
+         */
+        emit(j, "\x41\xff\xc5", 3);
+        emit1(j, 0xe9);
+        emit32(j, (int32_t) (loop - (j->size + 4)));
+        patch_jump(j, done);
+        break;
+    case NODE_SEARCH:
+        if (!args) {
+            emit_jmp_undefined(j);
+            break;
+        }
+        d_ptr.search = (struct node_search *) n->data;
+        for (i = 0; i + 1 < args; ++i) {
+            emit(j, "\x8b\x8b", 2);
+            emit32(j, 4 * i);
+            emit(j, "\x89\x8c\x24", 3);
+            emit32(j, 4 * i);
+        }
+        emit(j, "\x44\x8b\xa3", 3);
+        emit32(j, 4 * (args - 1));
+        emit(j, "\x45\x31\xed", 3);
+        /*
+         *  loop: cmp r13d, r12d; jge done; mov [rsp + 4(args-1)], r13d
+         */
+        loop = j->size;
+        emit(j, "\x45\x39\xe5", 3);
+        done = emit_jump(j, "\x0f\x8d", 2);
+        emit(j, "\x44\x89\xac\x24", 4);
+        emit32(j, 4 * (args - 1));
+        emit_apply(j, d_ptr.search->p, args, JIT_RSP);
+        /*
+         *  cmp eax, 1; je found; inc r13d; jmp loop
+         */
+        emit(j, "\x83\xf8\x01", 3);
+        found = emit_jump(j, "\x0f\x84", 2);
+        emit(j, "\x41\xff\xc5", 3);
+        emit1(j, 0xe9);
+        emit32(j, (int32_t) (loop - (j->size + 4)));
+        /*
+         *  done: mov eax, r12d; ret      found: mov eax, r13d
+         */
+        patch_jump(j, done);
+        emit(j, "\x44\x89\xe0", 3);
+        done = emit_jump(j, "\xe9", 1);
+        patch_jump(j, found);
+        emit(j, "\x44\x89\xe8", 3);
+        patch_jump(j, done);
+        break;
+    default:
+        emit_apply(j, n, args, JIT_RBX);
+        break;
+    } /* end switch */
+}
+
+static void
+emit_function(struct jit *j, size_t index)
+{
+    const struct node *n;
+    size_t i, ret;
+    int args, frame;
+
+    n = j->funcs[index].n;
+    args = j->funcs[index].args;
+    frame = jit_frame(n, args);
+    j->funcs[index].offset = j->size;
+    j->nundefined = 0;
+
+    /*
+     *  push rbx; push r12; push r13; sub rsp, frame; mov rbx, rdi
+     *
+     *  Three pushes after the return address leave the stack 16-byte aligned
+     *  for calls, and frame is a multiple of 16.
+     */
+    emit(j, "\x53\x41\x54\x41\x55", 5);
+    emit(j, "\x48\x81\xec", 3);
+    emit32(j, frame);
+    emit(j, "\x48\x89\xfb", 3);
+    if (args) {
+        /*
+         *  mov eax, [rbx]; test eax, eax; js undefined
+         */
+        emit(j, "\x8b\x03\x85\xc0", 4);
+        emit_js_undefined(j);
+    }
+
+    emit_body(j, n, args);
+    ret = emit_jump(j, "\xe9", 1);
+
+    /*
+     *  undefined: mov eax, -1
+     */
+    for (i = 0; i < j->nundefined; ++i)
+        patch_jump(j, j->undefined[i]);
+    emit1(j, 0xb8);
+    emit32(j, -1);
+
+    /*
+     *  add rsp, frame; pop r13; pop r12; pop rbx; ret
+     */
+    patch_jump(j, ret);
+    emit(j, "\x48\x81\xc4", 3);
+    emit32(j, frame);
+    emit(j, "\x41\x5d\x41\x5c\x5b\xc3", 6);
+}
+
+static int
+jit_assemble(struct node_jit *jit, const struct node *n, size_t args)
+{
+    struct jit j;
+    size_t i, page;
+    void *code;
+
+    memset(&j, 0, sizeof(j));
+    jit_func(&j, jit_resolve(n, (int) args), (int) args);
+    for (i = 0; i < j.nfuncs && !j.failed; ++i)
+        emit_function(&j, i);
+    for (i = 0; i < j.ncalls && !j.failed; ++i)
+        patch32(&j, j.calls[i].pos,
+                (int32_t) (j.funcs[j.calls[i].target].offset - (j.calls[i].pos + 4)));
+
+    code = MAP_FAILED;
+    if (!j.failed) {
+        page = (size_t) sysconf(_SC_PAGESIZE);
+        jit->size = (j.size + page - 1) / page * page;
+        code = mmap(NULL, jit->size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (MAP_FAILED != code) {
+            memcpy(code, j.code, j.size);
+            if (mprotect(code, jit->size, PROT_READ | PROT_EXEC)) {
+                munmap(code, jit->size);
+                code = MAP_FAILED;
+            }
+        }
+    }
+    if (MAP_FAILED != code) {
+        jit->code = code;
+        jit->fn = (node_jit_fn) code;
+    }
+
+    free(j.code);
+    free(j.funcs);
+    free(j.calls);
+    free(j.undefined);
+    return MAP_FAILED != code ? 0 : -1;
+}
+
+#endif /* JIT_X86_64 */
+
+/*!
+ *  Compiles \a n, called with \a args arguments, to native code. The tree
+ *  must outlive the compiled code, which refers to its kernels. Returns NULL
+ *  only if out of memory; if the platform is not supported or the code could
+ *  not be made executable, node_jit_run() falls back to node_compute().
+ */
+struct node_jit *
+node_jit_compile(const struct node *n, size_t args)
+{
+    struct node_jit *jit;
+
+    assert(n);
+
+    jit = malloc(sizeof(struct node_jit));
+    if (!jit)
+        return NULL;
+    jit->n = n;
+    jit->args = args;
+    jit->code = NULL;
+    jit->size = 0;
+    jit->fn = NULL;
+#ifdef JIT_X86_64
+    jit_assemble(jit, n, args);
+#endif
+    return jit;
+}
+
+/*!
+ *  Destroys the provided compiled code and releases associated memory.
+ */
+void
+node_jit_destroy(struct node_jit *jit)
+{
+    if (!jit)
+        return;
+
+#ifdef JIT_X86_64
+    if (jit->code)
+        munmap(jit->code, jit->size);
+#endif
+    free(jit);
+}
+
+/*!
+ *  Returns the same result as node_compute() for the compiled tree. The
+ *  native code is used when \a args is the argument count it was compiled
+ *  for, node_compute() otherwise.
+ */
+int
+node_jit_run(const struct node_jit *jit, const int *x, size_t args)
+{
+    if (jit->fn && args == jit->args)
+        return jit->fn(x);
+    return node_compute(jit->n, x, args);
+}
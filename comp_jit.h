@@ -0,0 +1,33 @@
+#ifndef COMP_JIT_H
+#define COMP_JIT_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include "comp.h"
+
+#define JIT_MAX_CODE_SIZE (16 * 1024 * 1024)
+
+typedef int (*node_jit_fn)(const int *x);
+
+struct node_jit
+{
+    const struct node *n;
+    size_t args;
+    void *code;
+    size_t size;
+    node_jit_fn fn;
+};
+
+struct node_jit *node_jit_compile(const struct node *n, size_t args);
+void node_jit_destroy(struct node_jit *jit);
+
+int node_jit_run(const struct node_jit *jit, const int *x, size_t args);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* COMP_JIT_H */
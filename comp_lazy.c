@@ -0,0 +1,177 @@
+#include <assert.h>
+#include <string.h>
+#include "comp_lazy.h"
+
+/*
+ * Lazy evaluation passes the legs of a composition to the outer function
+ * unevaluated. Each argument is a thunk, a leg together with the arguments
+ * of the composition it belongs to, and is evaluated the first time it is
+ * read; the value is then kept in the thunk for later reads. A leg that is
+ * never read, because the outer function is a projection or a zero, or a
+ * recursion whose step ignores it, costs nothing.
+ *
+ * Thunks live in the stack frame of the composition that made them, and the
+ * argument vectors of nested calls are arrays of pointers to them, so that a
+ * leg read in a recursion step or a search predicate is still evaluated only
+ * once for the whole loop. The previous value and the counter of a recursion,
+ * and the candidate of a search, are computed strictly, as in node_compute(),
+ * so that loops still run in constant stack space.
+ *
+ * Only the root checks its first argument for being negative, as values read
+ * further down are always results that have been tested.
+ */
+
+struct thunk
+{
+    const struct node *n;
+    struct thunk **x;
+    size_t args;
+    int value;
+    int forced;
+};
+
+static int lazy(const struct node *n, struct thunk **x, size_t args);
+
+static int
+force(struct thunk *t)
+{
+    if (!t->forced) {
+        t->value = lazy(t->n, t->x, t->args);
+        t->forced = 1;
+    }
+    return t->value;
+}
+
+static void
+thunk_value(struct thunk *t, int value)
+{
+    t->n = NULL;
+    t->value = value;
+    t->forced = 1;
+}
+
+static int
+lazy(const struct node *n, struct thunk **x, size_t args)
+{
+    union node_d_ptr d_ptr;
+    struct thunk h, k;
+    int i, j, lim;
+
+    switch (n->type)
+    {
+    case NODE_ZERO:
+    case NODE_INVALID:
+        return 0;
+    case NODE_PROJECTION:
+        j = ((struct node_projection *) n->data)->place;
+        return j >= 0 && j < (int) args ? force(x[j]) : -1;
+    case NODE_SUCCESSOR:
+        if (!args || (i = force(x[0])) < 0)
+            return -1;
+        return i + 1;
+    case NODE_COMPOSITION:
+    {
+        d_ptr.comp = (struct node_composition *) n->data;
+        struct thunk legs[d_ptr.comp->places + 1];
+        struct thunk *y[d_ptr.comp->places + 1];
+        for (j = 0; j < d_ptr.comp->places; ++j) {
+            legs[j].n = d_ptr.comp->g[j];
+            legs[j].x = x;
+            legs[j].args = args;
+            legs[j].forced = 0;
+            y[j] = &legs[j];
+        }
+        return lazy(d_ptr.comp->f, y, d_ptr.comp->places);
+    }
+    case NODE_RECURSION:
+    {
+        if (!args || (lim = force(x[args - 1])) < 0)
+            return -1;
+        d_ptr.rec = (struct node_recursion *) n->data;
+        if ((i = lazy(d_ptr.rec->f, x, args - 1)) < 0)
+            return -1;
+        struct thunk *nx[args + 1];
+        memcpy(&nx[1], x, (args - 1) * sizeof(struct thunk *));
+        nx[0] = &h;
+        nx[args] = &k;
+        for (j = 0; j < lim; ++j) {
+            thunk_value(&h, i);
+            thunk_value(&k, j);
+            if ((i = lazy(d_ptr.rec->g, nx, args + 1)) < 0)
+                return -1;
+        }
+        return i;
+    }
+    case NODE_SEARCH:
+    {
+        if (!args || (lim = force(x[args - 1])) < 0)
+            return -1;
+        d_ptr.search = (struct node_search *) n->data;
+        struct thunk *nx[args];
+        memcpy(nx, x, (args - 1) * sizeof(struct thunk *));
+        nx[args - 1] = &k;
+        for (i = 0; i < lim; ++i) {
+            thunk_value(&k, i);
+            j = lazy(d_ptr.search->p, nx, args);
+            if (j < 0)
+                return -1;
+            else if (1 == j)
+                return i;
+        }
+        return lim;
+    }
+    case NODE_KERNEL:
+    {
+        d_ptr.kernel = (struct node_kernel *) n->data;
+        if (d_ptr.kernel->arity >= 0 && d_ptr.kernel->arity != (int) args)
+            return lazy(d_ptr.kernel->orig, x, args);
+        if ((int) args < d_ptr.kernel->need)
+            return -1;
+        /*
+         *  Only the operands are read; the other places are never looked at
+         *  by node_kernel_compute(), other than the sign of the first.
+         */
+        int y[args + 1];
+        memset(y, 0, (args + 1) * sizeof(int));
+        if (d_ptr.kernel->a.place >= 0
+                && (y[d_ptr.kernel->a.place] = force(x[d_ptr.kernel->a.place])) < 0)
+            return -1;
+        if (d_ptr.kernel->b.place >= 0
+                && (y[d_ptr.kernel->b.place] = force(x[d_ptr.kernel->b.place])) < 0)
+            return -1;
+        return node_kernel_compute(d_ptr.kernel, y, args);
+    }
+    } /* end switch */
+
+    /*
+     * We should never reach here!
+     */
+    assert(0);
+    return -1;
+}
+
+/*!
+ *  Returns the result of \a n for the arguments \a x, evaluating the legs of
+ *  each composition only when, and if, the outer function reads them. For
+ *  arguments without negative entries, the result is the same as
+ *  node_compute() gives, except where a leg that is never read would have
+ *  been undefined.
+ */
+int
+node_compute_lazy(const struct node *n, const int *x, size_t args)
+{
+    size_t i;
+
+    assert(n && (x || !args));
+
+    if (args && *x < 0)
+        return -1;
+
+    struct thunk xs[args + 1];
+    struct thunk *y[args + 1];
+    for (i = 0; i < args; ++i) {
+        thunk_value(&xs[i], x[i]);
+        y[i] = &xs[i];
+    }
+    return lazy(n, y, args);
+}
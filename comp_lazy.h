@@ -0,0 +1,17 @@
+#ifndef COMP_LAZY_H
+#define COMP_LAZY_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include "comp.h"
+
+int node_compute_lazy(const struct node *n, const int *x, size_t args);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* COMP_LAZY_H */
@@ -0,0 +1,295 @@
+#include <malloc.h>
+#include <assert.h>
+#include <string.h>
+#include "comp_memo.h"
+
+/*
+ * The memo table maps (node, argument vector) pairs to results. It is a set
+ * associative cache: a key hashes to one set of NODE_MEMO_WAYS entries, and
+ * when the set is full the least recently used entry in it is replaced. The
+ * number of entries is fixed when the table is created, so memory use stays
+ * bounded no matter how many distinct calls an evaluation makes.
+ *
+ * Only composition, recursion and search nodes are cached; leaves and kernels
+ * are cheaper to evaluate than to look up. Argument vectors longer than
+ * NODE_MEMO_MAX_ARGS are evaluated without the cache.
+ */
+
+/*!
+ *  \struct node_memo
+ *
+ *  \brief A bounded memoization table for node_compute_memo().
+ */
+
+/*
+ *  Number of recursion prefixes h(x, y-1), h(x, y-2), ... looked up before a
+ *  recursion node falls back to running all steps from zero.
+ */
+#define MEMO_PREFIX_PROBES 4
+
+static size_t
+memo_hash(const struct node *n, const int *x, size_t args)
+{
+    size_t h, i;
+
+    h = (size_t) n * 0x9e3779b97f4a7c15ULL;
+    for (i = 0; i < args; ++i)
+        h = (h ^ (size_t) x[i]) * 0x100000001b3ULL;
+    return h ^ (h >> 29);
+}
+
+static struct node_memo_entry *
+memo_set(struct node_memo *memo, const struct node *n, const int *x, size_t args)
+{
+    return &memo->entries[(memo_hash(n, x, args) & (memo->sets - 1)) * NODE_MEMO_WAYS];
+}
+
+static int
+memo_lookup(struct node_memo *memo, const struct node *n, const int *x,
+            size_t args, int *y)
+{
+    struct node_memo_entry *e;
+    int i;
+
+    e = memo_set(memo, n, x, args);
+    for (i = 0; i < NODE_MEMO_WAYS; ++i, ++e) {
+        if (e->n == n && e->args == (int) args
+                && !memcmp(e->x, x, args * sizeof(int))) {
+            e->stamp = ++memo->tick;
+            *y = e->y;
+            ++memo->hits;
+            return 1;
+        }
+    }
+    ++memo->misses;
+    return 0;
+}
+
+static void
+memo_insert(struct node_memo *memo, const struct node *n, const int *x,
+            size_t args, int y)
+{
+    struct node_memo_entry *e, *victim;
+    int i;
+
+    e = memo_set(memo, n, x, args);
+    victim = e;
+    for (i = 0; i < NODE_MEMO_WAYS; ++i, ++e) {
+        if (!e->n) {
+            victim = e;
+            break;
+        }
+        if (e->stamp < victim->stamp)
+            victim = e;
+    }
+    if (victim->n)
+        ++memo->evictions;
+    victim->n = n;
+    victim->args = (int) args;
+    victim->y = y;
+    victim->stamp = ++memo->tick;
+    memcpy(victim->x, x, args * sizeof(int));
+    ++memo->insertions;
+}
+
+/*!
+ *  Creates a memo table holding at most \a max_entries results. The size is
+ *  rounded down to a multiple of NODE_MEMO_WAYS that is a power of two.
+ */
+struct node_memo *
+node_memo_new(size_t max_entries)
+{
+    struct node_memo *memo;
+    size_t sets;
+
+    sets = 1;
+    while (2 * sets * NODE_MEMO_WAYS <= max_entries)
+        sets *= 2;
+
+    memo = malloc(sizeof(struct node_memo));
+    if (!memo)
+        return NULL;
+    memo->entries = calloc(sets * NODE_MEMO_WAYS, sizeof(struct node_memo_entry));
+    if (!memo->entries) {
+        free(memo);
+        return NULL;
+    }
+    memo->sets = sets;
+    memo->tick = 0;
+    memo->hits = 0;
+    memo->misses = 0;
+    memo->insertions = 0;
+    memo->evictions = 0;
+    return memo;
+}
+
+/*!
+ *  Destroys the provided memo table and releases associated memory.
+ */
+void
+node_memo_destroy(struct node_memo *memo)
+{
+    if (!memo)
+        return;
+
+    free(memo->entries);
+    free(memo);
+}
+
+/*!
+ *  Drops all cached results and resets the counters. This must be done before
+ *  a node that has results in the table is destroyed, since entries are keyed
+ *  on the address of the node.
+ */
+void
+node_memo_clear(struct node_memo *memo)
+{
+    memset(memo->entries, 0,
+           memo->sets * NODE_MEMO_WAYS * sizeof(struct node_memo_entry));
+    memo->tick = 0;
+    memo->hits = 0;
+    memo->misses = 0;
+    memo->insertions = 0;
+    memo->evictions = 0;
+}
+
+static int compute(const struct node *n, const int *x, size_t args, struct node_memo *memo);
+
+static int
+compute_recursion(const struct node *n, const int *x, size_t args,
+                  struct node_memo *memo)
+{
+    union node_d_ptr d_ptr;
+    int i, k, lim, cached;
+
+    d_ptr.rec = (struct node_recursion *) n->data;
+    lim = x[args - 1];
+
+    int nx[args + 1];
+    memcpy(&nx[1], x, args * sizeof(int));
+
+    /*
+     *  Resume from the longest prefix h(x, k) still held in the table, such as
+     *  the result of an earlier call with a slightly smaller bound.
+     */
+    cached = 0;
+    for (k = lim - 1; k > 0 && k >= lim - MEMO_PREFIX_PROBES; --k) {
+        nx[args] = k;
+        if ((cached = memo_lookup(memo, n, &nx[1], args, &i)))
+            break;
+    }
+    if (!cached) {
+        k = 0;
+        if ((i = compute(d_ptr.rec->f, x, args - 1, memo)) < 0)
+            return -1;
+    }
+    for (; k < lim; ++k) {
+        nx[0] = i;
+        nx[args] = k;
+        if ((i = compute(d_ptr.rec->g, nx, args + 1, memo)) < 0)
+            return -1;
+    }
+    return i;
+}
+
+static int
+compute(const struct node *n, const int *x, size_t args, struct node_memo *memo)
+{
+    union node_d_ptr d_ptr;
+    struct node **curr;
+    int i, j, lim;
+
+    if (args && *x < 0)
+        return -1;
+
+    switch (n->type)
+    {
+    case NODE_ZERO:
+    case NODE_INVALID:
+        return 0;
+    case NODE_PROJECTION:
+        d_ptr.proj = (struct node_projection *) n->data;
+        j = d_ptr.proj->place;
+        return j < (int) args ? x[j] : -1;
+    case NODE_SUCCESSOR:
+        return (*x) + 1;
+    case NODE_KERNEL:
+        return node_compute(n, x, args);
+    default:
+        break;
+    } /* end switch */
+
+    if (args > NODE_MEMO_MAX_ARGS)
+        return node_compute(n, x, args);
+    if (memo_lookup(memo, n, x, args, &i))
+        return i;
+
+    switch (n->type)
+    {
+    case NODE_COMPOSITION:
+    {
+        d_ptr.comp = (struct node_composition *) n->data;
+        curr = d_ptr.comp->g;
+        int y[d_ptr.comp->places];
+        j = 0;
+        while (j < d_ptr.comp->places) {
+            i = compute(*curr, x, args, memo);
+            if (i < 0)
+                return -1;
+            y[j++] = i;
+            ++curr;
+        }
+        i = compute(d_ptr.comp->f, y, j, memo);
+        break;
+    }
+    case NODE_RECURSION:
+        if (!args)
+            return -1;
+        i = compute_recursion(n, x, args, memo);
+        break;
+    case NODE_SEARCH:
+    {
+        if (!args)
+            return -1;
+        d_ptr.search = (struct node_search *) n->data;
+        int nx[args];
+        memcpy(nx, x, args * sizeof(int));
+        lim = x[args - 1];
+        for (i = 0; i < lim; ++i) {
+            nx[args - 1] = i;
+            j = compute(d_ptr.search->p, nx, args, memo);
+            if (j < 0)
+                return -1;
+            else if (1 == j)
+                break;
+        }
+        /*
+         *  Without a witness the result is the bound, even a negative one.
+         */
+        if (i >= lim)
+            i = lim;
+        break;
+    }
+    default:
+        assert(0);
+        return -1;
+    } /* end switch */
+
+    if (i >= 0)
+        memo_insert(memo, n, x, args, i);
+    return i;
+}
+
+/*!
+ *  Returns the same result as node_compute(), caching the results of
+ *  composition, recursion and search subtrees in \a memo. The table may be
+ *  reused across calls on the same tree, and its hit, miss, insertion and
+ *  eviction counters accumulate until node_memo_clear() is called.
+ */
+int
+node_compute_memo(const struct node *n, const int *x, size_t args,
+                  struct node_memo *memo)
+{
+    assert(n && memo);
+    return compute(n, x, args, memo);
+}
@@ -0,0 +1,44 @@
+#ifndef COMP_MEMO_H
+#define COMP_MEMO_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include "comp.h"
+
+#define NODE_MEMO_MAX_ARGS 8
+#define NODE_MEMO_WAYS 4
+
+struct node_memo_entry
+{
+    const struct node *n;
+    unsigned long stamp;
+    int args;
+    int y;
+    int x[NODE_MEMO_MAX_ARGS];
+};
+
+struct node_memo
+{
+    struct node_memo_entry *entries;
+    size_t sets;
+    unsigned long tick;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long insertions;
+    unsigned long evictions;
+};
+
+struct node_memo *node_memo_new(size_t max_entries);
+void node_memo_destroy(struct node_memo *memo);
+void node_memo_clear(struct node_memo *memo);
+
+int node_compute_memo(const struct node *n, const int *x, size_t args, struct node_memo *memo);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* COMP_MEMO_H */
@@ -0,0 +1,1000 @@
+#include <assert.h>
+#include <limits.h>
+#include <string.h>
+#include "comp_opt.h"
+
+/*
+ * Strength reduction replaces subtrees that compute one of the elementary
+ * arithmetic functions by NODE_KERNEL nodes, which node_compute() evaluates
+ * natively instead of by counting. The recognized shapes are the textbook
+ * definitions,
+ *
+ *  add(x, y)   = <{0},[+,{0}]>
+ *  pred(y)     = <0,{1}>
+ *  monus(x, y) = <{0},[pred,{0}]>
+ *  iszero(y)   = <[+,0],0>
+ *  mult(x, y)  = <0,[add,{0},{1}]>
+ *  exp(x, y)   = <[+,0],[mult,{0},{1}]>
+ *  fact(y)     = <[+,0],[mult,{0},[+,{1}]]>
+ *
+ * up to the order and choice of the projections involved, and compositions of
+ * a kernel with legs that are projections, constants or successors of those.
+ *
+ * A subtree is matched against a kernel for one specific argument count. The
+ * meaning of a recursion depends on how many arguments it is called with, so
+ * a kernel built from a recursion records that count as its arity, and keeps
+ * the original tree to fall back on for any other count.
+ */
+
+/*
+ *  Largest argument count tried when matching a recursion node that does not
+ *  appear as the outer function of a composition.
+ */
+#define REDUCE_MAX_ARITY 4
+
+static int kernel_of(const struct node *n, int args, struct node_kernel *k);
+
+/*
+ *  Recognizes x[place] + offset, or a constant if place is negative.
+ */
+static int
+operand_of(const struct node *n, struct node_operand *o)
+{
+    union node_d_ptr d_ptr;
+
+    switch (n->type)
+    {
+    case NODE_PROJECTION:
+        o->place = ((struct node_projection *) n->data)->place;
+        o->offset = 0;
+        return 1;
+    case NODE_ZERO:
+        o->place = -1;
+        o->offset = 0;
+        return 1;
+    case NODE_SUCCESSOR:
+        o->place = 0;
+        o->offset = 1;
+        return 1;
+    case NODE_COMPOSITION:
+        d_ptr.comp = (struct node_composition *) n->data;
+        if (NODE_SUCCESSOR != d_ptr.comp->f->type || 1 != d_ptr.comp->places
+                || !operand_of(d_ptr.comp->g[0], o) || INT_MAX == o->offset)
+            return 0;
+        ++o->offset;
+        return 1;
+    case NODE_KERNEL:
+        d_ptr.kernel = (struct node_kernel *) n->data;
+        if (KERNEL_VALUE != d_ptr.kernel->op || d_ptr.kernel->arity >= 0
+                || d_ptr.kernel->need > d_ptr.kernel->a.place + 1)
+            return 0;
+        *o = d_ptr.kernel->a;
+        return 1;
+    default:
+        break;
+    } /* end switch */
+    return 0;
+}
+
+static int
+is_const(const struct node_operand *o, int c)
+{
+    return o->place < 0 && o->offset == c;
+}
+
+static int
+is_place(const struct node_operand *o, int place, int offset)
+{
+    return o->place == place && o->offset == offset;
+}
+
+static void
+set_kernel(struct node_kernel *k, int op, struct node_operand a, struct node_operand b)
+{
+    k->op = op;
+    k->a = a;
+    k->b = b;
+}
+
+/*
+ *  Matches the recursion node n called with r arguments. The base function
+ *  sees x[0] .. x[r-2], the step function (h, x[0] .. x[r-2], k), so inside
+ *  the step, place 0 is the previous value and place r is the counter.
+ */
+static int
+match_recursion(const struct node *n, int r, struct node_kernel *k)
+{
+    union node_d_ptr d_ptr;
+    struct node_kernel f, g;
+    struct node_operand y, q;
+    int has_q;
+
+    d_ptr.rec = (struct node_recursion *) n->data;
+    if (r < 1 || !kernel_of(d_ptr.rec->f, r - 1, &f) || KERNEL_VALUE != f.op
+            || !kernel_of(d_ptr.rec->g, r + 1, &g))
+        return 0;
+
+    y.place = r - 1;
+    y.offset = 0;
+    k->need = r;
+
+    /*
+     *  For mult and exp, q is the operand of the step other than the previous
+     *  value, renumbered to the arguments of the recursion. It must depend on
+     *  neither the previous value nor the counter.
+     */
+    has_q = 0;
+    q = y;
+    if (is_place(&g.a, 0, 0) || is_place(&g.b, 0, 0)) {
+        q = is_place(&g.a, 0, 0) ? g.b : g.a;
+        if (q.place < 0 || (q.place > 0 && q.place < r)) {
+            if (q.place > 0)
+                --q.place;
+            has_q = 1;
+        }
+    }
+
+    switch (g.op)
+    {
+    case KERNEL_VALUE:
+        if (is_place(&g.a, 0, 1)) {
+            set_kernel(k, KERNEL_ADD, f.a, y);
+            return 1;
+        }
+        if (is_const(&f.a, 0) && is_place(&g.a, r, 0)) {
+            set_kernel(k, KERNEL_PRED, y, y);
+            return 1;
+        }
+        if (is_const(&f.a, 1) && is_const(&g.a, 0)) {
+            set_kernel(k, KERNEL_ISZERO, y, y);
+            return 1;
+        }
+        break;
+    case KERNEL_PRED:
+        if (is_place(&g.a, 0, 0)) {
+            set_kernel(k, KERNEL_MONUS, f.a, y);
+            return 1;
+        }
+        break;
+    case KERNEL_ADD:
+        if (is_const(&f.a, 0) && has_q) {
+            set_kernel(k, KERNEL_MULT, q, y);
+            return 1;
+        }
+        break;
+    case KERNEL_MULT:
+        if (!is_const(&f.a, 1))
+            break;
+        if (has_q) {
+            set_kernel(k, KERNEL_EXP, q, y);
+            return 1;
+        }
+        if ((is_place(&g.a, 0, 0) && is_place(&g.b, r, 1))
+                || (is_place(&g.b, 0, 0) && is_place(&g.a, r, 1))) {
+            set_kernel(k, KERNEL_FACT, y, y);
+            return 1;
+        }
+        break;
+    default:
+        break;
+    } /* end switch */
+    return 0;
+}
+
+/*
+ *  Matches the composition node n, for any number of arguments. All legs must
+ *  be operands, and the outer function a kernel for as many arguments as there
+ *  are legs; the kernel's operands are then rewritten in terms of the legs.
+ */
+static int
+match_composition(const struct node *n, struct node_kernel *k)
+{
+    union node_d_ptr d_ptr;
+    struct node_kernel f;
+    int i;
+
+    d_ptr.comp = (struct node_composition *) n->data;
+    struct node_operand legs[d_ptr.comp->places + 1];
+
+    k->need = 0;
+    for (i = 0; i < d_ptr.comp->places; ++i) {
+        if (!operand_of(d_ptr.comp->g[i], &legs[i]))
+            return 0;
+        if (legs[i].place >= k->need)
+            k->need = legs[i].place + 1;
+    }
+    if (!kernel_of(d_ptr.comp->f, d_ptr.comp->places, &f))
+        return 0;
+
+    k->op = f.op;
+    k->a = f.a;
+    k->b = f.b;
+    if (f.a.place >= 0) {
+        k->a = legs[f.a.place];
+        if (INT_MAX - k->a.offset < f.a.offset)
+            return 0;
+        k->a.offset += f.a.offset;
+    }
+    if (f.b.place >= 0) {
+        k->b = legs[f.b.place];
+        if (INT_MAX - k->b.offset < f.b.offset)
+            return 0;
+        k->b.offset += f.b.offset;
+    }
+    return 1;
+}
+
+/*
+ *  Describes what n computes when called with exactly args arguments, if that
+ *  is one of the kernels.
+ */
+static int
+kernel_of(const struct node *n, int args, struct node_kernel *k)
+{
+    union node_d_ptr d_ptr;
+    struct node_operand o;
+
+    k->arity = -1;
+    k->orig = NULL;
+
+    switch (n->type)
+    {
+    case NODE_KERNEL:
+        d_ptr.kernel = (struct node_kernel *) n->data;
+        if (d_ptr.kernel->arity >= 0 && d_ptr.kernel->arity != args)
+            return kernel_of(d_ptr.kernel->orig, args, k);
+        *k = *d_ptr.kernel;
+        break;
+    case NODE_RECURSION:
+        if (!match_recursion(n, args, k))
+            return 0;
+        break;
+    case NODE_COMPOSITION:
+        if (match_composition(n, k))
+            break;
+        /* fall through */
+    default:
+        if (!operand_of(n, &o))
+            return 0;
+        set_kernel(k, KERNEL_VALUE, o, o);
+        k->need = o.place + 1;
+        break;
+    } /* end switch */
+
+    return k->need <= args;
+}
+
+static struct node *
+kernel_from(struct node *n, struct node_kernel *k, int arity)
+{
+    k->arity = arity;
+    k->orig = n;
+    return kernel_node_new(k);
+}
+
+static struct node *
+reduce(struct node *n)
+{
+    union node_d_ptr d_ptr;
+    struct node_kernel k;
+    int i;
+
+    switch (n->type)
+    {
+    case NODE_COMPOSITION:
+        d_ptr.comp = (struct node_composition *) n->data;
+        d_ptr.comp->f = reduce(d_ptr.comp->f);
+        for (i = 0; i < d_ptr.comp->places; ++i)
+            d_ptr.comp->g[i] = reduce(d_ptr.comp->g[i]);
+        if (match_composition(n, &k))
+            return kernel_from(n, &k, -1);
+        break;
+    case NODE_RECURSION:
+        d_ptr.rec = (struct node_recursion *) n->data;
+        d_ptr.rec->f = reduce(d_ptr.rec->f);
+        d_ptr.rec->g = reduce(d_ptr.rec->g);
+        for (i = 1; i <= REDUCE_MAX_ARITY; ++i)
+            if (match_recursion(n, i, &k))
+                return kernel_from(n, &k, i);
+        break;
+    case NODE_SEARCH:
+        d_ptr.search = (struct node_search *) n->data;
+        d_ptr.search->p = reduce(d_ptr.search->p);
+        break;
+    default:
+        break;
+    } /* end switch */
+    return n;
+}
+
+/*!
+ *  Replaces the subtrees of \a n that compute addition, multiplication,
+ *  exponentiation, predecessor, monus, iszero or factorial by kernel nodes,
+ *  and returns the new root. The tree is modified in place and the replaced
+ *  subtrees are kept inside the kernels, so the result evaluates and
+ *  serializes exactly like the original, but in constant or logarithmic time
+ *  for those functions. \a n must be an ordinary heap allocated tree.
+ */
+struct node *
+node_strength_reduce(struct node *n)
+{
+    assert(n && !(n->flags & (NODE_FLAG_ARENA | NODE_FLAG_SHARED)));
+    return reduce(n);
+}
+
+/*
+ * Partial evaluation specializes a tree on the value of one argument. The
+ * residual tree is built by walking the original with an environment that
+ * says, for each argument of the current node, whether it is a known value
+ * or which argument of the residual node it comes from:
+ *
+ *  - projections of known arguments become constant nodes,
+ *  - compositions and kernels whose arguments are all known are evaluated,
+ *  - a recursion whose bound is known, and small, is unrolled into nested
+ *    compositions of its specialized step function,
+ *  - any other recursion or search keeps its loop, with its base, step and
+ *    predicate specialized, behind a composition that reorders the residual
+ *    arguments if the bound is not the last one.
+ *
+ * The residual agrees with the original for every argument vector without
+ * negative entries. Undefinedness that does not depend on the arguments,
+ * like a projection out of range, is folded into the constant -1.
+ */
+
+struct spec_arg
+{
+    int place;
+    int value;
+};
+
+static struct node *spec(const struct node *n, int args, const struct spec_arg *env, int r);
+
+static int
+const_of(const struct node *n, int *value)
+{
+    const struct node_kernel *k;
+
+    if (NODE_KERNEL != n->type)
+        return 0;
+    k = (const struct node_kernel *) n->data;
+    if (KERNEL_VALUE != k->op || k->arity >= 0 || k->a.place >= 0)
+        return 0;
+    *value = k->a.offset;
+    return 1;
+}
+
+static struct node *
+spec_arg_node(const struct spec_arg *a)
+{
+    return a->place < 0 ? constant_node_new(a->value) : projection_node_new(a->place);
+}
+
+/*
+ *  Returns [n, {0} .. {r-1}, last].
+ */
+static struct node *
+spec_append(struct node *n, int r, struct node *last)
+{
+    struct node **g;
+    int i;
+
+    g = node_array_new(r + 2);
+    for (i = 0; i < r; ++i)
+        g[i] = projection_node_new(i);
+    g[r] = last;
+    return composition_node_new(n, g);
+}
+
+/*
+ *  Moves the residual arguments of env up by one, to make room for the
+ *  previous value of a recursion at place 0.
+ */
+static void
+spec_shift(struct spec_arg *dst, const struct spec_arg *env, int args)
+{
+    int i;
+
+    for (i = 0; i < args; ++i) {
+        dst[i] = env[i];
+        if (dst[i].place >= 0)
+            ++dst[i].place;
+    }
+}
+
+/*
+ *  Rewrites a kernel operand in terms of the residual arguments, raising
+ *  need to cover it.
+ */
+static int
+spec_operand(struct node_operand *o, const struct spec_arg *env, int *need)
+{
+    if (o->place < 0)
+        return 1;
+    if (env[o->place].place < 0) {
+        if (INT_MAX - env[o->place].value < o->offset)
+            return 0;
+        o->offset += env[o->place].value;
+        o->place = -1;
+        return 1;
+    }
+    o->place = env[o->place].place;
+    if (o->place >= *need)
+        *need = o->place + 1;
+    return 1;
+}
+
+static struct node *
+spec_composition(const struct node *n, int args, const struct spec_arg *env, int r)
+{
+    union node_d_ptr d_ptr;
+    struct node **g;
+    int i, m, places;
+
+    d_ptr.comp = (struct node_composition *) n->data;
+    places = d_ptr.comp->places;
+    struct node *legs[places + 1];
+    struct spec_arg fenv[places + 1];
+    int y[places + 1];
+
+    for (i = 0, m = 0; i < places; ++i) {
+        legs[i] = spec(d_ptr.comp->g[i], args, env, r);
+        fenv[i].place = -1;
+        if (!const_of(legs[i], &fenv[i].value))
+            fenv[i].place = m++;
+        else if (fenv[i].value < 0)
+            break;
+    }
+    if (i < places) {
+        while (i >= 0)
+            node_destroy(legs[i--]);
+        return constant_node_new(-1);
+    }
+
+    if (!m) {
+        for (i = 0; i < places; ++i) {
+            y[i] = fenv[i].value;
+            node_destroy(legs[i]);
+        }
+        return constant_node_new(node_compute(d_ptr.comp->f, y, places));
+    }
+
+    g = node_array_new(m + 1);
+    for (i = 0; i < places; ++i) {
+        if (fenv[i].place >= 0)
+            g[fenv[i].place] = legs[i];
+        else
+            node_destroy(legs[i]);
+    }
+    return composition_node_new(spec(d_ptr.comp->f, places, fenv, m), g);
+}
+
+/*
+ *  Specializes a recursion or search whose bound is the last residual
+ *  argument, and not used otherwise.
+ */
+static struct node *
+spec_loop(const struct node *n, int args, const struct spec_arg *env, int r)
+{
+    union node_d_ptr d_ptr;
+    struct spec_arg genv[args + 1];
+
+    if (NODE_SEARCH == n->type) {
+        d_ptr.search = (struct node_search *) n->data;
+        return search_node_new(spec(d_ptr.search->p, args, env, r));
+    }
+    d_ptr.rec = (struct node_recursion *) n->data;
+    genv[0].place = 0;
+    spec_shift(&genv[1], env, args - 1);
+    genv[args].place = r;
+    return recursion_node_new(spec(d_ptr.rec->f, args - 1, env, r - 1),
+                              spec(d_ptr.rec->g, args + 1, genv, r + 1));
+}
+
+/*
+ *  Unrolls a recursion with the known bound lim.
+ */
+static struct node *
+spec_unroll(const struct node *n, int args, const struct spec_arg *env, int r, int lim)
+{
+    union node_d_ptr d_ptr;
+    struct node *h, *step, **g;
+    struct spec_arg genv[args + 1];
+    int i, k, value;
+
+    d_ptr.rec = (struct node_recursion *) n->data;
+    h = spec(d_ptr.rec->f, args - 1, env, r);
+    for (k = 0; k < lim; ++k) {
+        genv[args].place = -1;
+        genv[args].value = k;
+        if (const_of(h, &value)) {
+            if (value < 0)
+                break;
+            genv[0].place = -1;
+            genv[0].value = value;
+            memcpy(&genv[1], env, (args - 1) * sizeof(struct spec_arg));
+            step = spec(d_ptr.rec->g, args + 1, genv, r);
+            node_destroy(h);
+            h = step;
+            continue;
+        }
+        genv[0].place = 0;
+        spec_shift(&genv[1], env, args - 1);
+        step = spec(d_ptr.rec->g, args + 1, genv, r + 1);
+        g = node_array_new(r + 2);
+        g[0] = h;
+        for (i = 0; i < r; ++i)
+            g[i + 1] = projection_node_new(i);
+        h = composition_node_new(step, g);
+    }
+    return h;
+}
+
+static struct node *
+spec(const struct node *n, int args, const struct spec_arg *env, int r)
+{
+    union node_d_ptr d_ptr;
+    const struct spec_arg *last;
+    struct node_kernel k;
+    int i, known;
+
+    /*
+     *  Fold whatever does not depend on the residual arguments.
+     */
+    for (i = 0, known = args > 0; i < args && known; ++i)
+        known = env[i].place < 0;
+    if (known) {
+        int x[args];
+        for (i = 0; i < args; ++i)
+            x[i] = env[i].value;
+        return constant_node_new(node_compute(n, x, args));
+    }
+
+    switch (n->type)
+    {
+    case NODE_ZERO:
+    case NODE_INVALID:
+        return constant_node_new(0);
+    case NODE_PROJECTION:
+        i = ((struct node_projection *) n->data)->place;
+        if (i < 0 || i >= args)
+            return constant_node_new(-1);
+        return spec_arg_node(&env[i]);
+    case NODE_SUCCESSOR:
+        if (!args)
+            return constant_node_new(-1);
+        if (env->place < 0)
+            return constant_node_new(INT_MAX == env->value ? -1 : env->value + 1);
+        if (!env->place)
+            return successor_node_new();
+        return spec_append(successor_node_new(), 0, projection_node_new(env->place));
+    case NODE_COMPOSITION:
+        return spec_composition(n, args, env, r);
+    case NODE_RECURSION:
+    case NODE_SEARCH:
+        if (!args)
+            return constant_node_new(-1);
+        last = &env[args - 1];
+        if (NODE_RECURSION == n->type && last->place < 0
+                && last->value <= NODE_SPECIALIZE_MAX_UNROLL)
+            return spec_unroll(n, args, env, r, last->value);
+        /*
+         *  Give the loop its bound as the last argument.
+         */
+        for (i = 0; i < args - 1 && env[i].place != r - 1; ++i)
+            ;
+        if (last->place == r - 1 && i == args - 1)
+            return spec_loop(n, args, env, r);
+        {
+            struct spec_arg lenv[args];
+            memcpy(lenv, env, (args - 1) * sizeof(struct spec_arg));
+            lenv[args - 1].place = r;
+            return spec_append(spec_loop(n, args, lenv, r + 1), r, spec_arg_node(last));
+        }
+    case NODE_KERNEL:
+        d_ptr.kernel = (struct node_kernel *) n->data;
+        if (d_ptr.kernel->arity >= 0 && d_ptr.kernel->arity != args)
+            return spec(d_ptr.kernel->orig, args, env, r);
+        if (args < d_ptr.kernel->need)
+            return constant_node_new(-1);
+        k = *d_ptr.kernel;
+        k.arity = -1;
+        k.need = 0;
+        if (!spec_operand(&k.a, env, &k.need) || !spec_operand(&k.b, env, &k.need))
+            return spec(d_ptr.kernel->orig, args, env, r);
+        k.orig = d_ptr.kernel->orig ? spec(d_ptr.kernel->orig, args, env, r) : NULL;
+        return kernel_node_new(&k);
+    } /* end switch */
+
+    /*
+     * We should never reach here!
+     */
+    assert(0);
+    return NULL;
+}
+
+/*!
+ *  Returns a new tree of \a args - 1 arguments that computes what \a n does
+ *  with \a args arguments when the one at \a place is \a value, the others
+ *  keeping their order. Known parts are evaluated up front, and recursions
+ *  on the fixed argument with a bound up to NODE_SPECIALIZE_MAX_UNROLL are
+ *  unrolled, so the residual is usually much cheaper to evaluate. \a n is
+ *  left untouched.
+ */
+struct node *
+node_specialize(const struct node *n, size_t args, int place, int value)
+{
+    struct spec_arg env[args + 1];
+    int i;
+
+    assert(n && place >= 0 && place < (int) args && value >= 0);
+
+    for (i = 0; i < (int) args; ++i) {
+        env[i].place = i < place ? i : i - 1;
+        env[i].value = 0;
+    }
+    env[place].place = -1;
+    env[place].value = value;
+    return spec(n, (int) args, env, (int) args - 1);
+}
+
+/*
+ * The pass pipeline removes redundancy that is common in trees written by
+ * hand, or generated, without changing what they compute. Each pass is a
+ * bottom-up rewrite of the nodes of the tree, and the pipeline runs the
+ * selected passes in order until none of them changes anything:
+ *
+ *  fuse        [[F, {p0} .. {pm}], h0 .. hk] -> [F, h(p0) .. h(pm)], an
+ *              outer function that only permutes its arguments is merged
+ *              into the composition around it. Zero legs of the inner
+ *              composition are kept as zero.
+ *  project     [{i}, g0 .. gm] -> gi, [0, g0 .. gm] -> 0, and
+ *              [+, {0}, ..] -> +; other legs of [+, ..] are dropped.
+ *  dead-legs   legs of a composition whose outer function never reads them
+ *              are replaced by zero.
+ *  add-const   chains [+, .. [+, {i}] ..] of successors over a projection
+ *              or zero become KERNEL_VALUE kernels, x[i] + c in one step.
+ *
+ * Kernels are left as they are, together with the trees they keep.
+ *
+ * The result agrees with node_compute() on the original for argument vectors
+ * without negative entries and with at least as many arguments as the arity
+ * node_analyze() gives the original. The one difference is that a leg whose
+ * value is never used no longer makes the composition undefined, as it does
+ * when such a leg overflows.
+ */
+
+#define OPT_MAX_ROUNDS 16
+
+typedef struct node *(*node_pass_fn)(struct node *n, unsigned long *changes);
+
+static int
+is_leaf_node(const struct node *n)
+{
+    switch (n->type)
+    {
+    case NODE_ZERO:
+    case NODE_PROJECTION:
+    case NODE_SUCCESSOR:
+        return 1;
+    default:
+        break;
+    } /* end switch */
+    return 0;
+}
+
+/*
+ *  Detaches the outer function and the legs marked in keep from the
+ *  composition n, and destroys the rest of it.
+ */
+static struct node *
+comp_release(struct node *n, const char *keep)
+{
+    struct node_composition *comp = (struct node_composition *) n->data;
+    struct node *f;
+    int i;
+
+    f = comp->f;
+    comp->f = NULL;
+    for (i = 0; i < comp->places; ++i)
+        if (keep[i])
+            comp->g[i] = NULL;
+    node_destroy(n);
+    return f;
+}
+
+/*
+ *  Marks in used every argument n reads when called with args arguments.
+ */
+static void
+reads(const struct node *n, int args, char *used)
+{
+    union node_d_ptr d_ptr;
+    int i;
+
+    switch (n->type)
+    {
+    case NODE_PROJECTION:
+        i = ((struct node_projection *) n->data)->place;
+        if (i >= 0 && i < args)
+            used[i] = 1;
+        break;
+    case NODE_SUCCESSOR:
+        if (args)
+            used[0] = 1;
+        break;
+    case NODE_COMPOSITION:
+        d_ptr.comp = (struct node_composition *) n->data;
+        for (i = 0; i < d_ptr.comp->places; ++i)
+            reads(d_ptr.comp->g[i], args, used);
+        break;
+    case NODE_RECURSION:
+    {
+        if (!args)
+            break;
+        d_ptr.rec = (struct node_recursion *) n->data;
+        used[args - 1] = 1;
+        reads(d_ptr.rec->f, args - 1, used);
+        /*
+         *  The step function sees (h, x[0] .. x[args-2], k).
+         */
+        char step[args + 1];
+        memset(step, 0, args + 1);
+        reads(d_ptr.rec->g, args + 1, step);
+        for (i = 1; i < args; ++i)
+            used[i - 1] |= step[i];
+        break;
+    }
+    case NODE_SEARCH:
+        if (!args)
+            break;
+        used[args - 1] = 1;
+        reads(((struct node_search *) n->data)->p, args, used);
+        break;
+    case NODE_KERNEL:
+        d_ptr.kernel = (struct node_kernel *) n->data;
+        if (d_ptr.kernel->arity >= 0 && d_ptr.kernel->arity != args) {
+            reads(d_ptr.kernel->orig, args, used);
+            break;
+        }
+        if (d_ptr.kernel->a.place >= 0 && d_ptr.kernel->a.place < args)
+            used[d_ptr.kernel->a.place] = 1;
+        if (d_ptr.kernel->b.place >= 0 && d_ptr.kernel->b.place < args)
+            used[d_ptr.kernel->b.place] = 1;
+        break;
+    case NODE_ZERO:
+    case NODE_INVALID:
+    default:
+        break;
+    } /* end switch */
+}
+
+static struct node *
+pass_fuse(struct node *n, unsigned long *changes)
+{
+    struct node_composition *comp, *inner;
+    struct node **g, *f;
+    int i, p;
+
+    if (NODE_COMPOSITION != n->type)
+        return n;
+    comp = (struct node_composition *) n->data;
+    if (NODE_COMPOSITION != comp->f->type)
+        return n;
+    inner = (struct node_composition *) comp->f->data;
+
+    /*
+     *  Every inner leg must pick a leg of n, and a leg that is not a leaf may
+     *  be picked only once, so that no work is repeated.
+     */
+    char uses[comp->places + 1];
+    memset(uses, 0, comp->places + 1);
+    for (i = 0; i < inner->places; ++i) {
+        if (NODE_ZERO == inner->g[i]->type)
+            continue;
+        if (NODE_PROJECTION != inner->g[i]->type)
+            return n;
+        p = ((struct node_projection *) inner->g[i]->data)->place;
+        if (p < 0 || p >= comp->places
+                || (uses[p] && !is_leaf_node(comp->g[p])))
+            return n;
+        uses[p] = 1;
+    }
+
+    g = node_array_new(inner->places + 1);
+    memset(uses, 0, comp->places + 1);
+    for (i = 0; i < inner->places; ++i) {
+        if (NODE_ZERO == inner->g[i]->type) {
+            g[i] = zero_node_new();
+            continue;
+        }
+        p = ((struct node_projection *) inner->g[i]->data)->place;
+        g[i] = uses[p] ? node_clone(comp->g[p]) : comp->g[p];
+        uses[p] = 1;
+    }
+    f = inner->f;
+    inner->f = NULL;
+    node_destroy(comp_release(n, uses));
+    ++*changes;
+    return composition_node_new(f, g);
+}
+
+static struct node *
+pass_project(struct node *n, unsigned long *changes)
+{
+    struct node_composition *comp;
+    struct node *g;
+    int i;
+
+    if (NODE_COMPOSITION != n->type)
+        return n;
+    comp = (struct node_composition *) n->data;
+    char keep[comp->places + 1];
+    memset(keep, 0, comp->places + 1);
+
+    switch (comp->f->type)
+    {
+    case NODE_PROJECTION:
+        i = ((struct node_projection *) comp->f->data)->place;
+        if (i < 0 || i >= comp->places)
+            return n;
+        g = comp->g[i];
+        keep[i] = 1;
+        node_destroy(comp_release(n, keep));
+        break;
+    case NODE_ZERO:
+        node_destroy(comp_release(n, keep));
+        g = zero_node_new();
+        break;
+    case NODE_SUCCESSOR:
+        if (!comp->places)
+            return n;
+        if (NODE_PROJECTION == comp->g[0]->type
+                && !((struct node_projection *) comp->g[0]->data)->place) {
+            keep[0] = 0;
+            g = comp_release(n, keep);
+            break;
+        }
+        if (1 == comp->places)
+            return n;
+        for (i = 1; i < comp->places; ++i)
+            node_destroy(comp->g[i]);
+        comp->g[1] = NULL;
+        comp->places = 1;
+        g = n;
+        break;
+    default:
+        return n;
+    } /* end switch */
+    ++*changes;
+    return g;
+}
+
+static struct node *
+pass_dead_legs(struct node *n, unsigned long *changes)
+{
+    struct node_composition *comp;
+    int i;
+
+    if (NODE_COMPOSITION != n->type)
+        return n;
+    comp = (struct node_composition *) n->data;
+    char used[comp->places + 1];
+    memset(used, 0, comp->places + 1);
+    reads(comp->f, comp->places, used);
+    for (i = 0; i < comp->places; ++i) {
+        if (used[i] || NODE_ZERO == comp->g[i]->type)
+            continue;
+        node_destroy(comp->g[i]);
+        comp->g[i] = zero_node_new();
+        ++*changes;
+    }
+    return n;
+}
+
+static struct node *
+pass_add_const(struct node *n, unsigned long *changes)
+{
+    struct node_kernel k;
+    struct node_operand o;
+
+    if (NODE_COMPOSITION != n->type || !operand_of(n, &o))
+        return n;
+    set_kernel(&k, KERNEL_VALUE, o, o);
+    k.need = o.place + 1;
+    ++*changes;
+    return kernel_from(n, &k, -1);
+}
+
+static const struct {
+    const char *name;
+    node_pass_fn fn;
+} passes[NODE_PASS_COUNT] = {
+    { "fuse",      pass_fuse      },
+    { "project",   pass_project   },
+    { "dead-legs", pass_dead_legs },
+    { "add-const", pass_add_const }
+};
+
+/*
+ *  Applies fn to every node of n, children first. A node whose subtree was
+ *  rewritten loses its node_analyze() result.
+ */
+static struct node *
+run_pass(struct node *n, node_pass_fn fn, unsigned long *changes)
+{
+    union node_d_ptr d_ptr;
+    unsigned long before = *changes;
+    int i;
+
+    switch (n->type)
+    {
+    case NODE_COMPOSITION:
+        d_ptr.comp = (struct node_composition *) n->data;
+        d_ptr.comp->f = run_pass(d_ptr.comp->f, fn, changes);
+        for (i = 0; i < d_ptr.comp->places; ++i)
+            d_ptr.comp->g[i] = run_pass(d_ptr.comp->g[i], fn, changes);
+        break;
+    case NODE_RECURSION:
+        d_ptr.rec = (struct node_recursion *) n->data;
+        d_ptr.rec->f = run_pass(d_ptr.rec->f, fn, changes);
+        d_ptr.rec->g = run_pass(d_ptr.rec->g, fn, changes);
+        break;
+    case NODE_SEARCH:
+        d_ptr.search = (struct node_search *) n->data;
+        d_ptr.search->p = run_pass(d_ptr.search->p, fn, changes);
+        break;
+    default:
+        break;
+    } /* end switch */
+    n = fn(n, changes);
+    if (*changes != before)
+        n->flags &= ~(NODE_FLAG_ANALYZED | NODE_FLAG_WELL_FORMED);
+    return n;
+}
+
+/*!
+ *  Returns the name of pass \a pass, see enum node_pass.
+ */
+const char *
+node_pass_name(int pass)
+{
+    assert(pass >= 0 && pass < NODE_PASS_COUNT);
+    return passes[pass].name;
+}
+
+/*!
+ *  Runs the passes selected by the bit mask \a mask, 1 << NODE_PASS_FUSE and
+ *  so on, over \a n until they reach a fixed point, and returns the new root.
+ *  The tree is modified in place, and \a n must be an ordinary heap allocated
+ *  tree. If \a report is not NULL, it receives the number of rewrites each
+ *  pass made and the number of rounds run.
+ */
+struct node *
+node_optimize(struct node *n, int mask, struct node_opt_report *report)
+{
+    unsigned long changes, total;
+    int pass, round;
+
+    assert(n && !(n->flags & (NODE_FLAG_ARENA | NODE_FLAG_SHARED)));
+
+    if (report)
+        memset(report, 0, sizeof(struct node_opt_report));
+
+    for (round = 0; round < OPT_MAX_ROUNDS; ++round) {
+        total = 0;
+        for (pass = 0; pass < NODE_PASS_COUNT; ++pass) {
+            if (!(mask & (1 << pass)))
+                continue;
+            changes = 0;
+            n = run_pass(n, passes[pass].fn, &changes);
+            total += changes;
+            if (report)
+                report->changes[pass] += changes;
+        }
+        if (report)
+            report->rounds = round + 1;
+        if (!total)
+            break;
+    }
+    return n;
+}
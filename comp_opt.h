@@ -0,0 +1,42 @@
+#ifndef COMP_OPT_H
+#define COMP_OPT_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include "comp.h"
+
+/*
+ *  Largest known recursion bound node_specialize() unrolls.
+ */
+#define NODE_SPECIALIZE_MAX_UNROLL 32
+
+enum node_pass {
+    NODE_PASS_FUSE = 0,
+    NODE_PASS_PROJECT,
+    NODE_PASS_DEAD_LEGS,
+    NODE_PASS_ADD_CONST,
+    NODE_PASS_COUNT
+};
+
+#define NODE_PASSES_ALL ((1 << NODE_PASS_COUNT) - 1)
+
+struct node_opt_report
+{
+    unsigned long changes[NODE_PASS_COUNT];
+    int rounds;
+};
+
+struct node *node_strength_reduce(struct node *n);
+struct node *node_specialize(const struct node *n, size_t args, int place, int value);
+
+struct node *node_optimize(struct node *n, int mask, struct node_opt_report *report);
+const char *node_pass_name(int pass);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* COMP_OPT_H */
@@ -0,0 +1,693 @@
+#include <malloc.h>
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <unistd.h>
+#include "comp_parallel.h"
+
+/*
+ * Parallel search splits the range 0 .. lim-1 of a search node into chunks of
+ * NODE_SEARCH_CHUNK candidates, which worker threads claim in increasing order
+ * from a shared counter. Each worker evaluates the predicate on its own copy
+ * of the argument vector.
+ *
+ * The sequential search stops at the first index where the predicate is 1 or
+ * undefined. The workers record the least index of each kind they have seen,
+ * and give up on any candidate above the smaller of the two, since it can no
+ * longer change the result. Every index below the final stopping point lies
+ * in a chunk that was claimed before that point was known, and is evaluated
+ * by the worker that claimed it, so the outcome is exactly that of the
+ * sequential search.
+ */
+
+struct search_job
+{
+    const struct node *p;
+    const int *x;
+    size_t args;
+    int lim;
+    atomic_long next;
+    atomic_int witness;
+    atomic_int error;
+};
+
+/*
+ *  Lowers *a to v if v is smaller.
+ */
+static void
+atomic_min(atomic_int *a, int v)
+{
+    int cur = atomic_load_explicit(a, memory_order_relaxed);
+    while (v < cur
+           && !atomic_compare_exchange_weak_explicit(a, &cur, v,
+                                                     memory_order_relaxed,
+                                                     memory_order_relaxed))
+        ;
+}
+
+static int
+search_bound(struct search_job *job)
+{
+    int w, e;
+    w = atomic_load_explicit(&job->witness, memory_order_relaxed);
+    e = atomic_load_explicit(&job->error, memory_order_relaxed);
+    return w < e ? w : e;
+}
+
+static void *
+search_worker(void *arg)
+{
+    struct search_job *job;
+    long start;
+    int i, end, j;
+
+    job = (struct search_job *) arg;
+    int nx[job->args];
+    memcpy(nx, job->x, job->args * sizeof(int));
+
+    for (;;) {
+        start = atomic_fetch_add_explicit(&job->next, NODE_SEARCH_CHUNK,
+                                          memory_order_relaxed);
+        if (start >= search_bound(job))
+            break;
+        end = job->lim - start < NODE_SEARCH_CHUNK ? job->lim : (int) start + NODE_SEARCH_CHUNK;
+        for (i = (int) start; i < end && i < search_bound(job); ++i) {
+            nx[job->args - 1] = i;
+            j = node_compute(job->p, nx, job->args);
+            if (j < 0) {
+                atomic_min(&job->error, i);
+                break;
+            } else if (1 == j) {
+                atomic_min(&job->witness, i);
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+
+static int
+search_parallel(const struct node *n, const int *x, size_t args, int threads)
+{
+    struct search_job job;
+    pthread_t *tids;
+    int i, started, w, e;
+
+    job.p = ((struct node_search *) n->data)->p;
+    job.x = x;
+    job.args = args;
+    job.lim = x[args - 1];
+    atomic_init(&job.next, 0);
+    atomic_init(&job.witness, job.lim);
+    atomic_init(&job.error, job.lim);
+
+    /*
+     *  The calling thread is one of the workers. If not all threads can be
+     *  created, the search finishes with the ones that were.
+     */
+    tids = malloc((threads - 1) * sizeof(pthread_t));
+    started = 0;
+    if (tids) {
+        for (i = 0; i < threads - 1; ++i) {
+            if (pthread_create(&tids[i], NULL, search_worker, &job))
+                break;
+            ++started;
+        }
+    }
+    search_worker(&job);
+    for (i = 0; i < started; ++i)
+        pthread_join(tids[i], NULL);
+    free(tids);
+
+    w = atomic_load(&job.witness);
+    e = atomic_load(&job.error);
+    return e < w ? -1 : w;
+}
+
+/*!
+ *  Returns the same result as node_compute(). If \a n is a search node with a
+ *  bound larger than NODE_SEARCH_CHUNK, the candidates are tested by \a threads
+ *  threads in parallel, including the calling one; if \a threads is 0 or less,
+ *  one thread per online processor is used. The result is still the least
+ *  index at which the predicate holds.
+ */
+int
+node_compute_parallel(const struct node *n, const int *x, size_t args, int threads)
+{
+    long cpus;
+
+    assert(n);
+
+    if (NODE_SEARCH != n->type || !args || *x < 0 || x[args - 1] <= NODE_SEARCH_CHUNK)
+        return node_compute(n, x, args);
+
+    if (threads <= 0) {
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (int) cpus : 1;
+    }
+    if (threads == 1)
+        return node_compute(n, x, args);
+    return search_parallel(n, x, args, threads);
+}
+
+/*
+ * The thread pool evaluates the legs of compositions as tasks. Each worker
+ * owns a deque of tasks: it pushes and pops at the bottom, so that it works
+ * depth first on the tasks it created itself, while idle workers steal from
+ * the top of other deques, where the oldest and usually largest tasks are.
+ * Threads outside the pool share one extra deque.
+ *
+ * A composition spawns a task for each leg that is estimated to be
+ * expensive, except the last one, evaluates the remaining legs itself and
+ * then runs or steals other tasks until its own have finished. Since waiting
+ * never blocks, nested compositions cannot deadlock the pool. Legs that are
+ * cheap, such as projections, zero and kernels, are always evaluated inline.
+ */
+
+struct pool_task
+{
+    const struct node *n;
+    const int *x;
+    size_t args;
+    int *out;
+    atomic_int *pending;
+};
+
+struct pool_deque
+{
+    struct pool_task *tasks;
+    size_t top;
+    size_t bottom;
+    size_t asize;
+    pthread_mutex_t lock;
+};
+
+/*!
+ *  \struct node_thread_pool
+ *
+ *  \brief A work-stealing thread pool for node_compute_pool().
+ */
+struct node_thread_pool
+{
+    pthread_t *threads;
+    struct pool_deque *deques;
+    int nthreads;
+    atomic_int queued;
+    int sleeping;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+};
+
+static _Thread_local struct node_thread_pool *pool_self;
+static _Thread_local int pool_index;
+
+static int
+deque_push(struct pool_deque *d, const struct pool_task *t)
+{
+    struct pool_task *tasks;
+    size_t asize;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom == d->asize) {
+        if (d->top) {
+            memmove(d->tasks, d->tasks + d->top,
+                    (d->bottom - d->top) * sizeof(struct pool_task));
+            d->bottom -= d->top;
+            d->top = 0;
+        } else {
+            asize = d->asize ? 2 * d->asize : 16;
+            tasks = realloc(d->tasks, asize * sizeof(struct pool_task));
+            if (!tasks) {
+                pthread_mutex_unlock(&d->lock);
+                return -1;
+            }
+            d->tasks = tasks;
+            d->asize = asize;
+        }
+    }
+    d->tasks[d->bottom++] = *t;
+    pthread_mutex_unlock(&d->lock);
+    return 0;
+}
+
+static int
+deque_take(struct pool_deque *d, struct pool_task *t, int steal)
+{
+    int found;
+
+    pthread_mutex_lock(&d->lock);
+    found = d->bottom > d->top;
+    if (found) {
+        *t = steal ? d->tasks[d->top++] : d->tasks[--d->bottom];
+        if (d->top == d->bottom)
+            d->top = d->bottom = 0;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+static int
+pool_self_index(struct node_thread_pool *pool)
+{
+    return pool_self == pool ? pool_index : pool->nthreads;
+}
+
+static int
+pool_take(struct node_thread_pool *pool, struct pool_task *t)
+{
+    int self, i, n;
+
+    if (!atomic_load_explicit(&pool->queued, memory_order_relaxed))
+        return 0;
+    self = pool_self_index(pool);
+    n = pool->nthreads + 1;
+    for (i = 0; i < n; ++i) {
+        if (deque_take(&pool->deques[(self + i) % n], t, i != 0)) {
+            atomic_fetch_sub_explicit(&pool->queued, 1, memory_order_relaxed);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int pool_compute(const struct node *n, const int *x, size_t args, struct node_thread_pool *pool);
+
+static void
+pool_run(struct node_thread_pool *pool, const struct pool_task *t)
+{
+    *t->out = pool_compute(t->n, t->x, t->args, pool);
+    atomic_fetch_sub_explicit(t->pending, 1, memory_order_release);
+}
+
+static int
+pool_spawn(struct node_thread_pool *pool, const struct pool_task *t)
+{
+    if (deque_push(&pool->deques[pool_self_index(pool)], t))
+        return -1;
+    atomic_fetch_add_explicit(&pool->queued, 1, memory_order_relaxed);
+    pthread_mutex_lock(&pool->lock);
+    if (pool->sleeping)
+        pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+static void *
+pool_worker(void *arg)
+{
+    struct node_thread_pool *pool;
+    struct pool_task t;
+
+    pool = pool_self;
+    (void) arg;
+
+    for (;;) {
+        if (pool_take(pool, &t)) {
+            pool_run(pool, &t);
+            continue;
+        }
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->stop && !atomic_load(&pool->queued)) {
+            ++pool->sleeping;
+            pthread_cond_wait(&pool->wake, &pool->lock);
+            --pool->sleeping;
+        }
+        if (pool->stop) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+struct pool_start
+{
+    struct node_thread_pool *pool;
+    int index;
+};
+
+static void *
+pool_start(void *arg)
+{
+    struct pool_start start;
+
+    start = *(struct pool_start *) arg;
+    free(arg);
+    pool_self = start.pool;
+    pool_index = start.index;
+    return pool_worker(NULL);
+}
+
+/*!
+ *  Creates a pool of \a threads worker threads, or one per online processor
+ *  if \a threads is 0 or less. Returns NULL if the pool could not be set up.
+ */
+struct node_thread_pool *
+node_thread_pool_new(int threads)
+{
+    struct node_thread_pool *pool;
+    struct pool_start *start;
+    long cpus;
+    int i;
+
+    if (threads <= 0) {
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (int) cpus : 1;
+    }
+
+    pool = malloc(sizeof(struct node_thread_pool));
+    if (!pool)
+        return NULL;
+    pool->threads = malloc(threads * sizeof(pthread_t));
+    pool->deques = calloc(threads + 1, sizeof(struct pool_deque));
+    if (!pool->threads || !pool->deques) {
+        free(pool->threads);
+        free(pool->deques);
+        free(pool);
+        return NULL;
+    }
+    for (i = 0; i <= threads; ++i)
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+    atomic_init(&pool->queued, 0);
+    pool->sleeping = 0;
+    pool->stop = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+
+    /*
+     *  Workers read nthreads to find the shared deque, so it is set before any
+     *  of them start. If one cannot be started, the pool is taken down again.
+     */
+    pool->nthreads = threads;
+    for (i = 0; i < threads; ++i) {
+        start = malloc(sizeof(struct pool_start));
+        if (start) {
+            start->pool = pool;
+            start->index = i;
+            if (!pthread_create(&pool->threads[i], NULL, pool_start, start))
+                continue;
+        }
+        free(start);
+        pool->nthreads = i;
+        node_thread_pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+/*!
+ *  Stops the worker threads and releases the pool. No evaluation may be
+ *  running on it.
+ */
+void
+node_thread_pool_destroy(struct node_thread_pool *pool)
+{
+    int i;
+
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->nthreads; ++i)
+        pthread_join(pool->threads[i], NULL);
+
+    for (i = 0; i <= pool->nthreads; ++i) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].tasks);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    free(pool->threads);
+    free(pool->deques);
+    free(pool);
+}
+
+/*
+ *  Estimates the number of steps needed to evaluate n, up to
+ *  NODE_POOL_GRAIN. Recursion and search take about as many steps as their
+ *  bound; the bound of a loop in an outer function is not known before the
+ *  legs are evaluated, so such loops are assumed to be expensive.
+ */
+static unsigned long
+pool_cost(const struct node *n, const int *x, size_t args, int depth)
+{
+    union node_d_ptr d_ptr;
+    unsigned long cost;
+    int j;
+
+    switch (n->type)
+    {
+    case NODE_RECURSION:
+    case NODE_SEARCH:
+        if (!x || !args || x[args - 1] < 0)
+            return x ? 1 : NODE_POOL_GRAIN;
+        return (unsigned long) x[args - 1] + 1;
+    case NODE_COMPOSITION:
+        if (!depth)
+            return NODE_POOL_GRAIN;
+        d_ptr.comp = (struct node_composition *) n->data;
+        cost = 1 + pool_cost(d_ptr.comp->f, NULL, 0, depth - 1);
+        for (j = 0; j < d_ptr.comp->places && cost < NODE_POOL_GRAIN; ++j)
+            cost += pool_cost(d_ptr.comp->g[j], x, args, depth - 1);
+        return cost;
+    case NODE_KERNEL:
+        d_ptr.kernel = (struct node_kernel *) n->data;
+        if (d_ptr.kernel->arity >= 0 && d_ptr.kernel->arity != (int) args)
+            return pool_cost(d_ptr.kernel->orig, x, args, depth);
+        return 1;
+    default:
+        return 1;
+    } /* end switch */
+}
+
+/*
+ *  Returns 1 if n contains a loop, or might within depth levels.
+ */
+static int
+pool_loops(const struct node *n, int depth)
+{
+    union node_d_ptr d_ptr;
+    int j;
+
+    if (!depth)
+        return 1;
+    switch (n->type)
+    {
+    case NODE_RECURSION:
+    case NODE_SEARCH:
+        return 1;
+    case NODE_COMPOSITION:
+        d_ptr.comp = (struct node_composition *) n->data;
+        if (pool_loops(d_ptr.comp->f, depth - 1))
+            return 1;
+        for (j = 0; j < d_ptr.comp->places; ++j)
+            if (pool_loops(d_ptr.comp->g[j], depth - 1))
+                return 1;
+        return 0;
+    case NODE_KERNEL:
+        d_ptr.kernel = (struct node_kernel *) n->data;
+        return d_ptr.kernel->arity >= 0 && pool_loops(d_ptr.kernel->orig, depth);
+    default:
+        return 0;
+    } /* end switch */
+}
+
+/*
+ *  Returns 1 if evaluating n might spawn tasks, that is if it contains a
+ *  composition with at least two legs that loop, or might within depth
+ *  levels. Otherwise there is no parallelism to be had in n.
+ */
+static int
+pool_splits(const struct node *n, int depth)
+{
+    union node_d_ptr d_ptr;
+    int j, loops;
+
+    if (!depth)
+        return 1;
+    switch (n->type)
+    {
+    case NODE_RECURSION:
+        d_ptr.rec = (struct node_recursion *) n->data;
+        return pool_splits(d_ptr.rec->f, depth - 1)
+               || pool_splits(d_ptr.rec->g, depth - 1);
+    case NODE_SEARCH:
+        d_ptr.search = (struct node_search *) n->data;
+        return pool_splits(d_ptr.search->p, depth - 1);
+    case NODE_COMPOSITION:
+        d_ptr.comp = (struct node_composition *) n->data;
+        if (pool_splits(d_ptr.comp->f, depth - 1))
+            return 1;
+        loops = 0;
+        for (j = 0; j < d_ptr.comp->places; ++j) {
+            if (pool_splits(d_ptr.comp->g[j], depth - 1))
+                return 1;
+            loops += pool_loops(d_ptr.comp->g[j], depth - 1);
+        }
+        return loops > 1;
+    case NODE_KERNEL:
+        d_ptr.kernel = (struct node_kernel *) n->data;
+        return d_ptr.kernel->arity >= 0 && pool_splits(d_ptr.kernel->orig, depth);
+    default:
+        return 0;
+    } /* end switch */
+}
+
+static int
+pool_composition(const struct node *n, const int *x, size_t args,
+                 struct node_thread_pool *pool)
+{
+    struct node_composition *comp;
+    struct pool_task t;
+    atomic_int pending;
+    int j, last;
+
+    comp = (struct node_composition *) n->data;
+    int y[comp->places + 1];
+    char spawn[comp->places + 1];
+
+    /*
+     *  spawn[j] is 2 for a leg that goes to the pool, 1 for an expensive leg
+     *  evaluated here and 0 for a cheap one, which has nothing to gain from
+     *  the pool and is handed to node_compute() directly.
+     */
+    last = -1;
+    for (j = 0; j < comp->places; ++j) {
+        spawn[j] = pool_cost(comp->g[j], x, args, 4) >= NODE_POOL_GRAIN ? 2 : 0;
+        if (spawn[j])
+            last = j;
+    }
+    if (last >= 0)
+        spawn[last] = 1;
+
+    atomic_init(&pending, 0);
+    t.x = x;
+    t.args = args;
+    t.pending = &pending;
+    for (j = 0; j < comp->places; ++j) {
+        if (spawn[j] != 2)
+            continue;
+        t.n = comp->g[j];
+        t.out = &y[j];
+        atomic_fetch_add_explicit(&pending, 1, memory_order_relaxed);
+        if (pool_spawn(pool, &t)) {
+            atomic_fetch_sub_explicit(&pending, 1, memory_order_relaxed);
+            spawn[j] = 1;
+        }
+    }
+
+    for (j = 0; j < comp->places; ++j) {
+        if (1 == spawn[j])
+            y[j] = pool_compute(comp->g[j], x, args, pool);
+        else if (!spawn[j])
+            y[j] = node_compute(comp->g[j], x, args);
+    }
+
+    /*
+     *  The tasks refer to x and y, so wait for all of them even if a leg
+     *  turned out undefined, helping with other work in the meantime.
+     */
+    while (atomic_load_explicit(&pending, memory_order_acquire)) {
+        if (pool_take(pool, &t))
+            pool_run(pool, &t);
+        else
+            sched_yield();
+    }
+
+    for (j = 0; j < comp->places; ++j)
+        if (y[j] < 0)
+            return -1;
+    return pool_compute(comp->f, y, comp->places, pool);
+}
+
+static int
+pool_compute(const struct node *n, const int *x, size_t args,
+             struct node_thread_pool *pool)
+{
+    union node_d_ptr d_ptr;
+    int i, j, k, lim;
+
+    if (args && *x < 0)
+        return -1;
+
+    /*
+     *  Small subtrees are not worth the bookkeeping. A loop is checked once
+     *  for whether its body has any parallelism at all, rather than at every
+     *  step.
+     */
+    if (pool_cost(n, x, args, 4) < NODE_POOL_GRAIN
+            || ((NODE_RECURSION == n->type || NODE_SEARCH == n->type)
+                && !pool_splits(n, 16)))
+        return node_compute(n, x, args);
+
+    switch (n->type)
+    {
+    case NODE_COMPOSITION:
+        return pool_composition(n, x, args, pool);
+    case NODE_RECURSION:
+    {
+        if (!args)
+            return -1;
+        d_ptr.rec = (struct node_recursion *) n->data;
+        lim = x[args - 1];
+        i = pool_compute(d_ptr.rec->f, x, args - 1, pool);
+        if (i < 0)
+            return -1;
+        int nx[args + 1];
+        memcpy(&nx[1], x, (args - 1) * sizeof(int));
+        for (k = 0; k < lim; ++k) {
+            nx[0] = i;
+            nx[args] = k;
+            i = pool_compute(d_ptr.rec->g, nx, args + 1, pool);
+            if (i < 0)
+                return -1;
+        }
+        return i;
+    }
+    case NODE_SEARCH:
+    {
+        if (!args)
+            return -1;
+        d_ptr.search = (struct node_search *) n->data;
+        int nx[args];
+        memcpy(nx, x, args * sizeof(int));
+        lim = x[args - 1];
+        for (i = 0; i < lim; ++i) {
+            nx[args - 1] = i;
+            j = pool_compute(d_ptr.search->p, nx, args, pool);
+            if (j < 0)
+                return -1;
+            else if (1 == j)
+                return i;
+        }
+        return lim;
+    }
+    case NODE_KERNEL:
+        d_ptr.kernel = (struct node_kernel *) n->data;
+        if (!node_kernel_applies(d_ptr.kernel, x, args))
+            return pool_compute(d_ptr.kernel->orig, x, args, pool);
+        return node_kernel_compute(d_ptr.kernel, x, args);
+    default:
+        return node_compute(n, x, args);
+    } /* end switch */
+}
+
+/*!
+ *  Returns the same result as node_compute(), evaluating the expensive legs
+ *  of compositions in parallel on \a pool. Several threads may evaluate on
+ *  the same pool at once.
+ */
+int
+node_compute_pool(const struct node *n, const int *x, size_t args,
+                  struct node_thread_pool *pool)
+{
+    assert(n && pool);
+    return pool_compute(n, x, args, pool);
+}
@@ -0,0 +1,35 @@
+#ifndef COMP_PARALLEL_H
+#define COMP_PARALLEL_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include "comp.h"
+
+/*
+ *  Number of consecutive candidates a worker claims at a time.
+ */
+#define NODE_SEARCH_CHUNK 8
+
+/*
+ *  Estimated number of steps below which a composition leg is evaluated
+ *  inline instead of as a task on the thread pool.
+ */
+#define NODE_POOL_GRAIN 256
+
+struct node_thread_pool;
+
+int node_compute_parallel(const struct node *n, const int *x, size_t args, int threads);
+
+struct node_thread_pool *node_thread_pool_new(int threads);
+void node_thread_pool_destroy(struct node_thread_pool *pool);
+
+int node_compute_pool(const struct node *n, const int *x, size_t args, struct node_thread_pool *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* COMP_PARALLEL_H */
@@ -0,0 +1,785 @@
+#include <malloc.h>
+#include <assert.h>
+#include <string.h>
+#include <limits.h>
+#include "comp_program.h"
+
+/*
+ * A node tree is compiled into a single array of instructions, where every
+ * node becomes a block of code terminated by OP_RET. Blocks of child nodes
+ * are emitted before the block of their parent, so compilation is one
+ * post-order walk of the tree. Leaf nodes used as legs of a composition are
+ * inlined into the parent block.
+ *
+ * The interpreter keeps the argument values and intermediate results on one
+ * value stack and the active calls on an explicit frame stack, so evaluation
+ * never recurses on the C stack. A frame refers to its arguments through a
+ * (base, argc) window into the value stack; legs of a composition share the
+ * window of the caller, while the outer function, the recursion step and the
+ * search predicate get a fresh window built on top of the stack.
+ *
+ * Since the whole state of an evaluation is the two stacks and the program
+ * counter, it can be suspended between any two instructions and resumed
+ * later, see node_task_start().
+ */
+
+/*!
+ *  \struct node_program
+ *
+ *  \brief A node tree compiled to a flat instruction array.
+ */
+
+/*!
+ *  \struct node_instr
+ *
+ *  \brief A single instruction, with up to two integer operands.
+ */
+
+#define VM_STACK_SIZE 256
+#define VM_FRAME_SIZE 64
+
+struct vm_frame
+{
+    int ret;
+    int base;
+    int argc;
+    int sp;
+};
+
+struct vm
+{
+    const struct node_instr *code;
+    int pc;
+    const struct node_kernel *kernels;
+    int *vals;
+    size_t sp;
+    size_t vsize;
+    struct vm_frame *frames;
+    size_t fp;
+    size_t fsize;
+    int vstack[VM_STACK_SIZE];
+    struct vm_frame fstack[VM_FRAME_SIZE];
+};
+
+static int
+emit(struct node_program *prog, uint8_t op, int a, int b)
+{
+    size_t n;
+    void *code;
+
+    if (prog->size == prog->asize) {
+        n = prog->asize ? 2 * prog->asize : 64;
+        if (n * sizeof(struct node_instr) > PROGRAM_MAX_CODE_SIZE)
+            return -1;
+        code = realloc(prog->code, n * sizeof(struct node_instr));
+        if (!code)
+            return -1;
+        prog->code = code;
+        prog->asize = n;
+    }
+    prog->code[prog->size].op = op;
+    prog->code[prog->size].a = a;
+    prog->code[prog->size].b = b;
+    return (int) prog->size++;
+}
+
+static int
+add_kernel(struct node_program *prog, const struct node_kernel *kernel)
+{
+    struct node_kernel *kernels;
+
+    kernels = realloc(prog->kernels, (prog->nkernels + 1) * sizeof(struct node_kernel));
+    if (!kernels)
+        return -1;
+    prog->kernels = kernels;
+    prog->kernels[prog->nkernels] = *kernel;
+    prog->kernels[prog->nkernels].orig = NULL;
+    return (int) prog->nkernels++;
+}
+
+static int
+is_leaf(const struct node *n)
+{
+    switch (n->type)
+    {
+    case NODE_ZERO:
+    case NODE_SUCCESSOR:
+    case NODE_PROJECTION:
+    case NODE_INVALID:
+        return 1;
+    default:
+        break;
+    } /* end switch */
+    return 0;
+}
+
+static int
+emit_leaf(struct node_program *prog, const struct node *n)
+{
+    switch (n->type)
+    {
+    case NODE_SUCCESSOR:
+        return emit(prog, OP_SUCC, 0, 0);
+    case NODE_PROJECTION:
+        return emit(prog, OP_PROJ, ((struct node_projection *) n->data)->place, 0);
+    case NODE_ZERO:
+    case NODE_INVALID:
+    default:
+        break;
+    } /* end switch */
+    return emit(prog, OP_ZERO, 0, 0);
+}
+
+/*
+ *  Applies the outer function of a composition to the top places values of
+ *  the stack. Leaf functions operate on the stack directly, anything else is
+ *  called through its block at entry.
+ */
+static int
+emit_apply(struct node_program *prog, const struct node *f, int entry, int places)
+{
+    switch (f->type)
+    {
+    case NODE_SUCCESSOR:
+        return emit(prog, OP_APPLY_SUCC, 0, places);
+    case NODE_PROJECTION:
+        return emit(prog, OP_APPLY_PROJ, ((struct node_projection *) f->data)->place, places);
+    case NODE_ZERO:
+    case NODE_INVALID:
+        return emit(prog, OP_APPLY_ZERO, 0, places);
+    default:
+        break;
+    } /* end switch */
+    return emit(prog, OP_CALLN, entry, places);
+}
+
+/*
+ *  Shared nodes of a hash-consed DAG are compiled once; the compiler remembers
+ *  the entry point of each in a small open addressing map.
+ */
+struct compiler
+{
+    struct node_program *prog;
+    const struct node **keys;
+    int *entries;
+    size_t size;
+    size_t count;
+};
+
+static size_t
+compiled_slot(const struct compiler *c, const struct node *n)
+{
+    size_t i;
+    i = ((size_t) n * 0x9e3779b97f4a7c15ULL >> 17) & (c->size - 1);
+    while (c->keys[i] && c->keys[i] != n)
+        i = (i + 1) & (c->size - 1);
+    return i;
+}
+
+static int
+compiled_entry(const struct compiler *c, const struct node *n)
+{
+    size_t i;
+    if (!c->size)
+        return -1;
+    i = compiled_slot(c, n);
+    return c->keys[i] ? c->entries[i] : -1;
+}
+
+static int
+compiled_insert(struct compiler *c, const struct node *n, int entry)
+{
+    const struct node **keys;
+    int *entries;
+    size_t i, j, size;
+
+    if (2 * (c->count + 1) > c->size) {
+        keys = c->keys;
+        entries = c->entries;
+        size = c->size;
+        c->size = size ? 2 * size : 64;
+        c->keys = calloc(c->size, sizeof(struct node *));
+        c->entries = malloc(c->size * sizeof(int));
+        if (!c->keys || !c->entries) {
+            free(keys);
+            free(entries);
+            return -1;
+        }
+        for (j = 0; j < size; ++j) {
+            if (keys[j]) {
+                i = compiled_slot(c, keys[j]);
+                c->keys[i] = keys[j];
+                c->entries[i] = entries[j];
+            }
+        }
+        free(keys);
+        free(entries);
+    }
+    i = compiled_slot(c, n);
+    c->keys[i] = n;
+    c->entries[i] = entry;
+    ++c->count;
+    return 0;
+}
+
+/*
+ *  Compiles the subtree rooted at n and returns the entry point of its block,
+ *  or -1 if the program could not be grown.
+ */
+static int
+compile(struct compiler *c, const struct node *n)
+{
+    struct node_program *prog;
+    union node_d_ptr d_ptr;
+    int i, f, g, entry, loop, end;
+
+    if (!n)
+        return -1;
+    if ((n->flags & NODE_FLAG_SHARED) && (entry = compiled_entry(c, n)) >= 0)
+        return entry;
+
+    prog = c->prog;
+
+    switch (n->type)
+    {
+    case NODE_COMPOSITION:
+    {
+        d_ptr.comp = (struct node_composition *) n->data;
+        int legs[d_ptr.comp->places + 1];
+        f = 0;
+        if (!is_leaf(d_ptr.comp->f) && (f = compile(c, d_ptr.comp->f)) < 0)
+            return -1;
+        for (i = 0; i < d_ptr.comp->places; ++i) {
+            legs[i] = 0;
+            if (!is_leaf(d_ptr.comp->g[i])
+                    && (legs[i] = compile(c, d_ptr.comp->g[i])) < 0)
+                return -1;
+        }
+        entry = (int) prog->size;
+        for (i = 0; i < d_ptr.comp->places; ++i) {
+            if (is_leaf(d_ptr.comp->g[i]))
+                g = emit_leaf(prog, d_ptr.comp->g[i]);
+            else
+                g = emit(prog, OP_CALL, legs[i], 0);
+            if (g < 0)
+                return -1;
+        }
+        if (emit_apply(prog, d_ptr.comp->f, f, d_ptr.comp->places) < 0)
+            return -1;
+        break;
+    }
+    case NODE_RECURSION:
+        d_ptr.rec = (struct node_recursion *) n->data;
+        if ((f = compile(c, d_ptr.rec->f)) < 0
+                || (g = compile(c, d_ptr.rec->g)) < 0)
+            return -1;
+        if ((entry = emit(prog, OP_REC, f, 0)) < 0
+                || emit(prog, OP_ZERO, 0, 0) < 0
+                || (loop = emit(prog, OP_REC_STEP, g, 0)) < 0
+                || emit(prog, OP_REC_NEXT, loop, 0) < 0
+                || (end = emit(prog, OP_POP, 0, 0)) < 0)
+            return -1;
+        prog->code[loop].b = end;
+        break;
+    case NODE_SEARCH:
+        d_ptr.search = (struct node_search *) n->data;
+        if ((f = compile(c, d_ptr.search->p)) < 0)
+            return -1;
+        if ((entry = emit(prog, OP_SEARCH, 0, 0)) < 0
+                || (loop = emit(prog, OP_SEARCH_STEP, f, 0)) < 0
+                || emit(prog, OP_SEARCH_NEXT, loop, 0) < 0)
+            return -1;
+        end = (int) prog->size;
+        prog->code[loop].b = end;
+        prog->code[loop + 1].b = end;
+        break;
+    case NODE_KERNEL:
+        /*
+         *  The original tree is compiled as well, for calls with an argument
+         *  count the kernel was not made for. Constants have none.
+         */
+        d_ptr.kernel = (struct node_kernel *) n->data;
+        f = 0;
+        if ((d_ptr.kernel->orig && (f = compile(c, d_ptr.kernel->orig)) < 0)
+                || (g = add_kernel(prog, d_ptr.kernel)) < 0
+                || (entry = emit(prog, OP_KERNEL, g, f)) < 0)
+            return -1;
+        break;
+    default:
+        entry = emit_leaf(prog, n);
+        break;
+    } /* end switch */
+
+    if (emit(prog, OP_RET, 0, 0) < 0)
+        return -1;
+    if ((n->flags & NODE_FLAG_SHARED) && compiled_insert(c, n, entry) < 0)
+        return -1;
+    return entry;
+}
+
+/*!
+ *  Compiles the node tree \a n to a flat program. The tree is not referenced
+ *  by the program and can be destroyed afterwards. Nodes shared through a
+ *  node_table are compiled once, however often they occur in the tree.
+ *  Returns NULL if memory for the program could not be allocated.
+ */
+struct node_program *
+node_program_compile(const struct node *n)
+{
+    struct node_program *prog;
+    struct compiler c;
+
+    prog = malloc(sizeof(struct node_program));
+    if (!prog)
+        return NULL;
+    prog->code = NULL;
+    prog->size = 0;
+    prog->asize = 0;
+    prog->kernels = NULL;
+    prog->nkernels = 0;
+
+    c.prog = prog;
+    c.keys = NULL;
+    c.entries = NULL;
+    c.size = 0;
+    c.count = 0;
+    prog->entry = compile(&c, n);
+    free(c.keys);
+    free(c.entries);
+
+    if (prog->entry < 0) {
+        node_program_destroy(prog);
+        return NULL;
+    }
+    return prog;
+}
+
+/*!
+ *  Destroys the provided program and releases associated memory.
+ */
+void
+node_program_destroy(struct node_program *prog)
+{
+    if (!prog)
+        return;
+
+    free(prog->code);
+    free(prog->kernels);
+    free(prog);
+}
+
+static void
+vm_init(struct vm *vm, const struct node_program *prog)
+{
+    vm->code = prog->code;
+    vm->kernels = prog->kernels;
+    vm->vals = vm->vstack;
+    vm->sp = 0;
+    vm->vsize = VM_STACK_SIZE;
+    vm->frames = vm->fstack;
+    vm->fp = 0;
+    vm->fsize = VM_FRAME_SIZE;
+}
+
+static void
+vm_release(struct vm *vm)
+{
+    if (vm->vals != vm->vstack)
+        free(vm->vals);
+    if (vm->frames != vm->fstack)
+        free(vm->frames);
+}
+
+/*
+ *  Makes room for at least n more values on the value stack.
+ */
+static int
+vm_grow(struct vm *vm, size_t n)
+{
+    size_t a;
+    int *vals;
+
+    a = 2 * vm->vsize;
+    while (a < vm->sp + n)
+        a *= 2;
+    if (vm->vals == vm->vstack) {
+        if ((vals = malloc(a * sizeof(int))))
+            memcpy(vals, vm->vstack, vm->sp * sizeof(int));
+    } else {
+        vals = realloc(vm->vals, a * sizeof(int));
+    }
+    if (!vals)
+        return -1;
+    vm->vals = vals;
+    vm->vsize = a;
+    return 0;
+}
+
+static inline int
+vm_reserve(struct vm *vm, size_t n)
+{
+    return vm->sp + n <= vm->vsize ? 0 : vm_grow(vm, n);
+}
+
+static int
+vm_grow_frames(struct vm *vm)
+{
+    size_t a;
+    struct vm_frame *frames;
+
+    a = 2 * vm->fsize;
+    if (vm->frames == vm->fstack) {
+        if ((frames = malloc(a * sizeof(struct vm_frame))))
+            memcpy(frames, vm->fstack, vm->fp * sizeof(struct vm_frame));
+    } else {
+        frames = realloc(vm->frames, a * sizeof(struct vm_frame));
+    }
+    if (!frames)
+        return -1;
+    vm->frames = frames;
+    vm->fsize = a;
+    return 0;
+}
+
+static inline int
+vm_call(struct vm *vm, int ret, size_t base, int argc, size_t sp)
+{
+    if (vm->fp == vm->fsize && vm_grow_frames(vm) < 0)
+        return -1;
+    vm->frames[vm->fp].ret = ret;
+    vm->frames[vm->fp].base = (int) base;
+    vm->frames[vm->fp].argc = argc;
+    vm->frames[vm->fp].sp = (int) sp;
+    ++vm->fp;
+    return 0;
+}
+
+/*
+ *  Pushes the arguments and the outermost frame, ready to run from the
+ *  program's entry point.
+ */
+static int
+vm_start(struct vm *vm, const struct node_program *prog, const int *x, size_t args)
+{
+    vm_init(vm, prog);
+    vm->pc = prog->entry;
+    if (vm_reserve(vm, args) < 0 || vm_call(vm, -1, 0, (int) args, 0) < 0)
+        return -1;
+    if (args)
+        memcpy(vm->vals, x, args * sizeof(int));
+    vm->sp = args;
+    return 0;
+}
+
+/*
+ *  Returned by vm_exec() when it ran out of steps.
+ */
+#define VM_YIELD -2
+
+/*
+ *  Runs the program from instruction vm->pc until the outermost frame returns.
+ *  Any negative intermediate value makes the whole computation undefined.
+ *  Every instruction costs one of the *fuel steps; when none are left the
+ *  program counter is saved and VM_YIELD returned, and a later call carries
+ *  on from there.
+ */
+static int
+vm_exec(struct vm *vm, unsigned long *fuel)
+{
+    const struct node_instr *in;
+    struct vm_frame *fr;
+    unsigned long left;
+    size_t start;
+    int v, k, pc, base, argc;
+
+    fr = &vm->frames[vm->fp - 1];
+    base = fr->base;
+    argc = fr->argc;
+    pc = vm->pc;
+    left = *fuel;
+
+    for (;;) {
+        if (!left) {
+            vm->pc = pc;
+            *fuel = 0;
+            return VM_YIELD;
+        }
+        --left;
+        in = &vm->code[pc];
+        switch (in->op)
+        {
+        case OP_ZERO:
+            v = 0;
+            goto push;
+        case OP_SUCC:
+            if (!argc)
+                return -1;
+            v = vm->vals[base] + 1;
+            goto push;
+        case OP_PROJ:
+            if (in->a >= argc)
+                return -1;
+            v = vm->vals[base + in->a];
+            goto push;
+        case OP_CALL:
+            if (vm_call(vm, pc + 1, base, argc, vm->sp) < 0)
+                return -1;
+            pc = in->a;
+            goto enter;
+        case OP_CALLN:
+            start = vm->sp - in->b;
+            if (vm_call(vm, pc + 1, start, in->b, start) < 0)
+                return -1;
+            pc = in->a;
+            goto enter;
+        case OP_APPLY_ZERO:
+            vm->sp -= in->b;
+            v = 0;
+            goto push;
+        case OP_APPLY_SUCC:
+            if (!in->b)
+                return -1;
+            vm->sp -= in->b;
+            v = vm->vals[vm->sp] + 1;
+            goto push;
+        case OP_APPLY_PROJ:
+            if (in->a >= in->b)
+                return -1;
+            vm->sp -= in->b;
+            v = vm->vals[vm->sp + in->a];
+            goto push;
+        case OP_RET:
+            v = vm->vals[vm->sp - 1];
+            vm->sp = fr->sp;
+            pc = fr->ret;
+            if (!--vm->fp) {
+                *fuel = left;
+                return v;
+            }
+            vm->vals[vm->sp++] = v;
+            goto enter;
+        case OP_POP:
+            --vm->sp;
+            ++pc;
+            break;
+        case OP_REC:
+            if (!argc || vm_call(vm, pc + 1, base, argc - 1, vm->sp) < 0)
+                return -1;
+            pc = in->a;
+            goto enter;
+        case OP_REC_STEP:
+            /*
+             *  Stack: [.., h(x, k), k]. Calls g(h(x, k), x, k) unless k has
+             *  reached the recursion variable.
+             */
+            k = vm->vals[vm->sp - 1];
+            if (k >= vm->vals[base + argc - 1]) {
+                pc = in->b;
+                break;
+            }
+            if (vm_reserve(vm, argc + 1) < 0)
+                return -1;
+            start = vm->sp;
+            vm->vals[start] = vm->vals[start - 2];
+            memcpy(&vm->vals[start + 1], &vm->vals[base], (argc - 1) * sizeof(int));
+            vm->vals[start + argc] = k;
+            vm->sp = start + argc + 1;
+            if (vm_call(vm, pc + 1, start, argc + 1, start) < 0)
+                return -1;
+            pc = in->a;
+            goto enter;
+        case OP_REC_NEXT:
+            v = vm->vals[--vm->sp];
+            vm->vals[vm->sp - 2] = v;
+            ++vm->vals[vm->sp - 1];
+            pc = in->a;
+            break;
+        case OP_SEARCH:
+            if (!argc)
+                return -1;
+            v = 0;
+            goto push;
+        case OP_SEARCH_STEP:
+            /*
+             *  Stack: [.., i]. Calls p(x, i) unless i has reached the limit,
+             *  in which case the limit itself is the result.
+             */
+            k = vm->vals[vm->sp - 1];
+            if (k >= vm->vals[base + argc - 1]) {
+                vm->vals[vm->sp - 1] = vm->vals[base + argc - 1];
+                pc = in->b;
+                break;
+            }
+            if (vm_reserve(vm, argc) < 0)
+                return -1;
+            start = vm->sp;
+            memcpy(&vm->vals[start], &vm->vals[base], (argc - 1) * sizeof(int));
+            vm->vals[start + argc - 1] = k;
+            vm->sp = start + argc;
+            if (vm_call(vm, pc + 1, start, argc, start) < 0)
+                return -1;
+            pc = in->a;
+            goto enter;
+        case OP_SEARCH_NEXT:
+            if (1 == vm->vals[--vm->sp]) {
+                pc = in->b;
+            } else {
+                ++vm->vals[vm->sp - 1];
+                pc = in->a;
+            }
+            break;
+        case OP_KERNEL:
+            if (node_kernel_applies(&vm->kernels[in->a], &vm->vals[base], argc)) {
+                v = node_kernel_compute(&vm->kernels[in->a], &vm->vals[base], argc);
+                goto push;
+            }
+            if (vm_call(vm, pc + 1, base, argc, vm->sp) < 0)
+                return -1;
+            pc = in->b;
+            goto enter;
+        default:
+            assert(0);
+            return -1;
+        } /* end switch */
+        continue;
+push:
+        if (v < 0 || vm_reserve(vm, 1) < 0)
+            return -1;
+        vm->vals[vm->sp++] = v;
+        ++pc;
+        continue;
+enter:
+        fr = &vm->frames[vm->fp - 1];
+        base = fr->base;
+        argc = fr->argc;
+    }
+}
+
+/*!
+ *  Runs the program \a prog on the argument vector \a x and returns the same
+ *  result as node_compute() would for the tree the program was compiled from.
+ *  Evaluation uses an explicit stack and does not recurse.
+ */
+int
+node_program_run(const struct node_program *prog, const int *x, size_t args)
+{
+    unsigned long fuel = ULONG_MAX;
+    struct vm vm;
+    int y;
+
+    assert(prog);
+
+    if (args && *x < 0)
+        return -1;
+
+    y = -1;
+    if (vm_start(&vm, prog, x, args) >= 0)
+        y = vm_exec(&vm, &fuel);
+    vm_release(&vm);
+    return y;
+}
+
+/*!
+ *  \struct node_task
+ *
+ *  \brief A suspended run of a node_program, see node_task_start().
+ */
+struct node_task
+{
+    struct vm vm;
+    int done;
+    int result;
+    unsigned long steps;
+};
+
+/*!
+ *  Starts a run of \a prog on the argument vector \a x, without executing any
+ *  of it yet. The task keeps its own copy of the arguments, but refers to the
+ *  program, which must outlive it. Returns NULL if out of memory.
+ *
+ *  Tasks let a scheduler interleave many evaluations on a few threads: each
+ *  call to node_task_run() executes a bounded slice of one of them, so cheap
+ *  requests are not held up behind an expensive search.
+ */
+struct node_task *
+node_task_start(const struct node_program *prog, const int *x, size_t args)
+{
+    struct node_task *task;
+
+    assert(prog && (x || !args));
+
+    task = malloc(sizeof(struct node_task));
+    if (!task)
+        return NULL;
+    task->done = 0;
+    task->result = -1;
+    task->steps = 0;
+    if (vm_start(&task->vm, prog, x, args) < 0) {
+        node_task_destroy(task);
+        return NULL;
+    }
+    if (args && *x < 0)
+        task->done = 1;
+    return task;
+}
+
+/*!
+ *  Destroys the provided task, finished or not, and releases associated
+ *  memory.
+ */
+void
+node_task_destroy(struct node_task *task)
+{
+    if (!task)
+        return;
+
+    vm_release(&task->vm);
+    free(task);
+}
+
+/*!
+ *  Executes at most \a max_steps more instructions of \a task. Returns
+ *  NODE_TASK_DONE once the result is known, and NODE_TASK_YIELDED if the
+ *  steps ran out first, in which case a later call continues where this one
+ *  stopped. A task that is done stays done.
+ */
+int
+node_task_run(struct node_task *task, unsigned long max_steps)
+{
+    unsigned long fuel = max_steps;
+    int y;
+
+    assert(task);
+
+    if (task->done)
+        return NODE_TASK_DONE;
+
+    y = vm_exec(&task->vm, &fuel);
+    task->steps += max_steps - fuel;
+    if (VM_YIELD == y)
+        return NODE_TASK_YIELDED;
+    task->done = 1;
+    task->result = y;
+    return NODE_TASK_DONE;
+}
+
+/*!
+ *  Returns the result of a task that is done, the same as node_program_run()
+ *  would have returned for its program and arguments.
+ */
+int
+node_task_result(const struct node_task *task)
+{
+    assert(task && task->done);
+    return task->result;
+}
+
+/*!
+ *  Returns the number of instructions \a task has executed so far.
+ */
+unsigned long
+node_task_steps(const struct node_task *task)
+{
+    assert(task);
+    return task->steps;
+}
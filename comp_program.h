@@ -0,0 +1,72 @@
+#ifndef COMP_PROGRAM_H
+#define COMP_PROGRAM_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include "comp.h"
+
+#define PROGRAM_MAX_CODE_SIZE (16 * 1024 * 1024)
+
+enum node_opcode {
+    OP_ZERO = 0,
+    OP_SUCC,
+    OP_PROJ,
+    OP_CALL,
+    OP_CALLN,
+    OP_APPLY_ZERO,
+    OP_APPLY_SUCC,
+    OP_APPLY_PROJ,
+    OP_RET,
+    OP_POP,
+    OP_REC,
+    OP_REC_STEP,
+    OP_REC_NEXT,
+    OP_SEARCH,
+    OP_SEARCH_STEP,
+    OP_SEARCH_NEXT,
+    OP_KERNEL
+};
+
+enum node_task_status {
+    NODE_TASK_DONE = 0,
+    NODE_TASK_YIELDED
+};
+
+struct node_instr
+{
+    uint8_t op;
+    int a;
+    int b;
+};
+
+struct node_program
+{
+    struct node_instr *code;
+    size_t size;
+    size_t asize;
+    struct node_kernel *kernels;
+    size_t nkernels;
+    int entry;
+};
+
+struct node_program *node_program_compile(const struct node *n);
+void node_program_destroy(struct node_program *prog);
+
+int node_program_run(const struct node_program *prog, const int *x, size_t args);
+
+struct node_task;
+
+struct node_task *node_task_start(const struct node_program *prog, const int *x, size_t args);
+void node_task_destroy(struct node_task *task);
+int node_task_run(struct node_task *task, unsigned long max_steps);
+int node_task_result(const struct node_task *task);
+unsigned long node_task_steps(const struct node_task *task);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* COMP_PROGRAM_H */
@@ -0,0 +1,172 @@
+#include <malloc.h>
+#include <assert.h>
+#include <string.h>
+#include "comp_range.h"
+
+/*
+ * Range evaluation tabulates a function over every value 0 .. lim of its
+ * last argument, the others held fixed. Called once per value, a primitive
+ * recursion would redo all steps below that value, and a search would retry
+ * every candidate below it, so the table would take time quadratic in lim.
+ * Both are instead run once, up to lim, recording each intermediate result
+ * as it goes. Compositions tabulate their legs this way and then apply the
+ * outer function to each column. Other nodes are evaluated value by value.
+ */
+
+static int range(const struct node *n, const int *x, size_t args, int lim, int *out);
+
+static void
+range_fill(int *out, int value, int lim)
+{
+    int k;
+    for (k = 0; k <= lim; ++k)
+        out[k] = value;
+}
+
+static int
+range_recursion(const struct node *n, const int *x, size_t args, int lim, int *out)
+{
+    struct node_recursion *rec = (struct node_recursion *) n->data;
+    int k;
+
+    out[0] = node_compute(rec->f, x, args - 1);
+
+    /*
+     *  h(x, k + 1) = g(h(x, k), x, k), and an undefined step leaves every
+     *  later value undefined.
+     */
+    int nx[args + 1];
+    if (args > 1)
+        memcpy(&nx[1], x, (args - 1) * sizeof(int));
+    for (k = 0; k < lim; ++k) {
+        if (out[k] < 0) {
+            range_fill(&out[k + 1], -1, lim - k - 1);
+            break;
+        }
+        nx[0] = out[k];
+        nx[args] = k;
+        out[k + 1] = node_compute(rec->g, nx, args + 1);
+    }
+    return 0;
+}
+
+static int
+range_search(const struct node *n, const int *x, size_t args, int lim, int *out)
+{
+    struct node_search *search = (struct node_search *) n->data;
+    int i, j;
+
+    /*
+     *  The search bounded by k + 1 tries the same candidates as the one
+     *  bounded by k, and then k. Once a witness is found, it is the result
+     *  for every larger bound.
+     */
+    int nx[args];
+    if (args > 1)
+        memcpy(nx, x, (args - 1) * sizeof(int));
+    out[0] = 0;
+    for (i = 0; i < lim; ++i) {
+        nx[args - 1] = i;
+        j = node_compute(search->p, nx, args);
+        if (j < 0 || 1 == j) {
+            range_fill(&out[i + 1], j < 0 ? -1 : i, lim - i - 1);
+            break;
+        }
+        out[i + 1] = i + 1;
+    }
+    return 0;
+}
+
+static int
+range_composition(const struct node *n, const int *x, size_t args, int lim, int *out)
+{
+    struct node_composition *comp = (struct node_composition *) n->data;
+    size_t count = (size_t) lim + 1;
+    int *ys;
+    int i, j, k;
+
+    ys = malloc((comp->places ? comp->places : 1) * count * sizeof(int));
+    if (!ys)
+        return -1;
+    for (j = 0; j < comp->places; ++j) {
+        if (range(comp->g[j], x, args, lim, ys + j * count)) {
+            free(ys);
+            return -1;
+        }
+    }
+
+    int y[comp->places + 1];
+    for (k = 0; k <= lim; ++k) {
+        for (j = 0; j < comp->places; ++j) {
+            if ((i = ys[j * count + k]) < 0)
+                break;
+            y[j] = i;
+        }
+        out[k] = j < comp->places ? -1 : node_compute(comp->f, y, j);
+    }
+    free(ys);
+    return 0;
+}
+
+static int
+range(const struct node *n, const int *x, size_t args, int lim, int *out)
+{
+    struct node_kernel *kernel;
+    int k;
+
+    /*
+     *  With more than one argument, the first one is fixed, and node_compute()
+     *  rejects it at the root if it is negative.
+     */
+    if (args > 1 && *x < 0) {
+        range_fill(out, -1, lim);
+        return 0;
+    }
+
+    switch (n->type)
+    {
+    case NODE_COMPOSITION:
+        return range_composition(n, x, args, lim, out);
+    case NODE_RECURSION:
+        return range_recursion(n, x, args, lim, out);
+    case NODE_SEARCH:
+        return range_search(n, x, args, lim, out);
+    case NODE_KERNEL:
+        kernel = (struct node_kernel *) n->data;
+        if (kernel->arity >= 0 && kernel->arity != (int) args)
+            return range(kernel->orig, x, args, lim, out);
+        break;
+    default:
+        break;
+    } /* end switch */
+
+    int nx[args];
+    if (args > 1)
+        memcpy(nx, x, (args - 1) * sizeof(int));
+    for (k = 0; k <= lim; ++k) {
+        nx[args - 1] = k;
+        out[k] = node_compute(n, nx, args);
+    }
+    return 0;
+}
+
+/*!
+ *  Evaluates \a n for every value 0 .. \a lim of its last argument and stores
+ *  the results in \a out, which must have room for lim + 1 of them, so that
+ *  out[k] is what node_compute() returns for the arguments x[0] .. x[args - 2]
+ *  followed by k. Only those first args - 1 arguments are read from \a x.
+ *
+ *  A recursion or search at the root, or in a leg of a composition at the
+ *  root, takes as many steps for the whole range as it would for lim alone.
+ *  Returns 0 on success and -1 if memory for intermediate results could not
+ *  be allocated.
+ */
+int
+node_compute_range(const struct node *n, const int *x, size_t args, int lim, int *out)
+{
+    assert(n && args && (x || 1 == args) && out);
+
+    if (lim < 0)
+        return 0;
+    return range(n, x, args, lim, out);
+}
@@ -0,0 +1,17 @@
+#ifndef COMP_RANGE_H
+#define COMP_RANGE_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include "comp.h"
+
+int node_compute_range(const struct node *n, const int *x, size_t args, int lim, int *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* COMP_RANGE_H */
@@ -1,238 +1,502 @@
+#include <malloc.h>
 #include <assert.h>
 #include <stdio.h>
+#include <limits.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
 #include "comp_serialize.h"
 
-static int
-skip(char c)
+/*
+ * The parser is a single pass over the input, driven one byte at a time by
+ * parser_step(). Open brackets are kept on an explicit stack of frames, and
+ * finished subtrees on a stack of nodes until the bracket around them closes
+ * and they become the children of a new node, so the work per byte is
+ * constant and the input is never scanned ahead or read twice. The legs of
+ * a composition are counted as they arrive instead of up front. Every read
+ * is checked against the end of the input, and the first byte that can not
+ * continue a well-formed tree is reported as the error offset.
+ *
+ * With build cleared the same pass only validates, and no nodes are made.
+ */
+
+enum parser_state {
+    PARSER_NODE = 0,    /* expecting the start of a node */
+    PARSER_CONST,       /* after the '#' of #{N} */
+    PARSER_PROJ,        /* inside the digits of {N} or #{N} */
+    PARSER_NEXT,        /* after a node, expecting ',' or a closing bracket */
+    PARSER_DONE,        /* the root is complete */
+    PARSER_ERROR
+};
+
+struct parser_frame
 {
-    switch (c)
-    {
-    case '>':
-    case '}':
-    case ')':
-    case ',':
-    case ']':
-        return 1;
-    default:
-        break;
-    } /* end switch */
-    return 0;
+    char open;
+    size_t base;
+};
+
+struct parser
+{
+    struct node_arena *arena;
+    int build;
+    int state;
+    int place;
+    int digits;
+    int constant;
+    struct parser_frame *frames;
+    size_t nframes;
+    size_t aframes;
+    struct node **nodes;
+    size_t nnodes;
+    size_t anodes;
+};
+
+static void
+parser_init(struct parser *p, struct node_arena *arena, int build)
+{
+    memset(p, 0, sizeof(struct parser));
+    p->arena = arena;
+    p->build = build;
+    p->state = PARSER_NODE;
 }
 
-static struct node *unserialize(struct buf *buf, int *pos);
+static int parser_grow(void **data, size_t *asize, size_t need, size_t elem);
 
-static struct node *
-parse(struct buf *buf, int *pos)
+/*
+ *  Puts a child of a node being torn down on the node stack.
+ */
+static void
+parser_keep(struct parser *p, struct node *n)
 {
-    struct node *f;
-    f = unserialize(buf, pos);
-    while (skip(buf->data[*pos]))
-        ++(*pos);
-    return f;
+    if (!n)
+        return;
+    if (parser_grow((void **) &p->nodes, &p->anodes, p->nnodes + 1,
+                    sizeof(struct node *))) {
+        node_destroy(n);
+        return;
+    }
+    p->nodes[p->nnodes++] = n;
 }
 
-static struct node **
-parse_array(struct buf *buf, int *pos, int n)
+/*
+ *  Releases the parser, and the partly built trees still on its node stack.
+ *  These can be nested as deeply as the input, which would overflow the
+ *  recursion in node_destroy(), so the stack itself serves as the list of
+ *  nodes left to free.
+ */
+static void
+parser_free(struct parser *p)
 {
+    union node_d_ptr d_ptr;
+    struct node *n;
     int i;
-    struct node **g;
-    g = node_array_new(n);
-    for (i = 0; i < n - 1; ++i)
-        g[i] = parse(buf, pos);
-    g[n - 1] = NULL;
-    return g;
+
+    while (!p->arena && p->nnodes) {
+        if (!(n = p->nodes[--p->nnodes]))
+            continue;
+        switch (n->type)
+        {
+        case NODE_COMPOSITION:
+            d_ptr.comp = (struct node_composition *) n->data;
+            parser_keep(p, d_ptr.comp->f);
+            for (i = 0; i < d_ptr.comp->places; ++i)
+                parser_keep(p, d_ptr.comp->g[i]);
+            free(d_ptr.comp->g);
+            break;
+        case NODE_RECURSION:
+            d_ptr.rec = (struct node_recursion *) n->data;
+            parser_keep(p, d_ptr.rec->f);
+            parser_keep(p, d_ptr.rec->g);
+            break;
+        case NODE_SEARCH:
+            d_ptr.search = (struct node_search *) n->data;
+            parser_keep(p, d_ptr.search->p);
+            break;
+        case NODE_KERNEL:
+            d_ptr.kernel = (struct node_kernel *) n->data;
+            parser_keep(p, d_ptr.kernel->orig);
+            break;
+        default:
+            break;
+        } /* end switch */
+        free(n->data);
+        free(n);
+    }
+    free(p->nodes);
+    free(p->frames);
+    p->nodes = NULL;
+    p->frames = NULL;
+    p->nnodes = p->nframes = 0;
 }
 
-static struct node *
-unserialize(struct buf *buf, int *pos)
+static int
+parser_grow(void **data, size_t *asize, size_t need, size_t elem)
 {
-    static char str[20];
-    char x, *bufdata;
-    struct node *f;
-    int i, n;
-    assert(buf);
+    size_t n;
+    void *q;
 
-    x = buf->data[*pos];
-    ++(*pos);
-    switch (x)
+    if (need <= *asize)
+        return 0;
+    n = *asize ? *asize * 2 : 16;
+    if (!(q = realloc(*data, n * elem)))
+        return -1;
+    *data = q;
+    *asize = n;
+    return 0;
+}
+
+/*
+ *  Records a finished node, as the root or as the next child of the
+ *  innermost open bracket. Only a leaf can fail to fit: parser_close()
+ *  reuses the slot of the children it takes off the stack.
+ */
+static int
+parser_push(struct parser *p, struct node *n)
+{
+    if (parser_grow((void **) &p->nodes, &p->anodes, p->nnodes + 1,
+                    sizeof(struct node *))) {
+        if (!p->arena)
+            node_destroy(n);
+        return PARSER_ERROR;
+    }
+    p->nodes[p->nnodes++] = n;
+    return p->nframes ? PARSER_NEXT : PARSER_DONE;
+}
+
+/*
+ *  Closes the innermost bracket, whose children are the nodes above its
+ *  base, and replaces them with the node they make up.
+ */
+static int
+parser_close(struct parser *p)
+{
+    struct parser_frame *fr = &p->frames[--p->nframes];
+    struct node **c = &p->nodes[fr->base], *n = NULL, **g;
+    size_t i, legs = p->nnodes - fr->base - 1;
+
+    p->nnodes = fr->base;
+    if (!p->build)
+        return parser_push(p, NULL);
+
+    switch (fr->open)
     {
-    case '0':
-        return zero_node_new();
-    case '{':
-        n = 0;
-        while ('}' != buf->data[*pos]) {
-            str[n++] = buf->data[*pos];
-            ++(*pos);
-        }
-        str[n] = '\0';
-        return projection_node_new(atoi(str));
-    case '+':
-        return successor_node_new();
     case '[':
-        bufdata = &buf->data[*pos];
-        n = i = 0;
-        while (i >= 0) {
-            switch (*bufdata)
-            {
-            case '>':
-            case '}':
-            case ')':
-            case ']':
-                --i;
-                break;
-            case '<':
-            case '{':
-            case '(':
-            case '[':
-                ++i;
-                break;
-            case ',':
-                if (!i) ++n;
-            default:
-                break;
-            } /* end switch */
-            ++bufdata;
-        }
-        f = parse(buf, pos);
-        return composition_node_new(f, parse_array(buf, pos, n + 1));
+        g = node_arena_array_new(p->arena, legs + 1);
+        for (i = 0; i < legs; ++i)
+            g[i] = c[i + 1];
+        n = composition_node_arena_new(p->arena, c[0], g);
+        break;
     case '<':
-        f = parse(buf, pos);
-        return recursion_node_new(f, parse(buf, pos));
+        n = recursion_node_arena_new(p->arena, c[0], c[1]);
+        break;
     case '(':
-        return search_node_new(unserialize(buf, pos));
-    case 'X':
-    default:
+        n = search_node_arena_new(p->arena, c[0]);
         break;
-    }
-    return invalid_node_new();
+    } /* end switch */
+    return parser_push(p, n);
 }
 
-static ser_valid_t validate_segment(struct buf *buf, int *pos);
-
-static ser_valid_t
-validate_proj_segment(struct buf *buf, int *pos)
+/*
+ *  Feeds one byte to the parser and returns its new state.
+ */
+static int
+parser_step(struct parser *p, char c)
 {
-    if ('}' == buf->data[*pos])
-        return SERIAL_DATA_INVALID;     /* We need at least one digit */
-    while ('}' != buf->data[*pos]) {
-        switch (buf->data[*pos])
+    struct parser_frame *fr;
+    size_t children;
+
+    switch (p->state)
+    {
+    case PARSER_NODE:
+        switch (c)
         {
         case '0':
-        case '1':
-        case '2':
-        case '3':
-        case '4':
-        case '5':
-        case '6':
-        case '7':
-        case '8':
-        case '9':
-            break;
+            return p->state = parser_push(p, p->build ? zero_node_arena_new(p->arena) : NULL);
+        case '+':
+            return p->state = parser_push(p, p->build ? successor_node_arena_new(p->arena) : NULL);
+        case 'X':
+            return p->state = parser_push(p, p->build ? invalid_node_arena_new(p->arena) : NULL);
+        case '{':
+            p->place = p->digits = p->constant = 0;
+            return p->state = PARSER_PROJ;
+        case '#':
+            return p->state = PARSER_CONST;
+        case '[':
+        case '<':
+        case '(':
+            if (parser_grow((void **) &p->frames, &p->aframes, p->nframes + 1,
+                            sizeof(struct parser_frame)))
+                return p->state = PARSER_ERROR;
+            p->frames[p->nframes].open = c;
+            p->frames[p->nframes].base = p->nnodes;
+            ++p->nframes;
+            return p->state = PARSER_NODE;
         default:
-            return SERIAL_DATA_INVALID;
+            break;
+        } /* end switch */
+        break;
+    case PARSER_CONST:
+        if ('{' != c)
+            break;
+        p->place = p->digits = 0;
+        p->constant = 1;
+        return p->state = PARSER_PROJ;
+    case PARSER_PROJ:
+        if (c >= '0' && c <= '9') {
+            if (p->place > (INT_MAX - (c - '0')) / 10)
+                break;      /* The coordinate does not fit in an int */
+            p->place = 10 * p->place + (c - '0');
+            ++p->digits;
+            return p->state;
+        }
+        if ('}' != c || !p->digits)
+            break;          /* We need at least one digit */
+        if (!p->build)
+            return p->state = parser_push(p, NULL);
+        if (p->constant)
+            return p->state = parser_push(p, constant_node_arena_new(p->arena, p->place));
+        return p->state = parser_push(p, projection_node_arena_new(p->arena, p->place));
+    case PARSER_NEXT:
+        fr = &p->frames[p->nframes - 1];
+        children = p->nnodes - fr->base;
+        switch (fr->open)
+        {
+        case '[':
+            if (',' == c)
+                return p->state = PARSER_NODE;
+            if (']' == c && children > 1)       /* '[f]' is not valid */
+                return p->state = parser_close(p);
+            break;
+        case '<':
+            if (',' == c && 1 == children)
+                return p->state = PARSER_NODE;
+            if ('>' == c && 2 == children)
+                return p->state = parser_close(p);
+            break;
+        case '(':
+            if (')' == c)
+                return p->state = parser_close(p);
+            break;
         } /* end switch */
-        ++(*pos);
+        break;
+    default:
+        break;
+    } /* end switch */
+
+    return p->state = PARSER_ERROR;
+}
+
+/*
+ *  Runs the parser over the whole buffer, which has to hold exactly one
+ *  tree. Returns the offset of the first bad byte, or -1 if there is none.
+ */
+static long
+parser_run(struct parser *p, const struct buf *buf)
+{
+    size_t pos;
+
+    for (pos = 0; pos < buf->size; ++pos)
+        if (PARSER_DONE == p->state || PARSER_ERROR == parser_step(p, buf->data[pos]))
+            return (long) pos;
+    return PARSER_DONE == p->state ? -1 : (long) buf->size;
+}
+
+/*!
+ *  Parses the tree in \a buf, allocating it from \a arena, or from the heap
+ *  if \a arena is NULL. The buffer has to hold exactly one tree, in the
+ *  format described under node_serialize(), and is read in one pass that
+ *  checks it as the tree is built. On malformed input NULL is returned, and
+ *  if \a error is not NULL, it receives the offset of the first byte that
+ *  does not fit, which is the size of the buffer if the input ends early.
+ */
+struct node *
+node_parse(const struct buf *buf, struct node_arena *arena, size_t *error)
+{
+    struct parser p;
+    struct node *n = NULL;
+    long pos;
+
+    assert(buf);
+
+    parser_init(&p, arena, 1);
+    if ((pos = parser_run(&p, buf)) < 0) {
+        n = p.nodes[0];
+        p.nnodes = 0;
+    } else if (error) {
+        *error = (size_t) pos;
     }
-    ++(*pos);
-    return SERIAL_DATA_OK;
+    parser_free(&p);
+    return n;
 }
 
-static ser_valid_t
-validate_rec_segment(struct buf *buf, int *pos)
+/*!
+ *  Creates a node from the string stored in \a buf, according to the rules
+ *  described under node_serialize(). Returns NULL if the string is not a
+ *  well-formed tree, see node_parse().
+ */
+struct node *
+node_unserialize(struct buf *buf)
 {
-    assert(buf && pos);
-
-    if (validate_segment(buf, pos) < 0)
-        return SERIAL_DATA_INVALID;
-    if (',' != buf->data[*pos])
-        return SERIAL_DATA_INVALID;
-    ++(*pos);
-    if (validate_segment(buf, pos) < 0)
-        return SERIAL_DATA_INVALID;
-    if ('>' != buf->data[*pos])
-        return SERIAL_DATA_INVALID;
-    ++(*pos);
-    return SERIAL_DATA_OK;
+    return node_parse(buf, NULL, NULL);
 }
 
-static ser_valid_t
-validate_comp_segment(struct buf *buf, int *pos)
+/*!
+ *  Same as node_unserialize(), but allocates the whole tree from \a arena.
+ */
+struct node *
+node_unserialize_arena(struct buf *buf, struct node_arena *arena)
 {
-    int i;
-    assert(buf && pos);
-
-    if (']' == buf->data[*pos])
-        return SERIAL_DATA_INVALID;     /* '[]' is not valid */
-    i = 0;
-    while (1) {
-        if (validate_segment(buf, pos) < 0)
-            return SERIAL_DATA_INVALID;
-        switch (buf->data[*pos])
-        {
-        case ']':
-            ++(*pos);
-            return i > 0 ? SERIAL_DATA_OK : SERIAL_DATA_INVALID;
-        case ',':
-            ++i;
-            break;
-        default:
-            return SERIAL_DATA_INVALID;
-        } /* end switch */
-        ++(*pos);
+    return node_parse(buf, arena, NULL);
+}
+
+/*
+ * A stream runs the parser over input that arrives in pieces, and hands out
+ * each top-level tree as soon as its last byte is seen. Only the parser's
+ * stacks are kept between pieces, never the input, so memory follows the
+ * nesting depth of the tree being read rather than the length of the stream.
+ * Trees may be separated by whitespace.
+ */
+
+struct node_stream
+{
+    struct parser parser;
+    uint64_t offset;
+    int failed;
+};
+
+/*!
+ *  Creates a stream parser, which builds its trees on the heap.
+ */
+struct node_stream *
+node_stream_new()
+{
+    struct node_stream *s;
+
+    if ((s = malloc(sizeof(struct node_stream)))) {
+        parser_init(&s->parser, NULL, 1);
+        s->offset = 0;
+        s->failed = 0;
     }
+    return s;
 }
 
-static ser_valid_t
-validate_search_segment(struct buf *buf, int *pos)
+/*!
+ *  Destroys the stream, along with any tree it has only partly read.
+ */
+void
+node_stream_destroy(struct node_stream *s)
 {
-    assert(buf && pos);
-
-    if (validate_segment(buf, pos) < 0)
-        return SERIAL_DATA_INVALID;
-    if (')' != buf->data[*pos])
-        return SERIAL_DATA_INVALID;
-    ++(*pos);
-    return SERIAL_DATA_OK;
+    if (!s)
+        return;
+    parser_free(&s->parser);
+    free(s);
 }
 
-static ser_valid_t
-validate_segment(struct buf *buf, int *pos)
+static int
+between_trees(const struct node_stream *s)
 {
-    char x;
-    assert(buf && pos);
+    return PARSER_NODE == s->parser.state && !s->parser.nframes;
+}
 
-    x = buf->data[*pos];
-    ++(*pos);
-    switch (x)
-    {
-    case '0':
-    case '+':
-    case 'X':
-        return SERIAL_DATA_OK;
-    case '{':
-        return validate_proj_segment(buf, pos);
-    case '[':
-        return validate_comp_segment(buf, pos);
-    case '<':
-        return validate_rec_segment(buf, pos);
-    case '(':
-        return validate_search_segment(buf, pos);
-    default:
-        break;
-    } /* end switch */
-    return SERIAL_DATA_INVALID;
+/*!
+ *  Feeds the next \a len bytes of input to the stream. Every tree that is
+ *  completed by them is passed to \a emit, which takes ownership of it, and
+ *  may return non-zero to stop. A tree can span any number of calls.
+ *  Returns 0 once all of \a data is consumed, or -1 on malformed input or
+ *  if \a emit asked to stop, after which the stream accepts no more input.
+ */
+int
+node_stream_feed(struct node_stream *s, const char *data, size_t len,
+                 node_stream_fn emit, void *arg)
+{
+    struct node *n;
+    size_t i;
+
+    if (s->failed)
+        return -1;
+
+    for (i = 0; i < len; ++i) {
+        if (between_trees(s) && isspace((unsigned char) data[i])) {
+            ++s->offset;
+            continue;
+        }
+        if (PARSER_ERROR == parser_step(&s->parser, data[i])) {
+            s->failed = 1;
+            return -1;
+        }
+        ++s->offset;
+        if (PARSER_DONE == s->parser.state) {
+            n = s->parser.nodes[0];
+            s->parser.nnodes = 0;
+            s->parser.state = PARSER_NODE;
+            if (emit(n, arg)) {
+                s->failed = 1;
+                return -1;
+            }
+        }
+    }
+    return 0;
 }
 
 /*!
- *  Creates a node from the string stored in \a buf, according to the rules
- *  described under node_serialize().
+ *  Ends the input. Returns 0, or -1 if it stopped inside a tree or the
+ *  stream had already failed.
  */
-struct node *
-node_unserialize(struct buf *buf)
+int
+node_stream_finish(struct node_stream *s)
+{
+    return !s->failed && between_trees(s) ? 0 : -1;
+}
+
+/*!
+ *  Returns the number of bytes consumed. After malformed input, this is the
+ *  offset of the first bad byte in the stream as a whole.
+ */
+uint64_t
+node_stream_offset(const struct node_stream *s)
+{
+    return s->offset;
+}
+
+/*!
+ *  Feeds the stream from \a fd until end of file, in pieces of
+ *  NODE_STREAM_CHUNK bytes, and finishes it. Returns 0, or -1 on a read
+ *  error or as for node_stream_feed() and node_stream_finish().
+ */
+int
+node_stream_read(struct node_stream *s, int fd, node_stream_fn emit, void *arg)
+{
+    char chunk[NODE_STREAM_CHUNK];
+    ssize_t k;
+
+    while ((k = read(fd, chunk, sizeof(chunk)))) {
+        if (k < 0) {
+            if (EINTR == errno)
+                continue;
+            return -1;
+        }
+        if (node_stream_feed(s, chunk, (size_t) k, emit, arg) < 0)
+            return -1;
+    }
+    return node_stream_finish(s);
+}
+
+/*!
+ *  Writes the constant function with the given \a value, as #{N}, which is
+ *  read back as a constant kernel. A negative value stands for the undefined
+ *  constant and is written as an out of range projection, [{1},0].
+ */
+void
+node_serialize_constant(int value, struct buf *buf)
 {
-    int n;
-    n = 0;
-    return unserialize(buf, &n);
+    char str[20];
+
+    if (value < 0) {
+        buf_append_chars(buf, "[{1},0]");
+        return;
+    }
+    snprintf(str, sizeof(str), "#{%i}", value);
+    buf_append_chars(buf, str);
 }
 
 /*!
@@ -248,13 +512,17 @@ node_unserialize(struct buf *buf)
  *  RECURSION node    -> <?,?>      where ? is replaced with the node "legs"
  *  SEARCH node       -> (?)        where ? is replaced with the sub-node
  *  INVALID node      -> X          (just a single 'X' character)
+ *  constant KERNEL   -> #{N}       where N is the value, see below
+ *
+ *  The tree is only read, so several threads may serialize the same tree at
+ *  once, each into its own buffer.
  */
 void
-node_serialize(struct node *node, struct buf* buf)
+node_serialize(const struct node *node, struct buf* buf)
 {
     struct node **g;
     union node_d_ptr d_ptr;
-    static char str[20];
+    char str[20];
 
     assert(node && buf);
 
@@ -266,7 +534,7 @@ node_serialize(struct node *node, struct buf* buf)
     case NODE_PROJECTION:
         d_ptr.proj = (struct node_projection *) node->data;
         buf_append_chars(buf, "{");
-        snprintf(str, 20, "%i", d_ptr.proj->place);
+        snprintf(str, sizeof(str), "%i", d_ptr.proj->place);
         buf_append_chars(buf, str);
         buf_append_chars(buf, "}");
         break;
@@ -299,6 +567,19 @@ node_serialize(struct node *node, struct buf* buf)
         node_serialize(d_ptr.search->p, buf);
         buf_append_chars(buf, ")");
         break;
+    case NODE_KERNEL:
+        /*
+         *  Kernels are an evaluation shortcut; the tree they replace is what
+         *  gets written out. Constants have none.
+         */
+        d_ptr.kernel = (struct node_kernel *) node->data;
+        if (d_ptr.kernel->orig) {
+            node_serialize(d_ptr.kernel->orig, buf);
+            break;
+        }
+        assert(KERNEL_VALUE == d_ptr.kernel->op && d_ptr.kernel->a.place < 0);
+        node_serialize_constant(d_ptr.kernel->a.offset, buf);
+        break;
     case NODE_INVALID:
     default:
         buf_append_chars(buf, "X");
@@ -306,10 +587,19 @@ node_serialize(struct node *node, struct buf* buf)
     }
 }
 
+/*!
+ *  Checks that \a buf holds exactly one well-formed tree, in the same pass
+ *  as node_parse() but without building it.
+ */
 ser_valid_t
 node_serial_data_is_valid(struct buf *buf)
 {
-    int n = 0;
-    return validate_segment(buf, &n);
+    struct parser p;
+    long pos;
+
+    parser_init(&p, NULL, 0);
+    pos = parser_run(&p, buf);
+    parser_free(&p);
+    return pos < 0 ? SERIAL_DATA_OK : SERIAL_DATA_INVALID;
 }
 
@@ -14,10 +14,30 @@ typedef enum {
     SERIAL_DATA_INVALID = -1
 } ser_valid_t;
 
+#define NODE_STREAM_CHUNK (64 * 1024)
+
+/*
+ *  Receives each tree completed by a stream, see node_stream_feed().
+ */
+typedef int (*node_stream_fn)(struct node *n, void *arg);
+
+struct node_stream;
+
+struct node *node_parse(const struct buf *buf, struct node_arena *arena, size_t *error);
 struct node *node_unserialize(struct buf *buf);
-void node_serialize(struct node *node, struct buf* buf);
+struct node *node_unserialize_arena(struct buf *buf, struct node_arena *arena);
+void node_serialize(const struct node *node, struct buf* buf);
+void node_serialize_constant(int value, struct buf *buf);
 ser_valid_t node_serial_data_is_valid(struct buf *buf);
 
+struct node_stream *node_stream_new();
+void node_stream_destroy(struct node_stream *s);
+int node_stream_feed(struct node_stream *s, const char *data, size_t len,
+                     node_stream_fn emit, void *arg);
+int node_stream_finish(struct node_stream *s);
+uint64_t node_stream_offset(const struct node_stream *s);
+int node_stream_read(struct node_stream *s, int fd, node_stream_fn emit, void *arg);
+
 #ifdef __cplusplus
 }
 #endif
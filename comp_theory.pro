@@ -1,18 +1,60 @@
 TEMPLATE = app
 CONFIG += console
 CONFIG -= qt
+CONFIG += c++17
+
+QMAKE_CFLAGS += -pthread
+LIBS += -pthread
+
+# qmake CONFIG+=tsan builds with ThreadSanitizer, to check the concurrent
+# evaluation tests.
+tsan {
+    QMAKE_CFLAGS += -fsanitize=thread -g
+    QMAKE_CXXFLAGS += -fsanitize=thread -g
+    QMAKE_LFLAGS += -fsanitize=thread
+}
 
 SOURCES += main.c \
     comp.c \
     tmachine.c \
     lcalc.c \
     buf.c \
-    comp_serialize.c
+    comp_serialize.c \
+    comp_program.c \
+    comp_memo.c \
+    comp_hashcons.c \
+    comp_opt.c \
+    comp_batch.c \
+    comp_parallel.c \
+    comp_value.c \
+    comp_eval.c \
+    comp_jit.c \
+    comp_flat.c \
+    comp_range.c \
+    comp_lazy.c \
+    comp_incr.c \
+    comp_binary.c \
+    comp_hpp_test.cpp
 
 HEADERS += \
     comp.h \
     tmachine.h \
     lcalc.h \
     buf.h \
-    comp_serialize.h
+    comp_serialize.h \
+    comp_program.h \
+    comp_memo.h \
+    comp_hashcons.h \
+    comp_opt.h \
+    comp_batch.h \
+    comp_parallel.h \
+    comp_value.h \
+    comp_eval.h \
+    comp_jit.h \
+    comp_flat.h \
+    comp_range.h \
+    comp_lazy.h \
+    comp_incr.h \
+    comp_binary.h \
+    comp.hpp
 
@@ -0,0 +1,783 @@
+#include <malloc.h>
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include "comp_value.h"
+
+/*
+ * Two evaluators for values that do not fit in an int.
+ *
+ * node_compute64() is node_compute() on int64_t. Every operation that could
+ * overflow is checked, and a result that does not fit is undefined (-1).
+ *
+ * node_compute_value() works on struct node_value, which holds a natural
+ * number of any size. Values up to INT64_MAX are kept in the machine word
+ * and computed on directly; the digits array is only allocated when an
+ * overflow check fires, and a result that fits in a word again is moved back
+ * into it. A value is undefined if it is a negative word. Recursion and
+ * search count in machine words, so a bound beyond INT64_MAX is undefined:
+ * no evaluation could count that far.
+ */
+
+static int
+operand64(const struct node_operand *o, const int64_t *x, int64_t *y)
+{
+    if (o->place < 0) {
+        *y = o->offset;
+        return 0;
+    }
+    if (x[o->place] < 0)
+        return -1;
+    return __builtin_add_overflow(x[o->place], (int64_t) o->offset, y);
+}
+
+/*
+ *  As node_kernel_applies(), for 64-bit arguments.
+ */
+static int
+applies64(const struct node_kernel *kernel, const int64_t *x, size_t args)
+{
+    if (kernel->arity >= 0 && kernel->arity != (int) args)
+        return 0;
+    if (kernel->a.place >= 0 && kernel->a.place < (int) args
+            && x[kernel->a.place] < 0)
+        return 0;
+    if (kernel->b.place >= 0 && kernel->b.place < (int) args
+            && x[kernel->b.place] < 0)
+        return 0;
+    return 1;
+}
+
+static int64_t
+kernel64(const struct node_kernel *kernel, const int64_t *x, size_t args)
+{
+    int64_t a, b, y;
+
+    if ((int) args < kernel->need || (args && *x < 0))
+        return -1;
+    if (operand64(&kernel->a, x, &a) || operand64(&kernel->b, x, &b))
+        return -1;
+
+    switch (kernel->op)
+    {
+    case KERNEL_VALUE:
+        return a;
+    case KERNEL_ADD:
+        return __builtin_add_overflow(a, b, &y) ? -1 : y;
+    case KERNEL_MULT:
+        return __builtin_mul_overflow(a, b, &y) ? -1 : y;
+    case KERNEL_EXP:
+        if (!b)
+            return 1;
+        if (a < 2)
+            return a;
+        y = 1;
+        while (b) {
+            if ((b & 1) && __builtin_mul_overflow(y, a, &y))
+                return -1;
+            if ((b >>= 1) && __builtin_mul_overflow(a, a, &a))
+                return -1;
+        }
+        return y;
+    case KERNEL_PRED:
+        return a ? a - 1 : 0;
+    case KERNEL_MONUS:
+        return a > b ? a - b : 0;
+    case KERNEL_ISZERO:
+        return !a;
+    case KERNEL_FACT:
+        y = 1;
+        while (a > 1)
+            if (__builtin_mul_overflow(y, a--, &y))
+                return -1;
+        return y;
+    default:
+        break;
+    } /* end switch */
+
+    assert(0);
+    return -1;
+}
+
+/*!
+ *  Computes the function \a n on the 64-bit arguments \a x, like
+ *  node_compute(). Results that do not fit in an int64_t are undefined.
+ */
+int64_t
+node_compute64(const struct node *n, const int64_t *x, size_t args)
+{
+    union node_d_ptr d_ptr;
+    struct node **curr;
+    int64_t i, j, k, lim;
+
+    if (args && *x < 0)
+        return -1;
+
+    switch (n->type)
+    {
+    case NODE_ZERO:
+    case NODE_INVALID:
+        return 0;
+    case NODE_PROJECTION:
+        d_ptr.proj = (struct node_projection *) n->data;
+        j = d_ptr.proj->place;
+        return j < (int64_t) args ? x[j] : -1;
+    case NODE_SUCCESSOR:
+        return (!args || INT64_MAX == *x) ? -1 : (*x) + 1;
+    case NODE_COMPOSITION:
+    {
+        d_ptr.comp = (struct node_composition *) n->data;
+        curr = d_ptr.comp->g;
+        int64_t y[d_ptr.comp->places + 1];
+        j = 0;
+        while (j < d_ptr.comp->places) {
+            i = node_compute64(*curr, x, args);
+            if (i < 0)
+                return -1;
+            y[j++] = i;
+            ++curr;
+        }
+        return node_compute64(d_ptr.comp->f, y, j);
+    }
+    case NODE_RECURSION:
+    {
+        if (!args)
+            return -1;
+        d_ptr.rec = (struct node_recursion *) n->data;
+        lim = x[args - 1];
+        i = node_compute64(d_ptr.rec->f, x, args - 1);
+        if (i < 0)
+            return -1;
+        int64_t nx[args + 1];
+        memcpy(&nx[1], x, (args - 1) * sizeof(int64_t));
+        for (k = 0; k < lim; ++k) {
+            nx[0] = i;
+            nx[args] = k;
+            i = node_compute64(d_ptr.rec->g, nx, args + 1);
+            if (i < 0)
+                return -1;
+        }
+        return i;
+    }
+    case NODE_SEARCH:
+    {
+        if (!args)
+            return -1;
+        d_ptr.search = (struct node_search *) n->data;
+        int64_t nx[args];
+        memcpy(nx, x, args * sizeof(int64_t));
+        lim = x[args - 1];
+        for (i = 0; i < lim; ++i) {
+            nx[args - 1] = i;
+            j = node_compute64(d_ptr.search->p, nx, args);
+            if (j < 0)
+                return -1;
+            else if (1 == j)
+                return i;
+        }
+        return lim;
+    }
+    case NODE_KERNEL:
+        d_ptr.kernel = (struct node_kernel *) n->data;
+        if (!applies64(d_ptr.kernel, x, args))
+            return node_compute64(d_ptr.kernel->orig, x, args);
+        return kernel64(d_ptr.kernel, x, args);
+    } /* end switch */
+
+    /*
+     * We should never reach here!
+     */
+    assert(0);
+    return -1;
+}
+
+/*!
+ *  \struct node_value
+ *
+ *  \brief A natural number of any size, or undefined.
+ *
+ *  If digits is NULL the value is word, and undefined if word is negative.
+ *  Otherwise it is the number with the size little-endian base 2^32 digits
+ *  in digits, and greater than INT64_MAX.
+ */
+
+/*!
+ *  Initializes \a v to \a word. A negative word makes the value undefined.
+ */
+void
+node_value_init(struct node_value *v, int64_t word)
+{
+    v->word = word < 0 ? -1 : word;
+    v->digits = NULL;
+    v->size = 0;
+}
+
+/*!
+ *  Releases the digits of \a v, if any, and leaves it undefined.
+ */
+void
+node_value_clear(struct node_value *v)
+{
+    free(v->digits);
+    node_value_init(v, -1);
+}
+
+static void
+value_set_word(struct node_value *v, int64_t word)
+{
+    if (v->digits)
+        node_value_clear(v);
+    v->word = word < 0 ? -1 : word;
+}
+
+/*!
+ *  Sets \a dst to a copy of \a src.
+ */
+valueerror_t
+node_value_copy(struct node_value *dst, const struct node_value *src)
+{
+    uint32_t *d;
+
+    if (dst == src)
+        return VALUE_OK;
+    if (!src->digits) {
+        value_set_word(dst, src->word);
+        return VALUE_OK;
+    }
+    d = malloc(src->size * sizeof(uint32_t));
+    if (!d)
+        return VALUE_ENOMEM;
+    memcpy(d, src->digits, src->size * sizeof(uint32_t));
+    node_value_clear(dst);
+    dst->digits = d;
+    dst->size = src->size;
+    dst->word = 0;
+    return VALUE_OK;
+}
+
+/*!
+ *  Returns 1 if \a v is defined, 0 otherwise.
+ */
+int
+node_value_defined(const struct node_value *v)
+{
+    return v->digits || v->word >= 0;
+}
+
+/*
+ *  Makes *d point to the digits of v and returns how many there are, using
+ *  tmp for a value held in the word.
+ */
+static size_t
+value_digits(const struct node_value *v, uint32_t tmp[2], const uint32_t **d)
+{
+    if (v->digits) {
+        *d = v->digits;
+        return v->size;
+    }
+    tmp[0] = (uint32_t) v->word;
+    tmp[1] = (uint32_t) ((uint64_t) v->word >> 32);
+    *d = tmp;
+    return tmp[1] ? 2 : (tmp[0] ? 1 : 0);
+}
+
+/*
+ *  Stores the n digits in d as the value of r, which takes them over. The
+ *  result is moved into the word if it fits.
+ */
+static void
+value_take(struct node_value *r, uint32_t *d, size_t n)
+{
+    while (n && !d[n - 1])
+        --n;
+    if (n < 2 || (n == 2 && !(d[1] & 0x80000000u))) {
+        value_set_word(r, n ? ((int64_t) (n == 2 ? d[1] : 0) << 32) | d[0] : 0);
+        free(d);
+        return;
+    }
+    node_value_clear(r);
+    r->word = 0;
+    r->digits = d;
+    r->size = n;
+}
+
+static int
+big_compare(const uint32_t *a, size_t na, const uint32_t *b, size_t nb)
+{
+    if (na != nb)
+        return na < nb ? -1 : 1;
+    while (na--)
+        if (a[na] != b[na])
+            return a[na] < b[na] ? -1 : 1;
+    return 0;
+}
+
+/*!
+ *  Compares two defined values, returning a negative number, zero or a
+ *  positive number if \a a is less than, equal to or greater than \a b.
+ */
+int
+node_value_compare(const struct node_value *a, const struct node_value *b)
+{
+    const uint32_t *da, *db;
+    uint32_t ta[2], tb[2];
+    size_t na, nb;
+
+    if (!a->digits && !b->digits)
+        return a->word < b->word ? -1 : (a->word > b->word);
+    na = value_digits(a, ta, &da);
+    nb = value_digits(b, tb, &db);
+    return big_compare(da, na, db, nb);
+}
+
+static uint32_t *
+big_alloc(size_t n)
+{
+    if (n > NODE_VALUE_MAX_DIGITS)
+        return NULL;
+    return calloc(n ? n : 1, sizeof(uint32_t));
+}
+
+static valueerror_t
+value_add(struct node_value *r, const struct node_value *a, const struct node_value *b)
+{
+    const uint32_t *da, *db;
+    uint32_t ta[2], tb[2], *d;
+    size_t na, nb, n, i;
+    uint64_t carry;
+    int64_t w;
+
+    if (!a->digits && !b->digits && !__builtin_add_overflow(a->word, b->word, &w)) {
+        value_set_word(r, w);
+        return VALUE_OK;
+    }
+    na = value_digits(a, ta, &da);
+    nb = value_digits(b, tb, &db);
+    n = (na > nb ? na : nb) + 1;
+    if (!(d = big_alloc(n)))
+        return VALUE_ENOMEM;
+    carry = 0;
+    for (i = 0; i < n; ++i) {
+        carry += (i < na ? da[i] : 0);
+        carry += (i < nb ? db[i] : 0);
+        d[i] = (uint32_t) carry;
+        carry >>= 32;
+    }
+    value_take(r, d, n);
+    return VALUE_OK;
+}
+
+/*
+ *  r = a - b if a > b, and 0 otherwise.
+ */
+static valueerror_t
+value_monus(struct node_value *r, const struct node_value *a, const struct node_value *b)
+{
+    const uint32_t *da, *db;
+    uint32_t ta[2], tb[2], *d;
+    size_t na, nb, i;
+    int64_t borrow;
+
+    if (node_value_compare(a, b) <= 0) {
+        value_set_word(r, 0);
+        return VALUE_OK;
+    }
+    if (!a->digits) {
+        value_set_word(r, a->word - b->word);
+        return VALUE_OK;
+    }
+    na = value_digits(a, ta, &da);
+    nb = value_digits(b, tb, &db);
+    if (!(d = big_alloc(na)))
+        return VALUE_ENOMEM;
+    borrow = 0;
+    for (i = 0; i < na; ++i) {
+        borrow += (int64_t) da[i] - (i < nb ? db[i] : 0);
+        d[i] = (uint32_t) borrow;
+        borrow = borrow < 0 ? -1 : 0;
+    }
+    value_take(r, d, na);
+    return VALUE_OK;
+}
+
+static valueerror_t
+value_mult(struct node_value *r, const struct node_value *a, const struct node_value *b)
+{
+    const uint32_t *da, *db;
+    uint32_t ta[2], tb[2], *d;
+    size_t na, nb, i, j;
+    uint64_t carry;
+    int64_t w;
+
+    if (!a->digits && !b->digits && !__builtin_mul_overflow(a->word, b->word, &w)) {
+        value_set_word(r, w);
+        return VALUE_OK;
+    }
+    na = value_digits(a, ta, &da);
+    nb = value_digits(b, tb, &db);
+    if (!na || !nb) {
+        value_set_word(r, 0);
+        return VALUE_OK;
+    }
+    if (!(d = big_alloc(na + nb)))
+        return VALUE_ENOMEM;
+    for (i = 0; i < na; ++i) {
+        carry = 0;
+        for (j = 0; j < nb; ++j) {
+            carry += (uint64_t) da[i] * db[j] + d[i + j];
+            d[i + j] = (uint32_t) carry;
+            carry >>= 32;
+        }
+        d[i + nb] = (uint32_t) carry;
+    }
+    value_take(r, d, na + nb);
+    return VALUE_OK;
+}
+
+static valueerror_t
+value_exp(struct node_value *r, const struct node_value *a, const struct node_value *b)
+{
+    struct node_value base, y;
+    valueerror_t err;
+    int64_t e;
+
+    if (!b->digits && !b->word) {
+        value_set_word(r, 1);
+        return VALUE_OK;
+    }
+    if (!a->digits && a->word < 2)
+        return node_value_copy(r, a);
+    if (b->digits)
+        return VALUE_ENOMEM;
+
+    node_value_init(&base, 0);
+    node_value_init(&y, 1);
+    err = node_value_copy(&base, a);
+    for (e = b->word; !err && e; e >>= 1) {
+        if (e & 1)
+            err = value_mult(&y, &y, &base);
+        if (!err && e > 1)
+            err = value_mult(&base, &base, &base);
+    }
+    if (!err) {
+        node_value_clear(r);
+        *r = y;
+    } else {
+        node_value_clear(&y);
+    }
+    node_value_clear(&base);
+    return err;
+}
+
+static valueerror_t
+value_fact(struct node_value *r, const struct node_value *a)
+{
+    struct node_value y, k;
+    valueerror_t err;
+    int64_t i;
+
+    if (a->digits)
+        return VALUE_ENOMEM;
+
+    node_value_init(&y, 1);
+    err = VALUE_OK;
+    for (i = 2; !err && i <= a->word; ++i) {
+        node_value_init(&k, i);
+        err = value_mult(&y, &y, &k);
+    }
+    if (!err) {
+        node_value_clear(r);
+        *r = y;
+    } else {
+        node_value_clear(&y);
+    }
+    return err;
+}
+
+static valueerror_t
+value_operand(const struct node_operand *o, const struct node_value *x,
+              struct node_value *y)
+{
+    struct node_value offset;
+
+    node_value_init(&offset, o->offset);
+    if (o->place < 0)
+        return node_value_copy(y, &offset);
+    if (!node_value_defined(&x[o->place])) {
+        value_set_word(y, -1);
+        return VALUE_OK;
+    }
+    return value_add(y, &x[o->place], &offset);
+}
+
+/*
+ *  As node_kernel_applies(), with undefined arguments in place of negative
+ *  ones.
+ */
+static int
+value_applies(const struct node_kernel *kernel, const struct node_value *x,
+              size_t args)
+{
+    if (kernel->arity >= 0 && kernel->arity != (int) args)
+        return 0;
+    if (kernel->a.place >= 0 && kernel->a.place < (int) args
+            && !node_value_defined(&x[kernel->a.place]))
+        return 0;
+    if (kernel->b.place >= 0 && kernel->b.place < (int) args
+            && !node_value_defined(&x[kernel->b.place]))
+        return 0;
+    return 1;
+}
+
+static valueerror_t
+value_kernel(const struct node_kernel *kernel, const struct node_value *x,
+             size_t args, struct node_value *y)
+{
+    struct node_value a, b, one;
+    valueerror_t err;
+
+    if ((int) args < kernel->need || (args && !node_value_defined(x))) {
+        value_set_word(y, -1);
+        return VALUE_OK;
+    }
+
+    node_value_init(&a, 0);
+    node_value_init(&b, 0);
+    if ((err = value_operand(&kernel->a, x, &a))
+            || (err = value_operand(&kernel->b, x, &b)))
+        goto done;
+    if (!node_value_defined(&a) || !node_value_defined(&b)) {
+        value_set_word(y, -1);
+        goto done;
+    }
+
+    switch (kernel->op)
+    {
+    case KERNEL_VALUE:
+        err = node_value_copy(y, &a);
+        break;
+    case KERNEL_ADD:
+        err = value_add(y, &a, &b);
+        break;
+    case KERNEL_MULT:
+        err = value_mult(y, &a, &b);
+        break;
+    case KERNEL_EXP:
+        err = value_exp(y, &a, &b);
+        break;
+    case KERNEL_PRED:
+        node_value_init(&one, 1);
+        err = value_monus(y, &a, &one);
+        break;
+    case KERNEL_MONUS:
+        err = value_monus(y, &a, &b);
+        break;
+    case KERNEL_ISZERO:
+        value_set_word(y, !a.digits && !a.word);
+        break;
+    case KERNEL_FACT:
+        err = value_fact(y, &a);
+        break;
+    default:
+        assert(0);
+        break;
+    } /* end switch */
+
+done:
+    node_value_clear(&a);
+    node_value_clear(&b);
+    return err;
+}
+
+static valueerror_t
+compute(const struct node *n, const struct node_value *x, size_t args,
+        struct node_value *y)
+{
+    union node_d_ptr d_ptr;
+    struct node_value one, t;
+    valueerror_t err;
+    int64_t i, lim;
+    int j;
+
+    if (args && !node_value_defined(x)) {
+        value_set_word(y, -1);
+        return VALUE_OK;
+    }
+
+    switch (n->type)
+    {
+    case NODE_ZERO:
+    case NODE_INVALID:
+        value_set_word(y, 0);
+        return VALUE_OK;
+    case NODE_PROJECTION:
+        d_ptr.proj = (struct node_projection *) n->data;
+        j = d_ptr.proj->place;
+        if (j >= (int) args) {
+            value_set_word(y, -1);
+            return VALUE_OK;
+        }
+        return node_value_copy(y, &x[j]);
+    case NODE_SUCCESSOR:
+        if (!args) {
+            value_set_word(y, -1);
+            return VALUE_OK;
+        }
+        node_value_init(&one, 1);
+        return value_add(y, x, &one);
+    case NODE_COMPOSITION:
+    {
+        d_ptr.comp = (struct node_composition *) n->data;
+        struct node_value ys[d_ptr.comp->places + 1];
+        for (j = 0; j < d_ptr.comp->places; ++j)
+            node_value_init(&ys[j], 0);
+        err = VALUE_OK;
+        for (j = 0; j < d_ptr.comp->places; ++j) {
+            if ((err = compute(d_ptr.comp->g[j], x, args, &ys[j])))
+                break;
+            if (!node_value_defined(&ys[j])) {
+                value_set_word(y, -1);
+                break;
+            }
+        }
+        if (!err && j == d_ptr.comp->places)
+            err = compute(d_ptr.comp->f, ys, j, y);
+        for (j = 0; j < d_ptr.comp->places; ++j)
+            node_value_clear(&ys[j]);
+        return err;
+    }
+    case NODE_RECURSION:
+    {
+        if (!args || x[args - 1].digits) {
+            value_set_word(y, -1);
+            return VALUE_OK;
+        }
+        d_ptr.rec = (struct node_recursion *) n->data;
+        lim = x[args - 1].word;
+        if ((err = compute(d_ptr.rec->f, x, args - 1, y)))
+            return err;
+        /*
+         *  The arguments x are shared with the caller, only the previous value
+         *  in nx[0] is owned here.
+         */
+        struct node_value nx[args + 1];
+        memcpy(&nx[1], x, (args - 1) * sizeof(struct node_value));
+        for (i = 0; i < lim && node_value_defined(y); ++i) {
+            nx[0] = *y;
+            node_value_init(&nx[args], i);
+            node_value_init(&t, 0);
+            err = compute(d_ptr.rec->g, nx, args + 1, &t);
+            node_value_clear(y);
+            *y = t;
+            if (err)
+                return err;
+        }
+        return VALUE_OK;
+    }
+    case NODE_SEARCH:
+    {
+        if (!args || x[args - 1].digits) {
+            value_set_word(y, -1);
+            return VALUE_OK;
+        }
+        d_ptr.search = (struct node_search *) n->data;
+        struct node_value nx[args];
+        memcpy(nx, x, args * sizeof(struct node_value));
+        lim = x[args - 1].word;
+        node_value_init(&t, 0);
+        for (i = 0; i < lim; ++i) {
+            node_value_init(&nx[args - 1], i);
+            if ((err = compute(d_ptr.search->p, nx, args, &t))) {
+                node_value_clear(&t);
+                return err;
+            }
+            if (!node_value_defined(&t) || (!t.digits && 1 == t.word))
+                break;
+        }
+        value_set_word(y, !node_value_defined(&t) ? -1 : (i < lim ? i : lim));
+        node_value_clear(&t);
+        return VALUE_OK;
+    }
+    case NODE_KERNEL:
+        d_ptr.kernel = (struct node_kernel *) n->data;
+        if (!value_applies(d_ptr.kernel, x, args))
+            return compute(d_ptr.kernel->orig, x, args, y);
+        return value_kernel(d_ptr.kernel, x, args, y);
+    } /* end switch */
+
+    /*
+     * We should never reach here!
+     */
+    assert(0);
+    return VALUE_ENOMEM;
+}
+
+/*!
+ *  Computes the function \a n on the arguments \a x and stores the result in
+ *  \a y, which must have been initialized with node_value_init(). Results are
+ *  exact; y is only undefined where node_compute() would be undefined for a
+ *  reason other than overflow. Returns VALUE_ENOMEM, and leaves y in an
+ *  unspecified but valid state, if memory runs out or a value would need more
+ *  than NODE_VALUE_MAX_DIGITS digits.
+ */
+valueerror_t
+node_compute_value(const struct node *n, const struct node_value *x,
+                   size_t args, struct node_value *y)
+{
+    assert(n && y);
+    return compute(n, x, args, y);
+}
+
+/*!
+ *  Appends the decimal representation of \a v to \a b, or "-1" if \a v is
+ *  undefined.
+ */
+valueerror_t
+node_value_print(const struct node_value *v, struct buf *b)
+{
+    uint32_t *d, *chunks;
+    uint64_t rem;
+    size_t n, m, i;
+    char s[24];
+
+    if (!v->digits) {
+        snprintf(s, sizeof(s), "%" PRId64, v->word);
+        buf_append_chars(b, s);
+        return VALUE_OK;
+    }
+
+    /*
+     *  Repeatedly divide by 10^9 to get the decimal digits in groups of nine,
+     *  least significant group first.
+     */
+    n = v->size;
+    d = malloc(n * sizeof(uint32_t));
+    chunks = malloc((n * 32 / 29 + 2) * sizeof(uint32_t));
+    if (!d || !chunks) {
+        free(d);
+        free(chunks);
+        return VALUE_ENOMEM;
+    }
+    memcpy(d, v->digits, n * sizeof(uint32_t));
+    m = 0;
+    do {
+        rem = 0;
+        for (i = n; i--; ) {
+            rem = (rem << 32) | d[i];
+            d[i] = (uint32_t) (rem / 1000000000u);
+            rem %= 1000000000u;
+        }
+        chunks[m++] = (uint32_t) rem;
+        while (n && !d[n - 1])
+            --n;
+    } while (n);
+    snprintf(s, sizeof(s), "%" PRIu32, chunks[--m]);
+    buf_append_chars(b, s);
+    while (m--) {
+        snprintf(s, sizeof(s), "%09" PRIu32, chunks[m]);
+        buf_append_chars(b, s);
+    }
+    free(d);
+    free(chunks);
+    return VALUE_OK;
+}
@@ -0,0 +1,45 @@
+#ifndef COMP_VALUE_H
+#define COMP_VALUE_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include "comp.h"
+#include "buf.h"
+
+/*
+ *  Upper limit on the number of 32-bit digits of a value, to keep a single
+ *  exponentiation or factorial from exhausting memory.
+ */
+#define NODE_VALUE_MAX_DIGITS (1024 * 1024)
+
+typedef enum {
+    VALUE_OK = 0,
+    VALUE_ENOMEM = -1
+} valueerror_t;
+
+struct node_value
+{
+    int64_t word;
+    uint32_t *digits;
+    size_t size;
+};
+
+int64_t node_compute64(const struct node *n, const int64_t *x, size_t args);
+
+void node_value_init(struct node_value *v, int64_t word);
+void node_value_clear(struct node_value *v);
+valueerror_t node_value_copy(struct node_value *dst, const struct node_value *src);
+int node_value_defined(const struct node_value *v);
+int node_value_compare(const struct node_value *a, const struct node_value *b);
+valueerror_t node_value_print(const struct node_value *v, struct buf *b);
+
+valueerror_t node_compute_value(const struct node *n, const struct node_value *x, size_t args, struct node_value *y);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* COMP_VALUE_H */
@@ -1,11 +1,105 @@
 #include <stdio.h>
 #include <malloc.h>
 #include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdlib.h>
 #include "comp.h"
 #include "tmachine.h"
 #include "lcalc.h"
 #include "buf.h"
 #include "comp_serialize.h"
+#include "comp_program.h"
+#include "comp_memo.h"
+#include "comp_hashcons.h"
+#include "comp_opt.h"
+#include "comp_batch.h"
+#include "comp_parallel.h"
+#include "comp_value.h"
+#include "comp_eval.h"
+#include "comp_jit.h"
+#include "comp_flat.h"
+#include "comp_range.h"
+#include "comp_lazy.h"
+#include "comp_incr.h"
+#include "comp_binary.h"
+
+void comp_hpp_test(void);   /* comp_hpp_test.cpp */
+
+/*
+ *  A set of trees loaded once and evaluated by several threads.
+ */
+struct shared_library
+{
+    struct node **fns;
+    struct buf **texts;
+    const int *expected;
+    size_t count;
+    int width;
+};
+
+/*
+ *  Evaluates every function of the library on every pair of arguments below
+ *  width, and serializes it, returning the number of results that differ
+ *  from the expected ones.
+ */
+static void *
+shared_library_worker(void *arg)
+{
+    const struct shared_library *lib = arg;
+    struct node_eval_ctx *ctx;
+    struct buf *b;
+    size_t f, mismatches = 0;
+    int x[2], e;
+
+    ctx = node_eval_ctx_new(NODE_FUEL_UNLIMITED, NODE_PROFILE_VISITS);
+    for (f = 0; f < lib->count; ++f) {
+        for (x[0] = 0; x[0] < lib->width; ++x[0]) {
+            for (x[1] = 0; x[1] < lib->width; ++x[1]) {
+                e = lib->expected[(f * lib->width + x[0]) * lib->width + x[1]];
+                mismatches += e != node_compute(lib->fns[f], x, 2);
+                mismatches += e != node_compute_checked(lib->fns[f], x, 2);
+                mismatches += e != node_compute_ctx(lib->fns[f], x, 2, ctx);
+            }
+        }
+        b = buf_new(64);
+        node_serialize(lib->fns[f], b);
+        mismatches += !buf_compare(b, lib->texts[f]);
+        buf_destroy(b);
+    }
+    node_eval_ctx_destroy(ctx);
+    return (void *) mismatches;
+}
+
+/*
+ *  Collects the trees read from a stream, serialized and each followed by
+ *  a ';'.
+ */
+static int
+stream_collect(struct node *n, void *arg)
+{
+    node_serialize(n, (struct buf *) arg);
+    buf_append_chars((struct buf *) arg, ";");
+    node_destroy(n);
+    return 0;
+}
+
+/*
+ *  Writes the buffer to a pipe and closes it.
+ */
+static void *
+stream_writer(void *arg)
+{
+    const struct buf *b = ((void **) arg)[0];
+    int fd = *(int *) ((void **) arg)[1];
+    size_t k = 0;
+    ssize_t w;
+
+    while (k < b->size && (w = write(fd, b->data + k, b->size - k)) > 0)
+        k += (size_t) w;
+    close(fd);
+    return NULL;
+}
 
 static void
 comp_test()
@@ -31,7 +125,16 @@ comp_test()
         printf("y = %i\n", y);
         assert(y == 17);
 
-        //
+        /*
+         *  The argument vector is left untouched, and large recursion bounds
+         *  run in constant stack space.
+         */
+        assert(x[0] == 5 && x[1] == 12);
+
+        const int z[2] = {5, 500000};
+        y = node_compute(f, z, 2);
+        printf("y = %i\n", y);
+        assert(y == 500005);
 
         node_destroy(f);
     }
@@ -253,6 +356,1640 @@ comp_test()
         node_destroy(monus);
     }
 
+    {
+        /*
+         *  Compiled programs agree with the tree interpreter:
+         *
+         *  f(x, y) = x ^ y
+         *  s(x, y) = min(x, y)    (search for the least i with x - i = 0)
+         */
+
+        struct node *one, *add, *mult, *exp, *pred, *monus, *iszero, *s;
+        struct node **g, **h, **j, **k, **l, **m, **p;
+        struct node_program *prog;
+        int x[2], y;
+
+        g = node_array_new(2);
+        g[0] = projection_node_new(0);
+        g[1] = NULL;
+
+        add = recursion_node_new(projection_node_new(0),
+                                 composition_node_new(successor_node_new(), g));
+
+        h = node_array_new(3);
+        h[0] = projection_node_new(0);
+        h[1] = projection_node_new(1);
+        h[2] = NULL;
+
+        mult = recursion_node_new(zero_node_new(), composition_node_new(add, h));
+
+        j = node_array_new(2);
+        j[0] = zero_node_new();
+        j[1] = NULL;
+
+        one = composition_node_new(successor_node_new(), j);
+
+        k = node_array_new(3);
+        k[0] = projection_node_new(0);
+        k[1] = projection_node_new(1);
+        k[2] = NULL;
+
+        exp = recursion_node_new(one, composition_node_new(mult, k));
+
+        prog = node_program_compile(exp);
+        assert(prog);
+
+        for (x[0] = 0; x[0] < 5; ++x[0]) {
+            for (x[1] = 0; x[1] < 5; ++x[1]) {
+                y = node_program_run(prog, x, 2);
+                assert(y == node_compute(exp, x, 2));
+            }
+        }
+        x[0] = 3;
+        x[1] = 4;
+        y = node_program_run(prog, x, 2);
+        printf("y = %i\n", y);
+        assert(81 == y);
+        assert(node_compute(exp, x, 1) == node_program_run(prog, x, 1));
+
+        node_program_destroy(prog);
+        node_destroy(exp);
+
+        pred = recursion_node_new(zero_node_new(), projection_node_new(1));
+
+        l = node_array_new(2);
+        l[0] = projection_node_new(0);
+        l[1] = NULL;
+
+        monus = recursion_node_new(projection_node_new(0),
+                                   composition_node_new(pred, l));
+
+        j = node_array_new(2);
+        j[0] = zero_node_new();
+        j[1] = NULL;
+
+        iszero = recursion_node_new(composition_node_new(successor_node_new(), j),
+                                    zero_node_new());
+
+        m = node_array_new(3);
+        m[0] = projection_node_new(0);
+        m[1] = projection_node_new(1);
+        m[2] = NULL;
+
+        p = node_array_new(2);
+        p[0] = composition_node_new(monus, m);
+        p[1] = NULL;
+
+        s = search_node_new(composition_node_new(iszero, p));
+
+        prog = node_program_compile(s);
+        assert(prog);
+
+        for (x[0] = 0; x[0] < 6; ++x[0]) {
+            for (x[1] = 0; x[1] < 6; ++x[1]) {
+                y = node_program_run(prog, x, 2);
+                assert(y == node_compute(s, x, 2));
+                assert(y == (x[0] < x[1] ? x[0] : x[1]));
+            }
+        }
+
+        /*
+         *  A search with a negative bound returns the bound.
+         */
+        x[0] = 0;
+        x[1] = -1;
+        assert(-1 == node_compute(s, x, 2));
+        assert(-1 == node_program_run(prog, x, 2));
+
+        node_program_destroy(prog);
+        node_destroy(s);
+    }
+
+    {
+        /*
+         *  Memoized evaluation of f(x, y) = x * y
+         */
+
+        struct node *add, *mult, *s, **g, **h;
+        struct node_memo *memo;
+        int x[2], y;
+
+        g = node_array_new(2);
+        g[0] = projection_node_new(0);
+        g[1] = NULL;
+
+        add = recursion_node_new(projection_node_new(0),
+                                 composition_node_new(successor_node_new(), g));
+
+        h = node_array_new(3);
+        h[0] = projection_node_new(0);
+        h[1] = projection_node_new(1);
+        h[2] = NULL;
+
+        mult = recursion_node_new(zero_node_new(), composition_node_new(add, h));
+
+        memo = node_memo_new(64);
+        assert(memo);
+
+        for (x[0] = 0; x[0] < 8; ++x[0]) {
+            for (x[1] = 0; x[1] < 8; ++x[1]) {
+                y = node_compute_memo(mult, x, 2, memo);
+                assert(y == x[0] * x[1]);
+            }
+        }
+        assert(memo->evictions > 0);
+
+        node_memo_clear(memo);
+        x[0] = 7;
+        x[1] = 9;
+        assert(63 == node_compute_memo(mult, x, 2, memo));
+        assert(0 == memo->hits);
+        assert(63 == node_compute_memo(mult, x, 2, memo));
+        assert(1 == memo->hits);
+
+        /*
+         *  A larger bound resumes from the cached prefix.
+         */
+        x[1] = 10;
+        assert(70 == node_compute_memo(mult, x, 2, memo));
+        assert(2 == memo->hits);
+
+        /*
+         *  A search with a negative bound returns the bound, also cached.
+         */
+        s = search_node_new(zero_node_new());
+        x[0] = 0;
+        x[1] = -1;
+        assert(-1 == node_compute(s, x, 2));
+        assert(-1 == node_compute_memo(s, x, 2, memo));
+        assert(-1 == node_compute_memo(s, x, 2, memo));
+        node_destroy(s);
+
+        node_memo_destroy(memo);
+        node_destroy(mult);
+    }
+
+    {
+        /*
+         *  Arena allocated trees:
+         *
+         *  f(x, y) = x * y
+         */
+
+        struct node_arena *arena, *copies;
+        struct node *mult, *copy;
+        struct buf *b;
+        int x[2] = {6, 7};
+        int i;
+
+        arena = node_arena_new(0);
+        copies = node_arena_new(256);
+
+        b = buf_new(64);
+        buf_append_chars(b, "<0,[<{0},[+,{0}]>,{0},{1}]>");
+        mult = node_unserialize_arena(b, arena);
+        assert(42 == node_compute(mult, x, 2));
+
+        /*
+         *  Cloning more nodes than fit in one block.
+         */
+        for (i = 0; i < 32; ++i) {
+            copy = node_arena_clone(copies, mult);
+            assert(42 == node_compute(copy, x, 2));
+        }
+
+        buf_destroy(b);
+        node_arena_destroy(copies);
+        node_arena_destroy(arena);
+    }
+
+    {
+        /*
+         *  Hash-consed trees:
+         *
+         *  f(x, y) = x ^ y  reuses the nodes of  f(x, y) = x * y
+         */
+
+        struct node_table *table;
+        struct node *mult, *exp, *m, *e;
+        struct node_program *prog;
+        struct buf *b;
+        size_t count;
+        int x[2] = {3, 4};
+
+        table = node_table_new();
+
+        b = buf_new(64);
+        buf_append_chars(b, "<0,[<{0},[+,{0}]>,{0},{1}]>");
+        mult = node_unserialize(b);
+        buf_destroy(b);
+
+        b = buf_new(64);
+        buf_append_chars(b, "<[+,0],[<0,[<{0},[+,{0}]>,{0},{1}]>,{0},{1}]>");
+        exp = node_unserialize(b);
+        buf_destroy(b);
+
+        m = node_table_intern(table, mult);
+        count = table->count;
+        assert(m == node_table_intern(table, mult));
+        node_table_release(table, m);
+        assert(count == table->count);
+
+        e = node_table_intern(table, exp);
+        assert(count + 3 == table->count);
+        assert(m == ((struct node_composition *)
+                     ((struct node_recursion *) e->data)->g->data)->f);
+
+        assert(12 == node_compute(m, x, 2));
+        assert(81 == node_compute(e, x, 2));
+
+        prog = node_program_compile(e);
+        assert(81 == node_program_run(prog, x, 2));
+        node_program_destroy(prog);
+
+        node_table_release(table, m);
+        assert(count + 3 == table->count);
+        node_table_release(table, e);
+        assert(0 == table->count);
+
+        node_table_destroy(table);
+        node_destroy(exp);
+        node_destroy(mult);
+    }
+
+    {
+        /*
+         *  Strength reduction to native kernels
+         */
+
+        static const struct {
+            const char *text;
+            size_t args;
+            int op;
+        } defs[] = {
+            { "<{0},[+,{0}]>",                                         2, KERNEL_ADD },
+            { "<0,{1}>",                                               1, KERNEL_PRED },
+            { "<{0},[<0,{1}>,{0}]>",                                   2, KERNEL_MONUS },
+            { "<[+,0],0>",                                             1, KERNEL_ISZERO },
+            { "<0,[<{0},[+,{0}]>,{0},{1}]>",                           2, KERNEL_MULT },
+            { "<[+,0],[<0,[<{0},[+,{0}]>,{0},{1}]>,{0},{1}]>",         2, KERNEL_EXP },
+            { "<[+,0],[<0,[<{0},[+,{0}]>,{0},{1}]>,{0},[+,{1}]]>",     1, KERNEL_FACT },
+            { "<[+,0],[<0,[<{0},[+,{0}]>,{1},{0}]>,{1},{0}]>",         2, KERNEL_EXP }
+        };
+        struct node *n, *orig;
+        struct node_program *prog;
+        struct buf *b, *c;
+        unsigned int i;
+        int x[3];
+
+        for (i = 0; i < sizeof(defs) / sizeof(defs[0]); ++i) {
+            b = buf_new(64);
+            buf_append_chars(b, defs[i].text);
+            orig = node_unserialize(b);
+            n = node_strength_reduce(node_clone(orig));
+
+            assert(NODE_KERNEL == n->type);
+            assert(defs[i].op == ((struct node_kernel *) n->data)->op);
+
+            c = buf_new(64);
+            node_serialize(n, c);
+            assert(buf_compare(b, c));
+
+            /*
+             *  A negative operand makes the kernel defer to the original tree,
+             *  which passes it on through a projection.
+             */
+            prog = node_program_compile(n);
+            for (x[0] = 0; x[0] < 5; ++x[0]) {
+                for (x[1] = -2; x[1] < 5; ++x[1]) {
+                    for (x[2] = -1; x[2] < 3; ++x[2]) {
+                        assert(node_compute(orig, x, defs[i].args)
+                               == node_compute(n, x, defs[i].args));
+                        assert(node_compute(orig, x, 3) == node_compute(n, x, 3));
+                        assert(node_compute(orig, x, defs[i].args)
+                               == node_program_run(prog, x, defs[i].args));
+                    }
+                }
+            }
+
+            node_program_destroy(prog);
+            buf_destroy(c);
+            buf_destroy(b);
+            node_destroy(orig);
+            node_destroy(n);
+        }
+
+        /*
+         *  Kernels run in time independent of the size of their inputs, and
+         *  overflow is undefined.
+         */
+        b = buf_new(64);
+        buf_append_chars(b, "<[+,0],[<0,[<{0},[+,{0}]>,{0},{1}]>,{0},{1}]>");
+        n = node_strength_reduce(node_unserialize(b));
+        x[0] = 3;
+        x[1] = 19;
+        assert(1162261467 == node_compute(n, x, 2));
+        x[1] = 20;
+        assert(-1 == node_compute(n, x, 2));
+        buf_destroy(b);
+        node_destroy(n);
+    }
+
+    {
+        /*
+         *  Batch evaluation agrees with node_compute() in every lane, including
+         *  lanes with negative arguments and different recursion depths.
+         */
+
+        static const char *defs[] = {
+            "<0,[<{0},[+,{0}]>,{0},{1}]>",
+            "([<[+,0],0>,[<{0},[<0,{1}>,{0}]>,{0},{1}]])",
+            "<{0},[<0,{1}>,{0}]>",
+            "[+,[+,{1}]]"
+        };
+        enum { W = 23, COUNT = W * W };
+        struct node *n;
+        struct buf *b;
+        unsigned int d;
+        int xs[2 * COUNT], out[COUNT], x[2], i;
+
+        for (i = 0; i < COUNT; ++i) {
+            xs[i] = i / W - 1;
+            xs[COUNT + i] = i % W - 1;
+        }
+
+        for (d = 0; d < 2 * sizeof(defs) / sizeof(defs[0]); ++d) {
+            b = buf_new(64);
+            buf_append_chars(b, defs[d / 2]);
+            n = node_unserialize(b);
+            if (d % 2)
+                n = node_strength_reduce(n);
+
+            assert(0 == node_compute_batch(n, xs, 2, COUNT, out));
+            for (i = 0; i < COUNT; ++i) {
+                x[0] = xs[i];
+                x[1] = xs[COUNT + i];
+                assert(out[i] == node_compute(n, x, 2));
+            }
+            assert(0 == node_compute_batch(n, xs, 1, 37, out));
+            for (i = 0; i < 37; ++i)
+                assert(out[i] == node_compute(n, &xs[i], 1));
+
+            buf_destroy(b);
+            node_destroy(n);
+        }
+    }
+
+    {
+        /*
+         *  Parallel search finds the same least witness as the sequential one:
+         *
+         *  s(x, y) = min(x, y)
+         */
+
+        struct node *s;
+        struct buf *b;
+        int x[2];
+
+        b = buf_new(64);
+        buf_append_chars(b, "([<[+,0],0>,[<{0},[<0,{1}>,{0}]>,{0},{1}]])");
+        s = node_unserialize(b);
+
+        for (x[0] = 0; x[0] < 40; x[0] += 3) {
+            for (x[1] = 0; x[1] < 40; x[1] += 5) {
+                assert(node_compute(s, x, 2) == node_compute_parallel(s, x, 2, 4));
+                assert(node_compute(s, x, 2) == node_compute_parallel(s, x, 2, 0));
+            }
+        }
+        x[0] = 17;
+        x[1] = 1000000;
+        assert(17 == node_compute_parallel(s, x, 2, 8));
+        x[0] = -1;
+        assert(-1 == node_compute_parallel(s, x, 2, 8));
+
+        buf_destroy(b);
+        node_destroy(s);
+    }
+
+    {
+        /*
+         *  Wide and arbitrary precision values
+         */
+
+        struct node *mult, *exp, *fact, *succ;
+        struct node_value v[2], y;
+        struct buf *b, *c;
+        int64_t w[2];
+        int x[2];
+
+        b = buf_new(64);
+        buf_append_chars(b, "<0,[<{0},[+,{0}]>,{0},{1}]>");
+        mult = node_unserialize(b);
+        buf_destroy(b);
+
+        b = buf_new(64);
+        buf_append_chars(b, "<[+,0],[<0,[<{0},[+,{0}]>,{0},{1}]>,{0},{1}]>");
+        exp = node_strength_reduce(node_unserialize(b));
+        buf_destroy(b);
+
+        b = buf_new(64);
+        buf_append_chars(b, "<[+,0],[<0,[<{0},[+,{0}]>,{0},{1}]>,{0},[+,{1}]]>");
+        fact = node_strength_reduce(node_unserialize(b));
+        buf_destroy(b);
+
+        b = buf_new(64);
+        buf_append_chars(b, "[+,[+,{0}]]");
+        succ = node_unserialize(b);
+        buf_destroy(b);
+
+        node_value_init(&y, 0);
+        for (x[0] = 0; x[0] < 6; ++x[0]) {
+            for (x[1] = -1; x[1] < 6; ++x[1]) {
+                w[0] = x[0];
+                w[1] = x[1];
+                node_value_init(&v[0], x[0]);
+                node_value_init(&v[1], x[1]);
+                assert(node_compute(mult, x, 2) == node_compute64(mult, w, 2));
+                assert(VALUE_OK == node_compute_value(mult, v, 2, &y));
+                assert(!y.digits && y.word == node_compute(mult, x, 2));
+                assert(node_compute(exp, x, 2) == node_compute64(exp, w, 2));
+                assert(VALUE_OK == node_compute_value(exp, v, 2, &y));
+                assert(!y.digits && y.word == node_compute(exp, x, 2));
+            }
+        }
+
+        w[0] = 3;
+        w[1] = 39;
+        assert(4052555153018976267LL == node_compute64(exp, w, 2));
+        w[1] = 40;
+        assert(-1 == node_compute64(exp, w, 2));
+        w[0] = 20;
+        assert(2432902008176640000LL == node_compute64(fact, w, 1));
+        w[0] = 21;
+        assert(-1 == node_compute64(fact, w, 1));
+        w[0] = INT64_MAX;
+        assert(-1 == node_compute64(succ, w, 1));
+
+        node_value_init(&v[0], 2);
+        node_value_init(&v[1], 100);
+        assert(VALUE_OK == node_compute_value(exp, v, 2, &y));
+        b = buf_new(64);
+        c = buf_new(64);
+        node_value_print(&y, b);
+        buf_append_chars(c, "1267650600228229401496703205376");
+        assert(buf_compare(b, c));
+        buf_destroy(b);
+        buf_destroy(c);
+
+        node_value_init(&v[0], 25);
+        assert(VALUE_OK == node_compute_value(fact, v, 1, &y));
+        b = buf_new(64);
+        c = buf_new(64);
+        node_value_print(&y, b);
+        buf_append_chars(c, "15511210043330985984000000");
+        assert(buf_compare(b, c));
+        buf_destroy(b);
+        buf_destroy(c);
+
+        /*
+         *  Values cross into digits and back through the word.
+         */
+        node_value_init(&v[0], INT64_MAX);
+        assert(VALUE_OK == node_compute_value(succ, v, 1, &y));
+        assert(y.digits);
+        b = buf_new(64);
+        c = buf_new(64);
+        node_value_print(&y, b);
+        buf_append_chars(c, "9223372036854775809");
+        assert(buf_compare(b, c));
+        buf_destroy(b);
+        buf_destroy(c);
+        node_value_clear(&y);
+
+        node_destroy(mult);
+        node_destroy(exp);
+        node_destroy(fact);
+        node_destroy(succ);
+    }
+
+    {
+        /*
+         *  Step budget and profiling
+         */
+
+        struct node *mult, *add, *n;
+        struct node_eval_ctx *ctx;
+        const struct node_profile_entry *e;
+        struct buf *b;
+        int x[2], y;
+
+        b = buf_new(64);
+        buf_append_chars(b, "<0,[<{0},[+,{0}]>,{0},{1}]>");
+        mult = node_unserialize(b);
+        buf_destroy(b);
+        add = ((struct node_composition *)
+               ((struct node_recursion *) mult->data)->g->data)->f;
+
+        ctx = node_eval_ctx_new(NODE_FUEL_UNLIMITED, NODE_PROFILE_VISITS | NODE_PROFILE_TIME);
+        x[0] = 3;
+        x[1] = 4;
+        y = node_compute_ctx(mult, x, 2, ctx);
+        assert(12 == y);
+        assert(NODE_FUEL_UNLIMITED == ctx->fuel);
+
+        e = node_eval_ctx_lookup(ctx, mult);
+        assert(e && 1 == e->visits);
+        e = node_eval_ctx_lookup(ctx, add);
+        assert(e && 4 == e->visits);
+        assert(ctx->max_depth > 2);
+
+        b = buf_new(64);
+        node_eval_ctx_export(ctx, b);
+        assert(b->size > 6 && !strncmp(b->data, "steps\t", 6));
+        buf_destroy(b);
+
+        /*
+         *  The budget is exact: one step less than needed is exhausted.
+         */
+        node_eval_ctx_reset(ctx, ctx->steps);
+        assert(12 == node_compute_ctx(mult, x, 2, ctx));
+        assert(0 == ctx->fuel);
+        node_eval_ctx_reset(ctx, ctx->steps - 1);
+        assert(NODE_EXHAUSTED == node_compute_ctx(mult, x, 2, ctx));
+
+        node_eval_ctx_destroy(ctx);
+
+        ctx = node_eval_ctx_new(1000, 0);
+        x[0] = 1000;
+        x[1] = 1000;
+        assert(NODE_EXHAUSTED == node_compute_ctx(mult, x, 2, ctx));
+        assert(1000 == ctx->steps && !ctx->count);
+        node_eval_ctx_destroy(ctx);
+
+        /*
+         *  A negative argument makes a leg undefined, not the budget run out.
+         */
+        b = buf_new(64);
+        buf_append_chars(b, "[{0},{1}]");
+        n = node_unserialize(b);
+        buf_destroy(b);
+        ctx = node_eval_ctx_new(NODE_FUEL_UNLIMITED, 0);
+        x[0] = 0;
+        x[1] = NODE_EXHAUSTED;
+        assert(-1 == node_compute(n, x, 2));
+        assert(-1 == node_compute_ctx(n, x, 2, ctx));
+        node_eval_ctx_destroy(ctx);
+        node_destroy(n);
+
+        node_destroy(mult);
+    }
+
+    {
+        /*
+         *  Composition legs on a work-stealing pool:
+         *
+         *  f(x, y) = x * y + y * x
+         */
+
+        struct node_thread_pool *pool;
+        struct node *n;
+        struct buf *b;
+        int x[2];
+
+        b = buf_new(64);
+        buf_append_chars(b, "[<{0},[+,{0}]>,<0,[<{0},[+,{0}]>,{0},{1}]>,"
+                            "<0,[<{0},[+,{0}]>,{0},{1}]>]");
+        n = node_unserialize(b);
+        buf_destroy(b);
+
+        pool = node_thread_pool_new(4);
+        assert(pool);
+        for (x[0] = 0; x[0] < 600; x[0] += 150) {
+            for (x[1] = 0; x[1] < 600; x[1] += 120)
+                assert(node_compute(n, x, 2) == node_compute_pool(n, x, 2, pool));
+        }
+        x[0] = 300;
+        x[1] = 400;
+        assert(240000 == node_compute_pool(n, x, 2, pool));
+        x[0] = -1;
+        assert(-1 == node_compute_pool(n, x, 2, pool));
+
+        node_thread_pool_destroy(pool);
+        node_destroy(n);
+    }
+
+    {
+        /*
+         *  Native code agrees with the interpreter
+         */
+
+        static const char *defs[] = {
+            "<{0},[+,{0}]>",
+            "<0,[<{0},[+,{0}]>,{0},{1}]>",
+            "<[+,0],[<0,[<{0},[+,{0}]>,{0},{1}]>,{0},{1}]>",
+            "([<[+,0],0>,[<{0},[<0,{1}>,{0}]>,{0},{1}]])",
+            "[<{0},[+,{0}]>,[+,{1}],0,{0}]",
+            "[{3},{0},{1}]",
+            "<[+,0],[<0,[<{0},[+,{0}]>,{0},{1}]>,{0},[+,{1}]]>"
+        };
+        struct node *n;
+        struct node_jit *jit;
+        struct buf *b;
+        unsigned int d;
+        size_t args;
+        int x[3];
+
+        for (d = 0; d < 2 * sizeof(defs) / sizeof(defs[0]); ++d) {
+            b = buf_new(64);
+            buf_append_chars(b, defs[d / 2]);
+            n = node_unserialize(b);
+            buf_destroy(b);
+            if (d % 2)
+                n = node_strength_reduce(n);
+
+            for (args = 0; args <= 3; ++args) {
+                jit = node_jit_compile(n, args);
+                assert(jit);
+                for (x[0] = -1; x[0] < 5; ++x[0]) {
+                    for (x[1] = -1; x[1] < 5; ++x[1]) {
+                        for (x[2] = 0; x[2] < 4; ++x[2]) {
+                            assert(node_compute(n, x, args) == node_jit_run(jit, x, args));
+                            assert(node_compute(n, x, 2) == node_jit_run(jit, x, 2));
+                        }
+                    }
+                }
+                node_jit_destroy(jit);
+            }
+            node_destroy(n);
+        }
+    }
+
+    {
+        /*
+         *  Specialized trees agree with the original wherever the fixed
+         *  argument has its value, also after a round trip through text, and
+         *  unrolled recursions take far fewer steps.
+         */
+
+        static const struct {
+            const char *text;
+            size_t args;
+            int max;
+        } defs[] = {
+            { "<0,[<{0},[+,{0}]>,{0},{1}]>",                           2, 40 },
+            { "<[+,0],[<0,[<{0},[+,{0}]>,{0},{1}]>,{0},{1}]>",         2, 5 },
+            { "<[+,0],[<0,[<{0},[+,{0}]>,{0},{1}]>,{0},[+,{1}]]>",     1, 5 },
+            { "([<[+,0],0>,[<{0},[<0,{1}>,{0}]>,{0},{1}]])",           2, 40 },
+            { "([<[+,0],0>,[<{0},[<0,{1}>,{0}]>,{2},{1}]])",           3, 40 },
+            { "<{1},[+,[+,{3}]]>",                                     3, 40 },
+            { "[<{0},[+,{0}]>,[+,{1}],{3}]",                           3, 40 }
+        };
+        static const int values[] = { 0, 1, 3, 5, 40 };
+        struct node *n, *r, *t, *m;
+        struct node_table *table;
+        struct node_eval_ctx *ctx;
+        struct node_program *prog;
+        struct buf *b, *c;
+        unsigned int i, j, k, v;
+        int x[3], y[3], before;
+
+        for (i = 0; i < sizeof(defs) / sizeof(defs[0]); ++i) {
+            b = buf_new(64);
+            buf_append_chars(b, defs[i].text);
+            n = node_unserialize(b);
+            buf_destroy(b);
+
+            for (j = 0; j < defs[i].args; ++j) {
+                for (v = 0; v < sizeof(values) / sizeof(values[0]); ++v) {
+                    if (values[v] > defs[i].max)
+                        continue;
+                    r = node_specialize(n, defs[i].args, (int) j, values[v]);
+                    b = buf_new(64);
+                    node_serialize(r, b);
+                    t = node_unserialize(b);
+                    prog = node_program_compile(r);
+                    x[j] = values[v];
+                    for (y[0] = 0; y[0] < 4; ++y[0]) {
+                        for (y[1] = 0; y[1] < 4; ++y[1]) {
+                            for (k = 0; k < defs[i].args; ++k)
+                                if (k != j)
+                                    x[k] = y[k < j ? k : k - 1];
+                            before = node_compute(n, x, defs[i].args);
+                            assert(before == node_compute(r, y, defs[i].args - 1));
+                            assert(before == node_compute(t, y, defs[i].args - 1));
+                            assert(before == node_program_run(prog, y, defs[i].args - 1));
+                        }
+                    }
+                    node_program_destroy(prog);
+                    node_destroy(t);
+                    buf_destroy(b);
+                    node_destroy(r);
+                }
+            }
+            node_destroy(n);
+        }
+
+        /*
+         *  2^y + x, with the power folded away for y = 10
+         */
+        b = buf_new(64);
+        buf_append_chars(b, "[<{0},[+,{0}]>,[<[+,0],[<0,[<{0},[+,{0}]>,{0},{1}]>,{0},{1}]>,[+,[+,0]],{1}],{0}]");
+        n = node_unserialize(b);
+        r = node_specialize(n, 2, 1, 10);
+        ctx = node_eval_ctx_new(NODE_FUEL_UNLIMITED, 0);
+        x[0] = 3;
+        x[1] = 10;
+        assert(1027 == node_compute_ctx(n, x, 2, ctx));
+        before = (int) ctx->steps;
+        node_eval_ctx_reset(ctx, NODE_FUEL_UNLIMITED);
+        assert(1027 == node_compute_ctx(r, x, 1, ctx));
+        assert(100 * ctx->steps < (unsigned long) before);
+        node_eval_ctx_destroy(ctx);
+        node_destroy(r);
+        node_destroy(n);
+        buf_destroy(b);
+
+        /*
+         *  A folded constant is written and shared as one node, however big.
+         */
+        b = buf_new(64);
+        buf_append_chars(b, "[+,{0}]");
+        n = node_unserialize(b);
+        buf_destroy(b);
+        r = node_specialize(n, 1, 0, 10000000);
+        b = buf_new(64);
+        node_serialize(r, b);
+        c = buf_new(64);
+        buf_append_chars(c, "#{10000001}");
+        assert(buf_compare(b, c));
+        buf_destroy(c);
+        t = node_unserialize(b);
+        assert(NODE_KERNEL == t->type);
+        assert(10000001 == node_compute(t, NULL, 0));
+        table = node_table_new();
+        m = node_table_intern(table, r);
+        assert(m == node_table_intern(table, t));
+        assert(NODE_KERNEL == m->type && 1 == table->count);
+        node_table_release(table, m);
+        node_table_release(table, m);
+        node_table_destroy(table);
+        node_destroy(t);
+        node_destroy(r);
+        node_destroy(n);
+        buf_destroy(b);
+    }
+
+    {
+        /*
+         *  Analysis finds the smallest arity and rejects trees that are not
+         *  well-formed; checked evaluation agrees with node_compute() from
+         *  there on up.
+         */
+
+        static const struct {
+            const char *text;
+            int arity;
+        } defs[] = {
+            { "<{0},[+,{0}]>",                                         2 },
+            { "<0,[<{0},[+,{0}]>,{0},{1}]>",                           1 },
+            { "<[+,0],[<0,[<{0},[+,{0}]>,{0},{1}]>,{0},[+,{1}]]>",     1 },
+            { "([<[+,0],0>,[<{0},[<0,{1}>,{0}]>,{0},{1}]])",           2 },
+            { "[<{0},[+,{0}]>,[+,{1}],0,{0}]",                         2 },
+            { "[{3},{0},{1}]",                                         -1 },
+            { "<{2},{4}>",                                             4 },
+            { "[+,X]",                                                 -1 },
+            { "0",                                                     0 }
+        };
+        struct node_composition *comp;
+        struct node *n;
+        struct buf *b;
+        unsigned int i, d;
+        size_t args;
+        int x[4];
+
+        for (d = 0; d < 2 * sizeof(defs) / sizeof(defs[0]); ++d) {
+            i = d / 2;
+            b = buf_new(64);
+            buf_append_chars(b, defs[i].text);
+            n = node_unserialize(b);
+            buf_destroy(b);
+            if (d % 2)
+                n = node_strength_reduce(n);
+
+            assert(defs[i].arity == node_analyze(n));
+            assert(defs[i].arity == node_analyze(n));
+            if (defs[i].arity < 0) {
+                node_destroy(n);
+                continue;
+            }
+            for (args = (size_t) defs[i].arity; args <= 4; ++args) {
+                for (x[0] = -1; x[0] < 4; ++x[0]) {
+                    for (x[1] = 0; x[1] < 4; ++x[1]) {
+                        x[2] = x[1] + 1;
+                        x[3] = x[0] + 2;
+                        assert(node_compute(n, x, args) == node_compute_checked(n, x, args));
+                    }
+                }
+            }
+            node_destroy(n);
+        }
+
+        /*
+         *  After an edit, the cleared tree is analyzed again.
+         */
+        b = buf_new(64);
+        buf_append_chars(b, "[{0},{0}]");
+        n = node_unserialize(b);
+        buf_destroy(b);
+        assert(1 == node_analyze(n));
+        comp = (struct node_composition *) n->data;
+        node_destroy(comp->g[0]);
+        comp->g[0] = projection_node_new(5);
+        assert(1 == node_analyze(n));
+        node_analysis_clear(n);
+        assert(6 == node_analyze(n));
+        node_destroy(n);
+    }
+
+    {
+        /*
+         *  Flat trees evaluate and serialize like the trees they are made of,
+         *  whether those are plain, strength reduced or shared, and convert
+         *  back to an equal tree.
+         */
+
+        static const char *defs[] = {
+            "<{0},[+,{0}]>",
+            "<[+,0],[<0,[<{0},[+,{0}]>,{0},{1}]>,{0},{1}]>",
+            "([<[+,0],0>,[<{0},[<0,{1}>,{0}]>,{0},{1}]])",
+            "[<{0},[+,{0}]>,[+,{1}],0,{0}]",
+            "[<{0},[+,{0}]>,[<{0},[+,{0}]>,{0},{0}],[<{0},[+,{0}]>,{1},{1}]]",
+            "[{3},{0},{1}]"
+        };
+        struct node_table *table;
+        struct node_flat *flat;
+        struct node *n, *m;
+        struct buf *b, *c;
+        unsigned int d;
+        int x[3];
+
+        table = node_table_new();
+        for (d = 0; d < 3 * sizeof(defs) / sizeof(defs[0]); ++d) {
+            b = buf_new(64);
+            buf_append_chars(b, defs[d / 3]);
+            n = node_unserialize(b);
+            if (1 == d % 3) {
+                n = node_strength_reduce(n);
+            } else if (2 == d % 3) {
+                m = node_table_intern(table, n);
+                node_destroy(n);
+                n = m;
+            }
+
+            flat = node_flat_new(n);
+            assert(flat);
+            if (2 == d % 3 && d / 3 == 4)
+                assert(8 == flat->size);
+
+            c = buf_new(64);
+            node_flat_serialize(flat, c);
+            assert(buf_compare(b, c));
+            buf_destroy(c);
+
+            m = node_flat_to_node(flat);
+            c = buf_new(64);
+            node_serialize(m, c);
+            assert(buf_compare(b, c));
+            buf_destroy(c);
+
+            for (x[0] = -1; x[0] < 4; ++x[0]) {
+                for (x[1] = -1; x[1] < 4; ++x[1]) {
+                    for (x[2] = 0; x[2] < 3; ++x[2]) {
+                        assert(node_compute(n, x, 2) == node_flat_compute(flat, x, 2));
+                        assert(node_compute(n, x, 3) == node_flat_compute(flat, x, 3));
+                        assert(node_compute(m, x, 2) == node_flat_compute(flat, x, 2));
+                    }
+                }
+            }
+
+            node_destroy(m);
+            node_flat_destroy(flat);
+            if (2 == d % 3)
+                node_table_release(table, n);
+            else
+                node_destroy(n);
+            buf_destroy(b);
+        }
+        node_table_destroy(table);
+    }
+
+    {
+        /*
+         *  Range evaluation agrees with node_compute() for every value of the
+         *  last argument, with recursion, search and composition at the root,
+         *  negative fixed arguments, and undefined steps part way through.
+         */
+
+        static const char *defs[] = {
+            "<{0},[+,{0}]>",
+            "<0,[<{0},[+,{0}]>,{0},{1}]>",
+            "([<[+,0],0>,[<{0},[<0,{1}>,{0}]>,{0},{1}]])",
+            "[<{0},[+,{0}]>,<{0},[+,{0}]>,([<[+,0],0>,[<{0},[<0,{1}>,{0}]>,{0},{1}]])]",
+            "<{0},[<0,{1}>,{0}]>",
+            "<[+,0],[{5},{0}]>",
+            "[+,{1}]"
+        };
+        enum { LIM = 40 };
+        struct node *n;
+        struct buf *b;
+        unsigned int d;
+        int out[LIM + 1], x[2], k;
+
+        for (d = 0; d < 2 * sizeof(defs) / sizeof(defs[0]); ++d) {
+            b = buf_new(64);
+            buf_append_chars(b, defs[d / 2]);
+            n = node_unserialize(b);
+            if (d % 2)
+                n = node_strength_reduce(n);
+
+            for (x[0] = -1; x[0] < 4; ++x[0]) {
+                assert(0 == node_compute_range(n, x, 2, LIM, out));
+                for (k = 0; k <= LIM; ++k) {
+                    x[1] = k;
+                    assert(out[k] == node_compute(n, x, 2));
+                }
+            }
+            assert(0 == node_compute_range(n, NULL, 1, LIM, out));
+            for (k = 0; k <= LIM; ++k)
+                assert(out[k] == node_compute(n, &k, 1));
+
+            buf_destroy(b);
+            node_destroy(n);
+        }
+    }
+
+    {
+        /*
+         *  Threads share one library of functions, interned and analyzed up
+         *  front, and evaluate and serialize it concurrently, each with its
+         *  own evaluation context.
+         */
+
+        static const char *defs[] = {
+            "<{0},[+,{0}]>",
+            "<0,[<{0},[+,{0}]>,{0},{1}]>",
+            "([<[+,0],0>,[<{0},[<0,{1}>,{0}]>,{0},{1}]])",
+            "<{0},[<0,{1}>,{0}]>",
+            "[<{0},[+,{0}]>,<0,[<{0},[+,{0}]>,{0},{1}]>,{1}]"
+        };
+        enum { FNS = sizeof(defs) / sizeof(defs[0]), W = 12, THREADS = 8 };
+        struct shared_library lib;
+        struct node_table *table;
+        struct node *fns[FNS], *n;
+        struct buf *texts[FNS];
+        pthread_t threads[THREADS];
+        int expected[FNS * W * W], x[2];
+        void *mismatches;
+        size_t f;
+        int t;
+
+        table = node_table_new();
+        for (f = 0; f < FNS; ++f) {
+            texts[f] = buf_new(64);
+            buf_append_chars(texts[f], defs[f]);
+            n = node_unserialize(texts[f]);
+            fns[f] = node_table_intern(table, n);
+            node_destroy(n);
+            assert(node_analyze(fns[f]) >= 0);
+            for (x[0] = 0; x[0] < W; ++x[0])
+                for (x[1] = 0; x[1] < W; ++x[1])
+                    expected[(f * W + x[0]) * W + x[1]] = node_compute(fns[f], x, 2);
+        }
+
+        lib.fns = fns;
+        lib.texts = texts;
+        lib.expected = expected;
+        lib.count = FNS;
+        lib.width = W;
+        for (t = 0; t < THREADS; ++t)
+            assert(0 == pthread_create(&threads[t], NULL, shared_library_worker, &lib));
+        for (t = 0; t < THREADS; ++t) {
+            assert(0 == pthread_join(threads[t], &mismatches));
+            assert(!mismatches);
+        }
+
+        for (f = 0; f < FNS; ++f) {
+            node_table_release(table, fns[f]);
+            buf_destroy(texts[f]);
+        }
+        node_table_destroy(table);
+    }
+
+    {
+        /*
+         *  Tasks run in slices, interleaved round robin, finish with the same
+         *  results as node_compute(), and a cheap task is not held up by an
+         *  expensive one started before it.
+         */
+
+        static const char *defs[] = {
+            "<{0},[+,{0}]>",
+            "<0,[<{0},[+,{0}]>,{0},{1}]>",
+            "([<[+,0],0>,[<{0},[<0,{1}>,{0}]>,{0},{1}]])",
+            "<[+,0],[{5},{0}]>",
+            "[<{0},[+,{0}]>,<0,[<{0},[+,{0}]>,{0},{1}]>,{1}]"
+        };
+        enum { FNS = sizeof(defs) / sizeof(defs[0]), W = 6 };
+        struct node_program *progs[FNS];
+        struct node_task *tasks[FNS * W * W];
+        struct node *fns[FNS];
+        struct buf *b;
+        unsigned long slice;
+        size_t f, t, running;
+        int x[2];
+
+        for (f = 0; f < FNS; ++f) {
+            b = buf_new(64);
+            buf_append_chars(b, defs[f]);
+            fns[f] = node_unserialize(b);
+            progs[f] = node_program_compile(fns[f]);
+            buf_destroy(b);
+        }
+
+        for (slice = 1; slice < 100; slice *= 7) {
+            for (t = 0; t < FNS * W * W; ++t) {
+                x[0] = (int) (t / W % W) - 1;
+                x[1] = (int) (t % W);
+                tasks[t] = node_task_start(progs[t / (W * W)], x, 2);
+                assert(tasks[t]);
+            }
+            do {
+                running = 0;
+                for (t = 0; t < FNS * W * W; ++t)
+                    running += NODE_TASK_YIELDED == node_task_run(tasks[t], slice);
+            } while (running);
+            for (t = 0; t < FNS * W * W; ++t) {
+                x[0] = (int) (t / W % W) - 1;
+                x[1] = (int) (t % W);
+                assert(node_task_result(tasks[t]) == node_compute(fns[t / (W * W)], x, 2));
+                assert(NODE_TASK_DONE == node_task_run(tasks[t], slice));
+                node_task_destroy(tasks[t]);
+            }
+        }
+
+        x[0] = 30;
+        x[1] = 30;
+        tasks[0] = node_task_start(progs[2], x, 2);
+        tasks[1] = node_task_start(progs[0], x, 2);
+        assert(NODE_TASK_YIELDED == node_task_run(tasks[0], 1000));
+        while (NODE_TASK_YIELDED == node_task_run(tasks[1], 1000))
+            ;
+        assert(60 == node_task_result(tasks[1]));
+        assert(node_task_steps(tasks[1]) < node_task_steps(tasks[0]));
+        while (NODE_TASK_YIELDED == node_task_run(tasks[0], 1000))
+            ;
+        assert(30 == node_task_result(tasks[0]));
+        node_task_destroy(tasks[0]);
+        node_task_destroy(tasks[1]);
+
+        for (f = 0; f < FNS; ++f) {
+            node_program_destroy(progs[f]);
+            node_destroy(fns[f]);
+        }
+    }
+
+    {
+        /*
+         *  The pass pipeline rewrites redundant trees into ones that compute
+         *  the same for every argument vector of at least their arity, and
+         *  reports what each pass did.
+         */
+
+        static const struct {
+            const char *def;
+            const char *opt;
+            int pass;
+        } defs[] = {
+            { "[[<{0},[+,{0}]>,{1},{0}],{0},{1}]",
+              "[<{0},+>,{1},{0}]", NODE_PASS_FUSE },
+            { "[[<{0},[+,{0}]>,{2},{2}],{0},[+,{1}],{1}]",
+              "[<{0},+>,{1},{1}]", NODE_PASS_FUSE },
+            { "[{1},<0,[<{0},[+,{0}]>,{0},{1}]>,{0}]",
+              "{0}", NODE_PASS_PROJECT },
+            { "[+,{0},<0,[<{0},[+,{0}]>,{0},{1}]>]",
+              "+", NODE_PASS_PROJECT },
+            { "[<{0},[+,{0}]>,{0},<0,[<{0},[+,{0}]>,{0},{1}]>,{1}]",
+              "[<{0},+>,{0},0,{1}]", NODE_PASS_DEAD_LEGS },
+            { "[<0,[{0},{0},{1},{2}]>,<{0},[+,{0}]>,{1}]",
+              "[<0,{0}>,0,{1}]", NODE_PASS_DEAD_LEGS },
+            { "[+,[+,[+,{1}]]]",
+              "[+,[+,[+,{1}]]]", NODE_PASS_ADD_CONST },
+            { "<[[{0},{1},{0}],0,{0}],[[<{0},[+,{0}]>,{0},{2}],{0},{1},[+,{2}]]>",
+              NULL, -1 },
+            { "([<[+,0],0>,[<{0},[<0,{1}>,{0}]>,{0},{1}]])",
+              NULL, -1 }
+        };
+        struct node_opt_report report;
+        struct node *n, *m;
+        struct buf *b, *c;
+        unsigned int d;
+        int x[3], args, arity, i, pass;
+
+        for (d = 0; d < sizeof(defs) / sizeof(defs[0]); ++d) {
+            b = buf_new(64);
+            buf_append_chars(b, defs[d].def);
+            n = node_unserialize(b);
+            m = node_optimize(node_unserialize(b), NODE_PASSES_ALL, &report);
+
+            if (defs[d].opt) {
+                c = buf_new(64);
+                node_serialize(m, c);
+                buf_destroy(b);
+                b = buf_new(64);
+                buf_append_chars(b, defs[d].opt);
+                assert(buf_compare(b, c));
+                buf_destroy(c);
+            }
+            if (defs[d].pass >= 0)
+                assert(report.changes[defs[d].pass] > 0);
+            for (pass = 0; pass < NODE_PASS_COUNT; ++pass)
+                assert(node_pass_name(pass));
+            assert(report.rounds >= 1);
+
+            arity = node_analyze(n);
+            assert(arity >= 0);
+            for (args = arity ? arity : 1; args <= 3; ++args) {
+                for (i = 0; i < 125; ++i) {
+                    x[0] = i % 5;
+                    x[1] = i / 5 % 5;
+                    x[2] = i / 25;
+                    assert(node_compute(n, x, args) == node_compute(m, x, args));
+                }
+            }
+
+            node_destroy(n);
+            node_destroy(m);
+            buf_destroy(b);
+        }
+
+        /*
+         *  A leg that is no longer read no longer counts for the arity once
+         *  the tree is analyzed again.
+         */
+        b = buf_new(64);
+        buf_append_chars(b, "[{0},{0},{3}]");
+        n = node_unserialize(b);
+        buf_destroy(b);
+        assert(4 == node_analyze(n));
+        n = node_optimize(n, 1 << NODE_PASS_DEAD_LEGS, NULL);
+        assert(1 == node_analyze(n));
+        node_destroy(n);
+    }
+
+    {
+        /*
+         *  Lazy evaluation agrees with node_compute(), and skips legs that are
+         *  never read, here an addition that would count to two billion.
+         */
+
+        static const char *defs[] = {
+            "<{0},[+,{0}]>",
+            "<0,[<{0},[+,{0}]>,{0},{1}]>",
+            "([<[+,0],0>,[<{0},[<0,{1}>,{0}]>,{0},{1}]])",
+            "[<{0},[+,{0}]>,{0},<0,[<{0},[+,{0}]>,{0},{1}]>,{1}]",
+            "[<0,[{0},{0},{1},{2}]>,<{0},[+,{0}]>,{1}]",
+            "[[{1},{0},[+,{1}]],{1},{0}]",
+            "[<{0},[+,{0}]>,[{1},{2},{0}],{0}]"
+        };
+        struct node *n;
+        struct buf *b;
+        unsigned int d;
+        int x[3], args, arity, i;
+
+        for (d = 0; d < 2 * sizeof(defs) / sizeof(defs[0]); ++d) {
+            b = buf_new(64);
+            buf_append_chars(b, defs[d / 2]);
+            n = node_unserialize(b);
+            if (d % 2)
+                n = node_strength_reduce(n);
+            arity = node_analyze(n);
+            assert(arity >= 0);
+            for (args = arity ? arity : 1; args <= 3; ++args) {
+                for (i = 0; i < 125; ++i) {
+                    x[0] = i % 5;
+                    x[1] = i / 5 % 5;
+                    x[2] = i / 25;
+                    assert(node_compute(n, x, args) == node_compute_lazy(n, x, args));
+                }
+            }
+            x[0] = -1;
+            assert(-1 == node_compute_lazy(n, x, 2));
+            buf_destroy(b);
+            node_destroy(n);
+        }
+
+        b = buf_new(64);
+        buf_append_chars(b, "[<{0},[+,{0}]>,{0},<{0},[+,{0}]>,[+,[+,0]]]");
+        n = node_unserialize(b);
+        x[0] = 7;
+        x[1] = 2000000000;
+        assert(9 == node_compute_lazy(n, x, 2));
+        buf_destroy(b);
+        node_destroy(n);
+    }
+
+    {
+        /*
+         *  After one leg of a composition is replaced, a stored set of inputs
+         *  evaluates to what the edited tree computes from scratch, with the
+         *  unchanged legs answered from retained results.
+         *
+         *  f(x, y) = x * y + (y + 1), then x * y + (x + y)
+         */
+
+        enum { W = 6 };
+        struct node_composition *comp;
+        struct node_incr *inc;
+        struct node *n, *m;
+        struct buf *b;
+        unsigned long hits, misses;
+        int x[2], i;
+
+        b = buf_new(64);
+        buf_append_chars(b, "[<{0},[+,{0}]>,<0,[<{0},[+,{0}]>,{0},{1}]>,[+,{1}]]");
+        inc = node_incr_new(node_unserialize(b));
+        buf_destroy(b);
+        b = buf_new(64);
+        buf_append_chars(b, "[<{0},[+,{0}]>,<0,[<{0},[+,{0}]>,{0},{1}]>,<{0},[+,{0}]>]");
+        m = node_unserialize(b);
+        buf_destroy(b);
+
+        for (i = 0; i < W * W; ++i) {
+            x[0] = i / W;
+            x[1] = i % W;
+            assert(x[0] * x[1] + x[1] + 1 == node_incr_compute(inc, x, 2));
+        }
+        hits = inc->hits;
+        misses = inc->misses;
+        for (i = 0; i < W * W; ++i) {
+            x[0] = i / W;
+            x[1] = i % W;
+            assert(x[0] * x[1] + x[1] + 1 == node_incr_compute(inc, x, 2));
+        }
+        assert(W * W == inc->hits - hits && misses == inc->misses);
+
+        comp = (struct node_composition *) inc->root->data;
+        n = projection_node_new(0);
+        assert(-1 == node_incr_replace(inc, &n, n));
+        node_destroy(n);
+
+        b = buf_new(64);
+        buf_append_chars(b, "<{0},[+,{0}]>");
+        assert(0 == node_incr_replace(inc, &comp->g[1], node_unserialize(b)));
+        buf_destroy(b);
+        hits = inc->hits;
+        for (i = 0; i < W * W; ++i) {
+            x[0] = i / W;
+            x[1] = i % W;
+            assert(node_compute(m, x, 2) == node_incr_compute(inc, x, 2));
+        }
+        assert(inc->hits - hits >= W * W);
+
+        /*
+         *  The replacement needs more arguments than the leg it replaces,
+         *  which the next analysis sees.
+         */
+        assert(2 == node_analyze(inc->root));
+        b = buf_new(64);
+        buf_append_chars(b, "{5}");
+        assert(0 == node_incr_replace(inc, &comp->g[0], node_unserialize(b)));
+        buf_destroy(b);
+        assert(6 == node_analyze(inc->root));
+
+        assert(0 == node_incr_replace(inc, &inc->root, m));
+        assert(!inc->count);
+        x[0] = 3;
+        x[1] = 4;
+        assert(19 == node_incr_compute(inc, x, 2));
+        node_incr_destroy(inc);
+    }
+
+    {
+        /*
+         *  Functions described as C++ types, see comp.hpp.
+         */
+
+        comp_hpp_test();
+    }
+
+    {
+        /*
+         *  A binary image reads back as the same tree and evaluates in place
+         *  to what node_compute() returns, also from a mapped file. Images
+         *  that are cut short, carry a wrong header, an unknown opcode or
+         *  trailing bytes are rejected when they are opened.
+         */
+
+        static const char *defs[] = {
+            "<{0},[+,{0}]>",
+            "<0,[<{0},[+,{0}]>,{0},{1}]>",
+            "([<[+,0],0>,[<{0},[<0,{1}>,{0}]>,{0},{1}]])",
+            "[<{0},[+,{0}]>,{0},<0,[<{0},[+,{0}]>,{0},{1}]>,{1}]",
+            "[{130},[+,0]]",
+            "[+,X]"
+        };
+        struct node_image img;
+        struct node *n, *m, **g;
+        struct buf *b, *t, *u;
+        char path[] = "/tmp/kompu-XXXXXX";
+        unsigned int d;
+        size_t k;
+        int x[3], i, fd;
+        char c;
+
+        for (d = 0; d < 2 * sizeof(defs) / sizeof(defs[0]); ++d) {
+            b = buf_new(64);
+            buf_append_chars(b, defs[d / 2]);
+            n = node_unserialize(b);
+            if (d % 2)
+                n = node_strength_reduce(n);
+            buf_destroy(b);
+
+            b = buf_new(64);
+            assert(0 == node_serialize_binary(n, b));
+            assert(0 == node_image_open(&img, b->data, b->size));
+            for (i = 0; i < 125; ++i) {
+                x[0] = i % 5;
+                x[1] = i / 5 % 5;
+                x[2] = i / 25;
+                assert(node_compute(n, x, 3) == node_image_compute(&img, x, 3));
+                assert(node_compute(n, x, 2) == node_image_compute(&img, x, 2));
+            }
+
+            m = node_image_to_node(&img);
+            t = buf_new(64);
+            u = buf_new(64);
+            node_serialize(n, t);
+            node_serialize(m, u);
+            assert(buf_compare(t, u));
+            buf_destroy(t);
+            buf_destroy(u);
+            node_destroy(m);
+
+            for (k = 0; k < b->size; ++k)
+                assert(-1 == node_image_open(&img, b->data, k));
+            for (k = 0; k < 5; ++k) {
+                b->data[k] ^= 1;
+                assert(-1 == node_image_open(&img, b->data, b->size));
+                b->data[k] ^= 1;
+            }
+            b->data[5] ^= 1;
+            assert(-1 == node_image_open(&img, b->data, b->size));
+            b->data[5] ^= 1;
+            c = b->data[7];
+            b->data[7] = 0x7f;
+            assert(-1 == node_image_open(&img, b->data, b->size));
+            b->data[7] = c;
+            buf_append_chars(b, "0");
+            assert(-1 == node_image_open(&img, b->data, b->size));
+            buf_destroy(b);
+            node_destroy(n);
+        }
+
+        /*
+         *  Constants, and a composition of them, mapped from a file.
+         */
+        g = node_array_new(3);
+        g[0] = constant_node_new(300);
+        g[1] = constant_node_new(-1);
+        n = composition_node_new(projection_node_new(0), g);
+        b = buf_new(64);
+        assert(0 == node_serialize_binary(n, b));
+        fd = mkstemp(path);
+        assert(fd >= 0);
+        assert(write(fd, b->data, b->size) == (ssize_t) b->size);
+        close(fd);
+        assert(0 == node_image_map(&img, path));
+        assert(4 == img.nodes);
+        x[0] = 1;
+        assert(-1 == node_image_compute(&img, x, 1));
+        m = node_image_to_node(&img);
+        assert(-1 == node_compute(m, x, 1));
+        node_image_unmap(&img);
+        unlink(path);
+        node_destroy(m);
+        node_destroy(n);
+        buf_destroy(b);
+
+        g = node_array_new(2);
+        g[0] = constant_node_new(300);
+        n = composition_node_new(projection_node_new(0), g);
+        b = buf_new(64);
+        assert(0 == node_serialize_binary(n, b));
+        assert(0 == node_image_open(&img, b->data, b->size));
+        assert(300 == node_image_compute(&img, x, 1));
+        node_destroy(n);
+        buf_destroy(b);
+
+        /*
+         *  The largest constant and the undefined one, on their own.
+         */
+        for (i = 0; i < 2; ++i) {
+            n = constant_node_new(i ? -1 : INT_MAX);
+            b = buf_new(64);
+            assert(0 == node_serialize_binary(n, b));
+            assert(0 == node_image_open(&img, b->data, b->size));
+            assert(node_compute(n, x, 1) == node_image_compute(&img, x, 1));
+            m = node_image_to_node(&img);
+            assert(node_compute(n, x, 1) == node_compute(m, x, 1));
+            node_destroy(m);
+            node_destroy(n);
+            buf_destroy(b);
+        }
+    }
+
+    {
+        /*
+         *  The parser checks the input as it builds the tree, and points at
+         *  the first byte that does not fit. Every proper prefix of a tree is
+         *  cut short at its end. A deep nest is parsed in one pass.
+         */
+
+        static const struct {
+            const char *str;
+            size_t error;
+        } bad[] = {
+            { "",               0 },
+            { "q",              0 },
+            { "[",              1 },
+            { "[+]",            2 },
+            { "[+,0",           4 },
+            { "[+,0]]",         5 },
+            { "<0,0,0>",        4 },
+            { "<0>",            2 },
+            { "(0,0)",          2 },
+            { "{}",             1 },
+            { "{12a}",          3 },
+            { "{9999999999}",  10 },
+            { "0 ",             1 },
+            { "#5",             1 },
+            { "#{}",            2 }
+        };
+        static const char *good = "[([<[+,0],0>,[<{0},[<0,{1}>,{0}]>,{0},{1}]]),{2147483647},X,#{7}]";
+        enum { DEPTH = 10000 };
+        struct node *n;
+        struct buf *b, *t;
+        size_t error, k;
+        unsigned int d;
+        int x[1];
+
+        for (d = 0; d < sizeof(bad) / sizeof(bad[0]); ++d) {
+            b = buf_new(64);
+            buf_append_chars(b, bad[d].str);
+            error = (size_t) -1;
+            assert(!node_parse(b, NULL, &error));
+            assert(bad[d].error == error);
+            assert(SERIAL_DATA_INVALID == node_serial_data_is_valid(b));
+            buf_destroy(b);
+        }
+
+        b = buf_new(64);
+        buf_append_chars(b, good);
+        assert(SERIAL_DATA_OK == node_serial_data_is_valid(b));
+        n = node_parse(b, NULL, NULL);
+        t = buf_new(64);
+        node_serialize(n, t);
+        assert(buf_compare(b, t));
+        buf_destroy(t);
+        node_destroy(n);
+        for (k = 0; k < b->size; ++k) {
+            t = buf_new(64);
+            buf_append(t, b->data, k);
+            assert(!node_parse(t, NULL, &error) && k == error);
+            buf_destroy(t);
+        }
+        buf_destroy(b);
+
+        b = buf_new(64 * 1024);
+        for (d = 0; d < DEPTH; ++d)
+            buf_append_chars(b, "[+,");
+        buf_append_chars(b, "0");
+        for (d = 0; d < DEPTH; ++d)
+            buf_append_chars(b, "]");
+        n = node_parse(b, NULL, NULL);
+        x[0] = 0;
+        assert(DEPTH == node_compute(n, x, 1));
+        node_destroy(n);
+        buf_destroy(b);
+
+        /*
+         *  A partial tree too deep for node_destroy() is still released.
+         */
+        b = buf_new(1024 * 1024);
+        for (d = 0; d < 100 * DEPTH; ++d)
+            buf_append_chars(b, "[+,");
+        buf_append_chars(b, "0");
+        for (d = 0; d < 50 * DEPTH; ++d)
+            buf_append_chars(b, "]");
+        assert(!node_parse(b, NULL, &error) && b->size == error);
+        buf_destroy(b);
+    }
+
+    {
+        /*
+         *  A stream hands out each tree as it closes, however the input is
+         *  cut into pieces, and reads a pipe whose contents are many times
+         *  the size of one read.
+         */
+
+        static const char *defs[] = {
+            "<{0},[+,{0}]>",
+            "0",
+            "[<{0},[+,{0}]>,{0},<0,[<{0},[+,{0}]>,{0},{1}]>,{1}]",
+            "({12})",
+            "X"
+        };
+        static const size_t pieces[] = { 1, 2, 3, 7, 4096 };
+        struct node_stream *s;
+        struct buf *in, *want, *got, *big;
+        pthread_t writer;
+        void *warg[2];
+        size_t k, len;
+        unsigned int d, r;
+        int fds[2];
+
+        in = buf_new(64);
+        want = buf_new(64);
+        for (d = 0; d < sizeof(defs) / sizeof(defs[0]); ++d) {
+            buf_append_chars(in, d % 2 ? " \n" : "\n");
+            buf_append_chars(in, defs[d]);
+            buf_append_chars(want, defs[d]);
+            buf_append_chars(want, ";");
+        }
+        buf_append_chars(in, "\n");
+
+        for (d = 0; d < sizeof(pieces) / sizeof(pieces[0]); ++d) {
+            s = node_stream_new();
+            got = buf_new(64);
+            for (k = 0; k < in->size; k += len) {
+                len = in->size - k < pieces[d] ? in->size - k : pieces[d];
+                assert(0 == node_stream_feed(s, in->data + k, len, stream_collect, got));
+            }
+            assert(0 == node_stream_finish(s));
+            assert(in->size == node_stream_offset(s));
+            assert(buf_compare(want, got));
+            buf_destroy(got);
+            node_stream_destroy(s);
+        }
+
+        big = buf_new(64 * 1024);
+        for (r = 0; r < 4096; ++r)
+            buf_append(big, in->data, in->size);
+        buf_destroy(in);
+        in = big;
+        big = buf_new(64 * 1024);
+        for (r = 0; r < 4096; ++r)
+            buf_append(big, want->data, want->size);
+        buf_destroy(want);
+        want = big;
+        assert(in->size > 4 * NODE_STREAM_CHUNK);
+        assert(0 == pipe(fds));
+        warg[0] = in;
+        warg[1] = &fds[1];
+        assert(0 == pthread_create(&writer, NULL, stream_writer, warg));
+        s = node_stream_new();
+        got = buf_new(64 * 1024);
+        assert(0 == node_stream_read(s, fds[0], stream_collect, got));
+        pthread_join(writer, NULL);
+        close(fds[0]);
+        assert(buf_compare(want, got));
+        buf_destroy(got);
+        node_stream_destroy(s);
+        buf_destroy(want);
+        buf_destroy(in);
+
+        s = node_stream_new();
+        got = buf_new(64);
+        assert(-1 == node_stream_feed(s, "0 [+,0] [+]0", 12, stream_collect, got));
+        assert(10 == node_stream_offset(s));
+        assert(-1 == node_stream_feed(s, "0", 1, stream_collect, got));
+        assert(-1 == node_stream_finish(s));
+        in = buf_new(64);
+        buf_append_chars(in, "0;[+,0];");
+        assert(buf_compare(in, got));
+        buf_destroy(in);
+        buf_destroy(got);
+        node_stream_destroy(s);
+
+        s = node_stream_new();
+        got = buf_new(64);
+        assert(0 == node_stream_feed(s, "0\n[+,", 5, stream_collect, got));
+        assert(-1 == node_stream_finish(s));
+        assert(5 == node_stream_offset(s));
+        buf_destroy(got);
+        node_stream_destroy(s);
+    }
+
     // divisibility, primes etc. !?
 
     printf("-------------------------\n"